@@ -166,8 +166,41 @@ void AcnetTask::pingHandler(rpyid_t id)
     sendLastReply(id, ACNET_SUCCESS, &pingRet, sizeof(pingRet));
 }
 
-void AcnetTask::taskResourcesHandler(rpyid_t id)
+// Subtype 0 reports the task pool's resources. Subtype 1 reports the
+// request and reply ID pools: each one's size, IDs in use, most IDs
+// ever in use, and the times it ran out. Subtype 2 reports the IDs
+// each task holds and has been refused by its quota.
+
+void AcnetTask::taskResourcesHandler(rpyid_t id, uint8_t subType)
 {
+    if (subType == 1) {
+	struct {
+	    uint16_t size;
+	    uint16_t active;
+	    uint16_t maxActive;
+	    uint32_t exhausted;
+	} __attribute__((packed)) rpy[2];
+
+	rpy[0].size = htoas((uint16_t) taskPool().reqPool.capacity());
+	rpy[0].active = htoas((uint16_t) taskPool().reqPool.activeIdCount());
+	rpy[0].maxActive = htoas((uint16_t) taskPool().reqPool.maxActiveIdCount());
+	rpy[0].exhausted = htoal((uint32_t) taskPool().reqPool.exhaustedCount());
+	rpy[1].size = htoas((uint16_t) taskPool().rpyPool.capacity());
+	rpy[1].active = htoas((uint16_t) taskPool().rpyPool.activeIdCount());
+	rpy[1].maxActive = htoas((uint16_t) taskPool().rpyPool.maxActiveIdCount());
+	rpy[1].exhausted = htoal((uint32_t) taskPool().rpyPool.exhaustedCount());
+
+	sendLastReply(id, ACNET_SUCCESS, rpy, sizeof(rpy));
+	return;
+    }
+
+    if (subType == 2) {
+	uint8_t rpy[INTERNAL_ACNET_USER_PACKET_SIZE];
+
+	sendLastReply(id, ACNET_SUCCESS, rpy, taskPool().fillBufferWithTaskIdUsage(rpy));
+	return;
+    }
+
     uint16_t rpy[5];
 
     rpy[0] = htoas(0);
@@ -558,7 +591,7 @@ bool AcnetTask::sendDataToClient(AcnetHeader const* hdr)
 		break;
 
 	     case 5:
-		taskResourcesHandler(id);
+		taskResourcesHandler(id, subType);
 		break;
 
 	     case 6:
@@ -0,0 +1,134 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <iostream>
+#include "acnetclient.h"
+
+// acnetbench measures request throughput and latency through a local
+// acnetd. It connects an echo server task and a client task over one
+// AcnetClient, keeps a window of requests in flight from the client
+// to the server and reports the request rate and the round trip
+// latencies once all requests have been answered.
+
+using std::chrono::steady_clock;
+
+static void usage(char const* prog)
+{
+    std::cerr << "usage: " << prog << " [-n requests] [-w window] [-s size] [-o options]\n"
+	"  -n requests\tnumber of requests to send (default 100000)\n"
+	"  -w window\tnumber of requests in flight (default 64)\n"
+	"  -s size\tpayload size in bytes (default 16)\n"
+	"  -o options\tconnection options to ask for (default 0x" << std::hex << AcnetClient::DEFAULT_OPTIONS <<
+	std::dec << ")\n";
+    exit(1);
+}
+
+static double percentile(std::vector<int64_t> const& v, double p)
+{
+    return v.empty() ? 0.0 : v[std::min(v.size() - 1, (size_t) (p * v.size()))] / 1000.0;
+}
+
+int main(int argc, char** argv)
+{
+    size_t count = 100000;
+    size_t window = 64;
+    size_t size = 16;
+    uint32_t options = AcnetClient::DEFAULT_OPTIONS;
+    int ch;
+
+    while (-1 != (ch = getopt(argc, argv, "n:w:s:o:")))
+	switch (ch) {
+	 case 'n':
+	    count = strtoul(optarg, 0, 0);
+	    break;
+
+	 case 'w':
+	    window = std::max(strtoul(optarg, 0, 0), 1ul);
+	    break;
+
+	 case 's':
+	    size = strtoul(optarg, 0, 0);
+	    break;
+
+	 case 'o':
+	    options = strtoul(optarg, 0, 0);
+	    break;
+
+	 default:
+	    usage(argv[0]);
+	}
+
+    if (optind != argc || size > INTERNAL_ACNET_USER_PACKET_SIZE)
+	usage(argv[0]);
+
+    taskhandle_t const server(ator("BNCHS"));
+    taskhandle_t const client(ator("BNCHC"));
+
+    try {
+	AcnetClient acnet;
+
+	uint32_t const srvOptions = acnet.connect(server, options);
+	uint32_t const clnOptions = acnet.connect(client, options);
+	trunknode_t const node = acnet.localNode();
+
+	acnet.receiveRequests(server, [&acnet, server](rpyid_t rpyid, AcnetHeader const&, uint8_t const* data, size_t n) {
+		acnet.sendReply(server, rpyid, data, n, true);
+	    });
+
+	size_t errors = 0;
+	acnet.setErrorHandler([&errors](status_t, rpyid_t) { ++errors; });
+
+	std::vector<uint8_t> const payload(size, 0x5a);
+	std::vector<int64_t> latency;
+	size_t sent = 0;
+	size_t done = 0;
+
+	latency.reserve(count);
+
+	steady_clock::time_point const start = steady_clock::now();
+
+	while (done < count) {
+	    while (sent < count && sent - done < window) {
+		steady_clock::time_point const t0 = steady_clock::now();
+
+		acnet.sendRequest(client, server, node, payload.data(), payload.size(), false,
+				  [&, t0](reqid_t, status_t status, uint8_t const*, size_t, bool last) {
+				      if (status.isFatal())
+					  ++errors;
+				      if (last) {
+					  latency.push_back(std::chrono::duration_cast<std::chrono::microseconds>
+							    (steady_clock::now() - t0).count());
+					  ++done;
+				      }
+				  });
+		++sent;
+	    }
+	    (void) acnet.poll(1000);
+	}
+
+	double const secs = std::chrono::duration<double>(steady_clock::now() - start).count();
+
+	std::sort(latency.begin(), latency.end());
+
+	printf("options: server 0x%x, client 0x%x\n", srvOptions, clnOptions);
+	printf("%zu requests (%zu byte payload, window %zu) in %.3f s: %.0f req/s, %zu errors\n",
+	       count, size, window, secs, count / secs, errors);
+	printf("latency (ms): p50 %.3f, p99 %.3f, max %.3f\n", percentile(latency, 0.50), percentile(latency, 0.99),
+	       latency.empty() ? 0.0 : latency.back() / 1000.0);
+    }
+    catch (status_t const& s) {
+	fprintf(stderr, "ACNET error %d\n", s.raw());
+	return 1;
+    }
+    catch (std::exception const& e) {
+	fprintf(stderr, "%s\n", e.what());
+	return 1;
+    }
+    return 0;
+}
+
+// Local Variables:
+// mode:c++
+// fill-column:125
+// End:
@@ -0,0 +1,726 @@
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <algorithm>
+#include <new>
+#include "acnetclient.h"
+
+// The largest number of commands held in the outgoing queue. The
+// queue is flushed early when it fills, which also bounds how many
+// datagrams are handed to one sendmmsg() call.
+
+#define MAX_OUTGOING	64
+
+static int64_t steadyMillis()
+{
+    using namespace std::chrono;
+
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static std::runtime_error systemError(char const* what)
+{
+    return std::runtime_error(std::string(what) + ": " + strerror(errno));
+}
+
+static int openSocket(sockaddr_in* dst)
+{
+    int const s = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (-1 == s)
+	throw systemError("couldn't create socket");
+
+    sockaddr_in in;
+
+    memset(&in, 0, sizeof(in));
+    in.sin_family = AF_INET;
+    in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (-1 == bind(s, (sockaddr*) &in, sizeof(in)) ||
+	(dst && -1 == ::connect(s, (sockaddr*) dst, sizeof(*dst)))) {
+	std::runtime_error const e = systemError("couldn't bind socket");
+
+	close(s);
+	throw e;
+    }
+    return s;
+}
+
+AcnetClient::AcnetClient(nodename_t vNode, int ackTimeout) :
+    vNode(vNode), ackTimeout(ackTimeout), sCmd(-1), sData(-1), nextSeq(0), pendingRequests(0),
+    cmdBuf(64 * 1024), rxBuf(64 * 1024)
+{
+    sockaddr_in in;
+
+    memset(&in, 0, sizeof(in));
+    in.sin_family = AF_INET;
+    in.sin_port = htons(ACNET_CLIENT_PORT);
+    in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    sCmd = openSocket(&in);
+
+    try {
+	sData = openSocket(0);
+    }
+    catch (...) {
+	close(sCmd);
+	throw;
+    }
+
+    // A deep receive queue lets acnetd run ahead of us when replies
+    // arrive in bursts.
+
+    int const v = 4 * 1024 * 1024;
+
+    (void) setsockopt(sData, SOL_SOCKET, SO_RCVBUF, &v, sizeof(v));
+}
+
+AcnetClient::~AcnetClient()
+{
+    while (!tasks.empty())
+	try {
+	    disconnect(tasks.begin()->first);
+	}
+	catch (...) {
+	}
+
+    close(sData);
+    close(sCmd);
+}
+
+AcnetClient::Task& AcnetClient::getTask(taskhandle_t handle)
+{
+    auto const ii = tasks.find(handle);
+
+    if (ii == tasks.end())
+	throw ACNET_NCN;
+    return ii->second;
+}
+
+uint32_t AcnetClient::connect(taskhandle_t handle, uint32_t options)
+{
+    {
+	auto const ii = tasks.find(handle);
+
+	if (ii != tasks.end())
+	    return ii->second.options;
+    }
+
+    sockaddr_in in;
+    socklen_t len = sizeof(in);
+
+    if (-1 == getsockname(sData, (sockaddr*) &in, &len))
+	throw systemError("couldn't get data port");
+
+    ConnectCommand cmd;
+
+    cmd.setClientName(handle);
+    cmd.setPid(getpid());
+    cmd.setDataPort(ntohs(in.sin_port));
+
+    std::vector<uint8_t> const ack = transact(0, cmd, sizeof(cmd));
+    AckConnect const* const ackCon = (AckConnect const*) ack.data();
+
+    if (ackCon->status().isFatal())
+	throw ackCon->status();
+    if (ack.size() < sizeof(AckConnect))
+	throw ACNET_IVM;
+
+    Task& task = tasks[handle];
+
+    task.handle = handle;
+    task.id = ackCon->taskId().raw();
+    task.options = 0;
+
+    // An acnetd that knows about CONN_M_ERRACKS also knows about
+    // CONN_M_PIPELINE, so it's enough to not ask for the former
+    // without the latter.
+
+    if (!(options & CONN_M_PIPELINE))
+	options &= ~CONN_M_ERRACKS;
+
+    if (options) {
+	SetOptionsCommand cmd;
+
+	cmd.setOptions(options);
+
+	std::vector<uint8_t> const ack = transact(&task, cmd, sizeof(cmd));
+	AckSetOptions const* const ackOpt = (AckSetOptions const*) ack.data();
+
+	// Older acnetd's reject the command; that simply means none
+	// of the options are available.
+
+	if (!ackOpt->status().isFatal() && ack.size() >= sizeof(AckSetOptions))
+	    task.options = ackOpt->options();
+    }
+    return task.options;
+}
+
+void AcnetClient::disconnect(taskhandle_t handle)
+{
+    Task& task = getTask(handle);
+    uint16_t const id = task.id;
+    DisconnectSingleCommand cmd;
+
+    try {
+	(void) transact(&task, cmd, sizeof(cmd));
+    }
+    catch (...) {
+	tasks.erase(handle);
+	throw;
+    }
+    tasks.erase(handle);
+
+    for (auto ii = requests.begin(); ii != requests.end();)
+	if (ii->second.taskId == id)
+	    requests.erase(ii++);
+	else
+	    ++ii;
+}
+
+trunknode_t AcnetClient::localNode()
+{
+    LocalNodeCommand cmd;
+    std::vector<uint8_t> const ack = transact(0, cmd, sizeof(cmd));
+    AckNameLookup const* const ackNode = (AckNameLookup const*) ack.data();
+
+    if (ackNode->status().isFatal())
+	throw ackNode->status();
+    if (ack.size() < sizeof(AckNameLookup))
+	throw ACNET_IVM;
+    return ackNode->trunkNode();
+}
+
+void AcnetClient::sendRequest(taskhandle_t handle, taskhandle_t target, trunknode_t node, void const* data, size_t n,
+			      bool mult, ReplyHandler onReply)
+{
+    Task& task = getTask(handle);
+    uint16_t const id = task.id;
+    SendRequestCommand cmd;
+
+    if (n > INTERNAL_ACNET_USER_PACKET_SIZE)
+	throw ACNET_INVARG;
+
+    cmd.setTask(target);
+    cmd.setAddr(node);
+    cmd.setFlags(mult ? REQ_M_MULTRPY : 0);
+
+    ++pendingRequests;
+    command(task, cmd, sizeof(cmd), data, n, [this, id, onReply](AckHeader const* ack, size_t len) {
+	    --pendingRequests;
+
+	    status_t const status = len < sizeof(AckSendRequest) && !ack->status().isFatal() ?
+		ACNET_IVM : ack->status();
+
+	    if (status.isFatal())
+		onReply(reqid_t(), status, 0, 0, true);
+	    else {
+		Request& req = requests[((AckSendRequest const*) ack)->requestId().raw()];
+
+		req.taskId = id;
+		req.onReply = onReply;
+	    }
+	});
+}
+
+// Sends the same request to each node of the list with a single
+// command. Nodes that couldn't be sent the request are reported to the
+// handler with their error status.
+
+void AcnetClient::sendRequests(taskhandle_t handle, taskhandle_t target, trunknode_t const* nodes, size_t count,
+			       void const* data, size_t n, bool mult, ScatterHandler onReply, uint32_t tmo)
+{
+    Task& task = getTask(handle);
+    uint16_t const id = task.id;
+
+    if (!count || count > MAX_REQUEST_FANOUT || n > INTERNAL_ACNET_USER_PACKET_SIZE)
+	throw ACNET_INVARG;
+
+    std::vector<uint8_t> buf(sizeof(SendRequestsCommand) + count * sizeof(uint16_t));
+    SendRequestsCommand* const cmd = new (buf.data()) SendRequestsCommand();
+
+    cmd->setTask(target);
+    cmd->setFlags(mult ? REQ_M_MULTRPY : 0);
+    cmd->setTimeout(tmo);
+    cmd->setCount((uint16_t) count);
+    for (size_t ii = 0; ii < count; ++ii)
+	cmd->setAddr(ii, nodes[ii]);
+
+    pendingRequests += count;
+    command(task, *cmd, buf.size(), data, n, [this, id, count, onReply](AckHeader const* ack, size_t len) {
+	    AckSendRequests const* const acks = (AckSendRequests const*) ack;
+	    size_t const total = len >= sizeof(AckHeader) + sizeof(uint16_t) ?
+		std::min((size_t) acks->count(), (len - sizeof(AckHeader) - sizeof(uint16_t)) / 4) : 0;
+
+	    pendingRequests -= count;
+
+	    for (size_t ii = 0; ii < count; ++ii) {
+		status_t const status = ii < total ? acks->status(ii) : (ack->status().isFatal() ? ack->status() : ACNET_IVM);
+
+		if (status.isFatal())
+		    onReply(ii, reqid_t(), status, 0, 0, true);
+		else {
+		    Request& req = requests[acks->requestId(ii).raw()];
+
+		    req.taskId = id;
+		    req.onReply = [ii, onReply](reqid_t reqid, status_t status, uint8_t const* data, size_t n, bool last) {
+			onReply(ii, reqid, status, data, n, last);
+		    };
+		}
+	    }
+	});
+}
+
+// Replies that are already on their way are dropped when they show up,
+// since the request is no longer in the table.
+
+void AcnetClient::cancel(taskhandle_t handle, reqid_t reqid)
+{
+    CancelCommand cmd;
+
+    cmd.setReqid(reqid);
+    requests.erase(reqid.raw());
+    command(getTask(handle), cmd, sizeof(cmd), 0, 0, [this](AckHeader const* ack, size_t len) {
+	    reportFailure(ack, len);
+	});
+}
+
+void AcnetClient::receiveRequests(taskhandle_t handle, RequestHandler onRequest, CancelHandler onCancel)
+{
+    Task& task = getTask(handle);
+    ReceiveRequestCommand cmd;
+    std::vector<uint8_t> const ack = transact(&task, cmd, sizeof(cmd));
+
+    if (((AckHeader const*) ack.data())->status().isFatal())
+	throw ((AckHeader const*) ack.data())->status();
+
+    task.onRequest = onRequest;
+    task.onCancel = onCancel;
+}
+
+void AcnetClient::sendReply(taskhandle_t handle, rpyid_t rpyid, void const* data, size_t n, bool last, status_t status)
+{
+    Task& task = getTask(handle);
+    SendReplyCommand cmd;
+
+    if (n > INTERNAL_ACNET_USER_PACKET_SIZE)
+	throw ACNET_INVARG;
+
+    cmd.setRpyid(rpyid);
+    cmd.setFlags(last ? RPY_M_ENDMULT : 0);
+    cmd.setStatus(status);
+
+    // With CONN_M_ERRACKS, successful replies aren't acked at all so
+    // there's nothing to wait for; failures show up as unsolicited
+    // acks which carry the reply ID.
+
+    if (task.options & CONN_M_ERRACKS)
+	command(task, cmd, sizeof(cmd), data, n, AckHandler());
+    else
+	command(task, cmd, sizeof(cmd), data, n, [this, rpyid](AckHeader const* ack, size_t) {
+		if (ack->status().isFatal() && onError)
+		    onError(ack->status(), rpyid);
+	    });
+}
+
+void AcnetClient::sendReplies(taskhandle_t handle, rpyid_t const* rpyids, size_t count, void const* data, size_t n,
+			      bool last, status_t status)
+{
+    Task& task = getTask(handle);
+
+    if (!count || count > MAX_REPLY_FANOUT || n > INTERNAL_ACNET_USER_PACKET_SIZE)
+	throw ACNET_INVARG;
+
+    std::vector<uint8_t> buf(sizeof(SendRepliesCommand) + count * sizeof(uint16_t));
+    SendRepliesCommand* const cmd = new (buf.data()) SendRepliesCommand();
+
+    cmd->setFlags(last ? RPY_M_ENDMULT : 0);
+    cmd->setStatus(status);
+    cmd->setCount((uint16_t) count);
+    for (size_t ii = 0; ii < count; ++ii)
+	cmd->setRpyid(ii, rpyids[ii]);
+
+    if (task.options & CONN_M_ERRACKS)
+	command(task, *cmd, buf.size(), data, n, AckHandler());
+    else {
+	std::vector<rpyid_t> const ids(rpyids, rpyids + count);
+
+	command(task, *cmd, buf.size(), data, n, [this, ids](AckHeader const* ack, size_t len) {
+		AckSendReplies const* const acks = (AckSendReplies const*) ack;
+
+		if (!onError)
+		    return;
+		if (len < sizeof(AckHeader) + sizeof(uint16_t) || !acks->count())
+		    reportFailure(ack, len);
+		else
+		    for (size_t ii = 0; ii < acks->count() && ii < ids.size(); ++ii)
+			if (acks->status(ii).isFatal())
+			    onError(acks->status(ii), ids[ii]);
+	    });
+    }
+}
+
+void AcnetClient::grantCredits(taskhandle_t handle, uint32_t credits)
+{
+    Task& task = getTask(handle);
+    GrantCreditsCommand cmd;
+
+    cmd.setCredits(credits);
+
+    if (task.options & CONN_M_ERRACKS)
+	command(task, cmd, sizeof(cmd), 0, 0, AckHandler());
+    else
+	command(task, cmd, sizeof(cmd), 0, 0, [this](AckHeader const* ack, size_t len) {
+		reportFailure(ack, len);
+	    });
+}
+
+// Reports a failed command to the error handler. This is used for
+// acks that nobody is waiting for, so the reply ID is only known if
+// the ack is an AckSendReply.
+
+void AcnetClient::reportFailure(AckHeader const* ack, size_t len)
+{
+    if (onError && ack->status().isFatal()) {
+	if (ack->cmd() == AckList::ackSendReply && len >= sizeof(AckSendReply))
+	    onError(ack->status(), ((AckSendReply const*) ack)->replyId());
+	else
+	    onError(ack->status(), rpyid_t());
+    }
+}
+
+// Sends a command for a connected task. Pipelined tasks tag the
+// command with a sequence number and queue it; the ack handler (if
+// any) is called when the matching entry of an AckBatch arrives.
+// Lock-step tasks send the command right away and call the handler
+// with the ack.
+
+void AcnetClient::command(Task& task, CommandHeader& hdr, size_t len, void const* data, size_t n, AckHandler onAck)
+{
+    hdr.setClientName(task.handle);
+    hdr.setVirtualNodeName(vNode);
+
+    if (task.options & CONN_M_PIPELINE) {
+	uint16_t const seq = nextSeq++;
+	uint16_t const tmp = htons(seq);
+
+	outgoing.push_back(std::vector<uint8_t>());
+
+	std::vector<uint8_t>& buf = outgoing.back();
+
+	buf.reserve(len + n + sizeof(tmp));
+	buf.insert(buf.end(), (uint8_t const*) &hdr, (uint8_t const*) &hdr + len);
+	buf.insert(buf.end(), (uint8_t const*) data, (uint8_t const*) data + n);
+	buf.insert(buf.end(), (uint8_t const*) &tmp, (uint8_t const*) &tmp + sizeof(tmp));
+
+	if (onAck)
+	    pendingAcks[seq] = onAck;
+	if (outgoing.size() >= MAX_OUTGOING)
+	    flush();
+    } else {
+	std::vector<uint8_t> const ack = transact(0, hdr, len, data, n);
+
+	if (onAck)
+	    onAck((AckHeader const*) ack.data(), ack.size());
+    }
+}
+
+// Sends a command and waits for its ack, which is returned. A null
+// task sends a command that doesn't need a connection (or the
+// command of a lock-step task, whose header has already been filled
+// in.) Acks of pipelined commands that show up in the meantime are
+// dispatched as usual.
+
+std::vector<uint8_t> AcnetClient::transact(Task* task, CommandHeader& hdr, size_t len, void const* data, size_t n)
+{
+    std::vector<uint8_t> result;
+    int64_t const deadline = steadyMillis() + ackTimeout;
+
+    if (task && (task->options & CONN_M_PIPELINE)) {
+	bool done = false;
+	uint16_t const seq = nextSeq;
+
+	command(*task, hdr, len, data, n, [&result, &done](AckHeader const* ack, size_t n) {
+		result.assign((uint8_t const*) ack, (uint8_t const*) ack + n);
+		done = true;
+	    });
+	flush();
+
+	while (!done) {
+	    size_t const len = readAck(std::max(deadline - steadyMillis(), int64_t(0)));
+
+	    if (!len) {
+		pendingAcks.erase(seq);
+		throw ACNET_TMO;
+	    }
+	    handleAck(cmdBuf.data(), len);
+	}
+    } else {
+	if (task)
+	    hdr.setClientName(task->handle);
+	hdr.setVirtualNodeName(vNode);
+
+	// Anything queued has to go out first to preserve the order
+	// of the commands.
+
+	flush();
+
+	std::vector<uint8_t> buf((uint8_t const*) &hdr, (uint8_t const*) &hdr + len);
+
+	buf.insert(buf.end(), (uint8_t const*) data, (uint8_t const*) data + n);
+	if (-1 == send(sCmd, buf.data(), buf.size(), 0))
+	    throw systemError("couldn't send command");
+
+	while (true) {
+	    size_t const len = readAck(std::max(deadline - steadyMillis(), int64_t(0)));
+
+	    if (!len)
+		throw ACNET_TMO;
+	    if (len >= sizeof(AckHeader) && ((AckHeader const*) cmdBuf.data())->cmd() == AckList::ackBatch)
+		handleAck(cmdBuf.data(), len);
+	    else {
+		result.assign(cmdBuf.begin(), cmdBuf.begin() + len);
+		break;
+	    }
+	}
+    }
+
+    // Callers look at the status of the ack, so make sure there's one
+    // to look at.
+
+    if (result.size() < sizeof(AckHeader)) {
+	Ack ack;
+
+	ack.setStatus(ACNET_IVM);
+	result.assign((uint8_t const*) &ack, (uint8_t const*) &ack + sizeof(ack));
+    }
+    return result;
+}
+
+// Waits up to 'tmo' milliseconds for a datagram on the command socket
+// and reads it into cmdBuf. Returns its length or 0 if none arrived.
+
+size_t AcnetClient::readAck(int tmo)
+{
+    pollfd pfd = { sCmd, POLLIN, 0 };
+
+    while (true) {
+	int const res = ::poll(&pfd, 1, tmo);
+
+	if (-1 == res && EINTR != errno)
+	    throw systemError("couldn't poll command socket");
+	if (0 == res)
+	    return 0;
+	if (1 == res) {
+	    ssize_t const len = recv(sCmd, cmdBuf.data(), cmdBuf.size(), 0);
+
+	    if (len > 0)
+		return (size_t) len;
+	    if (-1 == len && EINTR != errno && EAGAIN != errno)
+		throw systemError("couldn't read command socket");
+	}
+    }
+}
+
+void AcnetClient::flush()
+{
+    size_t done = 0;
+
+#if THIS_TARGET == Linux_Target
+    while (done < outgoing.size()) {
+	size_t const total = outgoing.size() - done;
+	mmsghdr msgs[MAX_OUTGOING];
+	iovec iov[MAX_OUTGOING];
+	size_t const count = std::min(total, (size_t) MAX_OUTGOING);
+
+	memset(msgs, 0, sizeof(msgs[0]) * count);
+	for (size_t ii = 0; ii < count; ++ii) {
+	    iov[ii].iov_base = outgoing[done + ii].data();
+	    iov[ii].iov_len = outgoing[done + ii].size();
+	    msgs[ii].msg_hdr.msg_iov = iov + ii;
+	    msgs[ii].msg_hdr.msg_iovlen = 1;
+	}
+
+	int const res = sendmmsg(sCmd, msgs, count, 0);
+
+	if (-1 == res) {
+	    if (EINTR == errno)
+		continue;
+	    outgoing.erase(outgoing.begin(), outgoing.begin() + done);
+	    throw systemError("couldn't send commands");
+	}
+	done += res;
+    }
+#else
+    for (; done < outgoing.size(); ++done)
+	while (-1 == send(sCmd, outgoing[done].data(), outgoing[done].size(), 0))
+	    if (EINTR != errno) {
+		outgoing.erase(outgoing.begin(), outgoing.begin() + done);
+		throw systemError("couldn't send command");
+	    }
+#endif
+    outgoing.clear();
+}
+
+size_t AcnetClient::poll(int tmo)
+{
+    flush();
+
+    pollfd pfd[] = {
+	{ sCmd, POLLIN, 0 },
+	{ sData, POLLIN, 0 }
+    };
+
+    int const res = ::poll(pfd, 2, tmo);
+
+    if (-1 == res) {
+	if (EINTR == errno)
+	    return 0;
+	throw systemError("couldn't poll sockets");
+    }
+
+    size_t total = 0;
+
+    // The command socket goes first: acnetd always sends the ack of a
+    // SendRequest before any of its replies, so this way the request
+    // ID is known by the time the replies are dispatched.
+
+    if (pfd[0].revents & POLLIN)
+	total += drainCommandSocket();
+    if (pfd[1].revents & POLLIN)
+	total += drainDataSocket();
+
+    // Commands sent by the handlers go out together.
+
+    flush();
+    return total;
+}
+
+size_t AcnetClient::drainCommandSocket()
+{
+    size_t total = 0;
+    ssize_t len;
+
+    while ((len = recv(sCmd, cmdBuf.data(), cmdBuf.size(), MSG_DONTWAIT)) > 0) {
+	handleAck(cmdBuf.data(), len);
+	++total;
+    }
+    return total;
+}
+
+// Dispatches an ack received outside of transact(). Acks of pipelined
+// commands arrive in batches; an entry nobody is waiting for is the
+// unsolicited ack of a failed command (see CONN_M_ERRACKS.) A batch is
+// copied before it is dispatched since a handler may issue a command
+// that waits for its own ack, reusing cmdBuf.
+
+void AcnetClient::handleAck(uint8_t const* buf, size_t len)
+{
+    if (len < sizeof(AckHeader))
+	return;
+
+    if (((AckHeader const*) buf)->cmd() != AckList::ackBatch) {
+	reportFailure((AckHeader const*) buf, len);
+	return;
+    }
+
+    if (len < sizeof(AckBatch))
+	return;
+
+    std::vector<uint8_t> const batch(buf, buf + len);
+    uint8_t const* ptr = batch.data() + sizeof(AckBatch);
+    uint8_t const* const end = batch.data() + batch.size();
+
+    for (size_t count = ((AckBatch const*) batch.data())->count(); count && ptr + sizeof(AckBatchEntry) <= end;
+	 --count) {
+	AckBatchEntry const* const entry = (AckBatchEntry const*) ptr;
+	size_t const n = entry->len();
+
+	ptr += sizeof(AckBatchEntry);
+	if (n < sizeof(AckHeader) || ptr + n > end)
+	    break;
+
+	auto const ii = pendingAcks.find(entry->seq());
+
+	if (ii != pendingAcks.end()) {
+	    AckHandler const onAck = ii->second;
+
+	    pendingAcks.erase(ii);
+	    onAck((AckHeader const*) ptr, n);
+	} else
+	    reportFailure((AckHeader const*) ptr, n);
+	ptr += n;
+    }
+}
+
+size_t AcnetClient::drainDataSocket()
+{
+    size_t total = 0;
+    ssize_t len;
+
+    while ((len = recv(sData, rxBuf.data(), rxBuf.size(), MSG_DONTWAIT)) > 0) {
+	handleData(rxBuf.data(), len);
+	++total;
+    }
+    return total;
+}
+
+// Hands a packet from the data socket to its handler. The handlers
+// see the packet in place, in rxBuf.
+
+void AcnetClient::handleData(uint8_t const* buf, size_t len)
+{
+    if (len < sizeof(AcnetHeader))
+	return;
+
+    AcnetHeader const& hdr = *(AcnetHeader const*) buf;
+    size_t const n = std::max(std::min(len, (size_t) hdr.msgLen()), sizeof(AcnetHeader)) - sizeof(AcnetHeader);
+    uint16_t const flags = hdr.flags();
+
+    if (PKT_IS_REPLY(flags)) {
+	auto ii = requests.find(hdr.msgId().raw());
+
+	// A reply to an unknown request could be one whose ack is still
+	// sitting in the command socket.
+
+	if (ii == requests.end() && pendingRequests) {
+	    (void) drainCommandSocket();
+	    ii = requests.find(hdr.msgId().raw());
+	}
+
+	// The handler is called through a copy since it may cancel its
+	// own request, which erases the entry holding it.
+
+	if (ii != requests.end()) {
+	    ReplyHandler const onReply = ii->second.onReply;
+
+	    if (flags & ACNET_FLG_MLT)
+		onReply(hdr.msgId(), hdr.status(), hdr.msg(), n, false);
+	    else {
+		requests.erase(ii);
+		onReply(hdr.msgId(), hdr.status(), hdr.msg(), n, true);
+	    }
+	}
+    } else if (PKT_IS_REQUEST(flags) || PKT_IS_CANCEL(flags)) {
+
+	// acnetd passes the reply ID in the status field of requests and
+	// cancels.
+
+	auto const ii = tasks.find(hdr.svrTaskName());
+	rpyid_t const rpyid(hdr.status().raw());
+
+	if (ii != tasks.end()) {
+	    if (PKT_IS_CANCEL(flags)) {
+		if (ii->second.onCancel)
+		    ii->second.onCancel(rpyid);
+	    } else if (ii->second.onRequest)
+		ii->second.onRequest(rpyid, hdr, hdr.msg(), n);
+	}
+    }
+}
+
+// Local Variables:
+// mode:c++
+// fill-column:125
+// End:
@@ -0,0 +1,150 @@
+#ifndef __ACNETCLIENT_H
+#define __ACNETCLIENT_H
+
+#include <functional>
+#include "server.h"
+
+// AcnetClient is a C++ implementation of the client side of acnetd's
+// command protocol. One object owns a command socket and a data
+// socket and any number of task handles can be connected through
+// them, so a process that serves several ACNET tasks doesn't need a
+// socket pair for each.
+//
+// The library is built around the connection options (see
+// CONN_M_PIPELINE and friends in server.h.) When acnetd grants
+// pipelining, commands aren't sent one at a time; they're queued
+// and handed to the kernel in one go by flush() (or poll()), and
+// their acks come back in AckBatch messages which are matched to
+// the outstanding commands by sequence number. Against an older
+// acnetd, the object falls back to sending one command and waiting
+// for its ack.
+//
+// Nothing happens in the background: incoming requests, replies and
+// acks are only processed inside poll(). The handlers are called
+// from poll() and the payload pointers they receive point into the
+// object's receive buffer, so the data is only valid until the
+// handler returns. Handlers may send commands, but must not call
+// poll().
+//
+// ACNET errors are reported by throwing a status_t; operating system
+// errors throw std::runtime_error.
+
+class AcnetClient : private Noncopyable {
+ public:
+
+    // Called for every reply of a request. 'last' is set on the final
+    // reply, after which the request ID is no longer valid. When
+    // acnetd refuses the request, the handler is called once with the
+    // error status and 'last' set.
+
+    typedef std::function<void(reqid_t, status_t, uint8_t const*, size_t, bool last)> ReplyHandler;
+
+    // The reply handler of a scattered request also receives the
+    // index, in the node list, of the node that replied.
+
+    typedef std::function<void(size_t, reqid_t, status_t, uint8_t const*, size_t, bool last)> ScatterHandler;
+
+    // Called for every request sent to a receiving task. The header
+    // holds the requestor's node and task; the reply ID is used to
+    // answer with sendReply().
+
+    typedef std::function<void(rpyid_t, AcnetHeader const&, uint8_t const*, size_t)> RequestHandler;
+    typedef std::function<void(rpyid_t)> CancelHandler;
+
+    // Called when acnetd reports the failure of a reply, a cancel or
+    // a credit grant; these calls don't wait for their acks so the
+    // error can't be thrown. The reply ID is only meaningful for
+    // failed replies; it is zero when unknown (a failed SendReplies on
+    // a CONN_M_ERRACKS connection, for instance.)
+
+    typedef std::function<void(status_t, rpyid_t)> ErrorHandler;
+
+    static uint32_t const DEFAULT_OPTIONS = CONN_M_PIPELINE | CONN_M_ERRACKS | CONN_M_IMPLICITACK;
+
+    explicit AcnetClient(nodename_t = nodename_t(), int ackTimeout = 2000);
+    ~AcnetClient();
+
+    // Connection management. connect() returns the options acnetd
+    // granted; CONN_M_ERRACKS is only kept along with
+    // CONN_M_PIPELINE since, without sequence numbers, an unsolicited
+    // ack can't be told apart from the ack of the next command.
+
+    uint32_t connect(taskhandle_t, uint32_t options = DEFAULT_OPTIONS);
+    void disconnect(taskhandle_t);
+    trunknode_t localNode();
+    void setErrorHandler(ErrorHandler h) { onError = h; }
+
+    // Requests
+
+    void sendRequest(taskhandle_t, taskhandle_t, trunknode_t, void const*, size_t, bool, ReplyHandler);
+    void sendRequests(taskhandle_t, taskhandle_t, trunknode_t const*, size_t, void const*, size_t, bool,
+		      ScatterHandler, uint32_t tmo = 0);
+    void cancel(taskhandle_t, reqid_t);
+    size_t activeRequests() const { return requests.size() + pendingRequests; }
+
+    // Request handling
+
+    void receiveRequests(taskhandle_t, RequestHandler, CancelHandler = CancelHandler());
+    void sendReply(taskhandle_t, rpyid_t, void const*, size_t, bool last, status_t = ACNET_SUCCESS);
+    void sendReplies(taskhandle_t, rpyid_t const*, size_t, void const*, size_t, bool last,
+		     status_t = ACNET_SUCCESS);
+    void grantCredits(taskhandle_t, uint32_t);
+
+    // Event processing. flush() hands every queued command to the
+    // kernel. poll() flushes and then dispatches incoming packets,
+    // waiting up to 'tmo' milliseconds (-1 waits forever) for the
+    // first one. It returns the number of packets dispatched.
+
+    void flush();
+    size_t poll(int tmo);
+
+ private:
+    typedef std::function<void(AckHeader const*, size_t)> AckHandler;
+
+    struct Task {
+	taskhandle_t handle;
+	uint16_t id;
+	uint32_t options;
+	RequestHandler onRequest;
+	CancelHandler onCancel;
+    };
+
+    struct Request {
+	uint16_t taskId;
+	ReplyHandler onReply;
+    };
+
+    nodename_t const vNode;
+    int const ackTimeout;
+    int sCmd;
+    int sData;
+    uint16_t nextSeq;
+    size_t pendingRequests;
+
+    std::map<taskhandle_t, Task> tasks;
+    std::map<uint16_t, Request> requests;
+    std::map<uint16_t, AckHandler> pendingAcks;
+    std::vector<std::vector<uint8_t> > outgoing;
+    std::vector<uint8_t> cmdBuf;
+    std::vector<uint8_t> rxBuf;
+    ErrorHandler onError;
+
+    Task& getTask(taskhandle_t);
+
+    void command(Task&, CommandHeader&, size_t, void const*, size_t, AckHandler);
+    std::vector<uint8_t> transact(Task*, CommandHeader&, size_t, void const* = 0, size_t = 0);
+    void reportFailure(AckHeader const*, size_t);
+    size_t readAck(int);
+
+    size_t drainCommandSocket();
+    void handleAck(uint8_t const*, size_t);
+    size_t drainDataSocket();
+    void handleData(uint8_t const*, size_t);
+};
+
+#endif
+
+// Local Variables:
+// mode:c++
+// fill-column:125
+// End:
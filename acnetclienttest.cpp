@@ -0,0 +1,136 @@
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include "acnetclient.h"
+
+// acnetclienttest exercises the client library against a local
+// acnetd. Each test prints its name and "ok" or "FAILED"; the exit
+// status is the number of failed tests.
+
+static taskhandle_t const server(ator("CLTSTS"));
+static taskhandle_t const client(ator("CLTSTC"));
+
+// Runs poll() until 'done' is set or 'tmo' milliseconds have passed
+// without any packet showing up.
+
+static bool pollUntil(AcnetClient& acnet, bool const& done, int tmo)
+{
+    while (!done)
+	if (!acnet.poll(tmo))
+	    return false;
+    return true;
+}
+
+// The server keeps replying to the request until it sees the
+// cancel. The client's reply handler cancels the request from inside
+// the handler on the second reply; since cancel() erases the
+// request's entry, the handler must not be touched afterwards and no
+// more replies may be delivered.
+
+static bool cancelFromReplyHandler(AcnetClient& acnet)
+{
+    trunknode_t const node = acnet.localNode();
+    rpyid_t rpyid;
+    bool requested = false;
+    bool ended = false;
+
+    acnet.receiveRequests(server, [&rpyid, &requested](rpyid_t id, AcnetHeader const&, uint8_t const*, size_t) {
+	    rpyid = id;
+	    requested = true;
+	}, [&ended](rpyid_t) { ended = true; });
+
+    // Replies sent after the cancel are refused; that's expected.
+
+    acnet.setErrorHandler([](status_t, rpyid_t) {});
+
+    // The captured string makes the handler too big for
+    // std::function's small buffer, so destroying it while it runs
+    // frees memory the running call still reads.
+
+    std::string const tag(64, 'x');
+    size_t replies = 0;
+    size_t late = 0;
+    bool cancelled = false;
+
+    acnet.sendRequest(client, server, node, "", 0, true,
+		      [&acnet, &replies, &late, &cancelled, tag](reqid_t reqid, status_t status, uint8_t const*,
+								 size_t, bool) {
+			  if (status.isFatal() || cancelled) {
+			      ++late;
+			      return;
+			  }
+			  if (++replies == 2) {
+			      acnet.cancel(client, reqid);
+			      cancelled = tag.size() == 64;
+			  }
+		      });
+
+    if (!pollUntil(acnet, requested, 1000)) {
+	std::cerr << "  request never arrived\n";
+	return false;
+    }
+
+    for (size_t ii = 0; !ended && ii < 100; ++ii) {
+	acnet.sendReply(server, rpyid, &ii, sizeof(ii), false);
+	(void) acnet.poll(10);
+    }
+
+    // Let any replies that were already on their way show up.
+
+    while (acnet.poll(100))
+	;
+
+    if (!ended)
+	std::cerr << "  server never saw the cancel\n";
+    if (replies != 2 || late)
+	std::cerr << "  " << replies << " replies before the cancel, " << late << " after\n";
+    return ended && cancelled && replies == 2 && !late && !acnet.activeRequests();
+}
+
+int main(int argc, char**)
+{
+    static struct {
+	char const* name;
+	bool (*fn)(AcnetClient&);
+    } const tests[] = {
+	{ "cancel from reply handler", cancelFromReplyHandler },
+    };
+
+    if (argc != 1) {
+	std::cerr << "usage: acnetclienttest\n";
+	return 1;
+    }
+
+    int failed = 0;
+
+    for (auto const& test : tests) {
+	bool ok;
+
+	printf("%s: ", test.name);
+	fflush(stdout);
+	try {
+	    AcnetClient acnet;
+
+	    (void) acnet.connect(server);
+	    (void) acnet.connect(client);
+	    ok = test.fn(acnet);
+	}
+	catch (status_t const& s) {
+	    std::cerr << "ACNET error " << s.raw() << "\n";
+	    ok = false;
+	}
+	catch (std::exception const& e) {
+	    std::cerr << e.what() << "\n";
+	    ok = false;
+	}
+	printf("%s\n", ok ? "ok" : "FAILED");
+	failed += !ok;
+    }
+    return failed;
+}
+
+// Local Variables:
+// mode:c++
+// fill-column:125
+// End:
@@ -1,12 +1,15 @@
 #include <signal.h>
 #include <cerrno>
+#include <cstring>
 #include <sys/socket.h>
 #include "exttask.h"
 
 ExternalTask::ExternalTask(TaskPool& taskPool, taskhandle_t handle, taskid_t id, pid_t pid, uint16_t cmdPort,
 			    uint16_t dataPort) : TaskInfo(taskPool, handle, id),
 			    pid_(pid), contSocketErrors(0), totalSocketErrors(0),
-			    lastCommandTime(now()), lastAliveCheckTime(now())
+			    lastCommandTime(now()), lastAliveCheckTime(now()), options_(0),
+			    seqTagged(false), seq(0), credits(0), pendingBytes(0), maxPendingDepth(0),
+			    creditStalls(0), pendingDrops(0)
 {
 #if THIS_TARGET != Linux_Target && THIS_TARGET != SunOS_Target
     saCmd.sin_len = sizeof(saCmd);
@@ -43,10 +46,19 @@ bool ExternalTask::checkResult(ssize_t const res)
     return true;
 }
 
-bool ExternalTask::sendDataToClient(AcnetHeader const* const hdr)
+ssize_t ExternalTask::sendToCommandSocket(void const* d, size_t n)
+{
+    return sendto(sClient, d, n, 0, (sockaddr const*) &saCmd, sizeof(saCmd));
+}
+
+ssize_t ExternalTask::sendToDataSocket(void const* d, size_t n)
+{
+    return sendto(sClient, d, n, 0, (sockaddr const*) &saData, sizeof(saData));
+}
+
+bool ExternalTask::xmitData(AcnetHeader const* const hdr)
 {
-    ssize_t const res = sendto(sClient, hdr, hdr->msgLen(), 0,
-			       (sockaddr const*) &saData, sizeof(saData));
+    ssize_t const res = sendToDataSocket(hdr, hdr->msgLen());
 
     if (res != hdr->msgLen()) {
 	contSocketErrors++;
@@ -58,10 +70,112 @@ bool ExternalTask::sendDataToClient(AcnetHeader const* const hdr)
     return checkResult(res);
 }
 
-bool ExternalTask::sendAckToClient(void const* d, size_t n)
+// Clients using credits only get the packets they have room for. The
+// rest wait in 'pendingData' (in order) until GrantCredits gives us
+// more. When even that queue is full, the packet is dropped. A client
+// without credits gets everything right away; the loopback socket
+// can't tell us when its receive buffer is full, so credits are the
+// only backpressure a client has.
+
+bool ExternalTask::sendDataToClient(AcnetHeader const* const hdr)
+{
+    if (options_ & CONN_M_CREDITS) {
+	if (!credits || !pendingData.empty()) {
+	    ++creditStalls;
+	    queueData(hdr);
+	    return true;
+	}
+	--credits;
+    }
+    return xmitData(hdr);
+}
+
+void ExternalTask::queueData(AcnetHeader const* const hdr)
+{
+    size_t const n = hdr->msgLen();
+
+    if (pendingBytes + n <= MAX_PENDING_BYTES) {
+	uint8_t const* const ptr = (uint8_t const*) hdr;
+
+	pendingData.push(std::vector<uint8_t>(ptr, ptr + n));
+	pendingBytes += n;
+	if (pendingData.size() > maxPendingDepth)
+	    maxPendingDepth = pendingData.size();
+    } else {
+	++pendingDrops;
+	++stats.lostPkt;
+    }
+}
+
+bool ExternalTask::sendPendingData()
+{
+    while (!pendingData.empty() && (credits || !(options_ & CONN_M_CREDITS))) {
+	std::vector<uint8_t> const& pkt = pendingData.front();
+
+	if (options_ & CONN_M_CREDITS)
+	    --credits;
+
+	bool const result = xmitData((AcnetHeader const*) pkt.data());
+
+	pendingBytes -= pkt.size();
+	pendingData.pop();
+	if (!result)
+	    return false;
+    }
+    return true;
+}
+
+bool ExternalTask::hasCredit() const
+{
+    if (!(options_ & CONN_M_CREDITS) || (credits && pendingData.empty()))
+	return true;
+
+    ++creditStalls;
+    return false;
+}
+
+bool FilterRule::matches(AcnetHeader const& hdr) const
+{
+    size_t const len = hdr.msgLen() - sizeof(AcnetHeader);
+    uint16_t const f = flags();
+
+    if ((f & FILTER_M_NODE) && hdr.client() != node())
+	return false;
+
+    if (f & FILTER_M_TYPECODE) {
+	uint16_t tmp;
+
+	if (len < sizeof(tmp))
+	    return false;
+	memcpy(&tmp, hdr.msg(), sizeof(tmp));
+	if (atohs(tmp) != typeCode())
+	    return false;
+    }
+
+    if ((f & FILTER_M_PREFIX) && (len < prefixLen() || memcmp(hdr.msg(), prefix(), prefixLen())))
+	return false;
+
+    return true;
+}
+
+bool ExternalTask::passesFilter(AcnetHeader const& hdr) const
+{
+    if (filter.empty())
+	return true;
+
+    for (size_t ii = 0; ii < filter.size(); ++ii)
+	if (filter[ii].matches(hdr)) {
+	    ++filterMatches[ii];
+	    return true;
+	}
+
+    ++filterRejects;
+    return false;
+}
+
+bool ExternalTask::xmitAck(void const* d, size_t n)
 {
-    ssize_t const res = sendto(sClient, d, n, 0, (sockaddr const*) &saCmd,
-			       sizeof(saCmd));
+    ssize_t const res = sendToCommandSocket(d, n);
 
     if (res != (ssize_t) n) {
 	contSocketErrors++;
@@ -73,12 +187,56 @@ bool ExternalTask::sendAckToClient(void const* d, size_t n)
     return checkResult(res);
 }
 
+// Acks to commands that carried a sequence number are added to the
+// task's current AckBatch rather than sent right away. The batch goes
+// out when it fills up or when TaskPool::flushPendingAcks() is called
+// after the command socket has been drained.
+
+bool ExternalTask::sendAckToClient(void const* d, size_t n)
+{
+    if (!seqTagged)
+	return xmitAck(d, n);
+
+    if (ackBatch.size() + sizeof(AckBatchEntry) + n > MAX_ACK_BATCH && !flushAcks())
+	return false;
+
+    if (ackBatch.empty()) {
+	AckBatch const hdr;
+	uint8_t const* const ptr = (uint8_t const*) &hdr;
+
+	ackBatch.reserve(MAX_ACK_BATCH);
+	ackBatch.insert(ackBatch.end(), ptr, ptr + sizeof(hdr));
+	taskPool().queueAckFlush(this);
+    }
+
+    AckBatchEntry const entry(seq, (uint16_t) n);
+    uint8_t const* const ptr = (uint8_t const*) &entry;
+
+    ackBatch.insert(ackBatch.end(), ptr, ptr + sizeof(entry));
+    ackBatch.insert(ackBatch.end(), (uint8_t const*) d, (uint8_t const*) d + n);
+
+    AckBatch* const hdr = (AckBatch*) ackBatch.data();
+
+    hdr->setCount(hdr->count() + 1);
+    return true;
+}
+
+bool ExternalTask::flushAcks()
+{
+    if (ackBatch.empty())
+	return true;
+
+    bool const result = xmitAck(ackBatch.data(), ackBatch.size());
+
+    ackBatch.clear();
+    return result;
+}
+
 bool ExternalTask::sendMessageToClient(AcnetClientMessage* msg)
 {
     msg->setPid(pid());
 
-    ssize_t const res = sendto(sClient, msg, sizeof(AcnetClientMessage), 0,
-			       (sockaddr const*) &saData, sizeof(saData));
+    ssize_t const res = sendToDataSocket(msg, sizeof(AcnetClientMessage));
 
     if (res != sizeof(AcnetClientMessage)) {
 	contSocketErrors++;
@@ -171,7 +329,7 @@ void ExternalTask::handleSend(SendCommand const *cmd, size_t const len)
     } else
 	ack.setStatus(ACNET_IVM);
 
-    if (!sendAckToClient(&ack, sizeof(ack)))
+    if (!ackSuppressed(ack.status()) && !sendAckToClient(&ack, sizeof(ack)))
 	taskPool().removeTask(this);
 }
 
@@ -216,6 +374,8 @@ void ExternalTask::handleSendRequest(SendRequestCommand const *cmd, size_t const
 		++stats.reqXmt;
 		++taskPool().stats.reqXmt;
 		ack.setRequestId(req->id());
+	    } catch (status_t err) {
+		ack.setStatus(err);
 	    } catch (...) {
 		ack.setStatus(ACNET_NLM);
 		++taskPool().stats.reqQLimit;
@@ -258,6 +418,8 @@ void ExternalTask::handleSendRequestWithTimeout(SendRequestWithTimeoutCommand co
 		++stats.reqXmt;
 		++taskPool().stats.reqXmt;
 		ack.setRequestId(req->id());
+	    } catch (status_t err) {
+		ack.setStatus(err);
 	    } catch (...) {
 		ack.setStatus(ACNET_NLM);
 		++taskPool().stats.reqQLimit;
@@ -275,6 +437,8 @@ void ExternalTask::handleSendReply(SendReplyCommand const *cmd, size_t const len
 {
     AckSendReply ack;
 
+    ack.setReplyId(cmd->rpyid());
+
     // In order for the message to be sent, the payload must not be bigger than INTERNAL_ACNET_USER_PACKET (which means the
     // message cannot be bigger than the max payload size plus the command header.)
 
@@ -286,7 +450,106 @@ void ExternalTask::handleSendReply(SendReplyCommand const *cmd, size_t const len
     } else
 	ack.setStatus(ACNET_IVM);
 
-    if (!sendAckToClient(&ack, sizeof(ack)))
+    if (!ackSuppressed(ack.status()) && !sendAckToClient(&ack, sizeof(ack)))
+	taskPool().removeTask(this);
+}
+
+// Sends one request to each node of the command's list. The payload
+// is swapped once; each request then only copies it into its
+// outgoing packet.
+
+void ExternalTask::handleSendRequests(SendRequestsCommand const *cmd, size_t const len)
+{
+    AckSendRequests ack;
+
+    // The command must hold the full list of nodes and the payload must not be bigger than INTERNAL_ACNET_USER_PACKET.
+
+    if (len >= sizeof(SendRequestsCommand) && cmd->count() <= MAX_REQUEST_FANOUT &&
+	len >= sizeof(SendRequestsCommand) + cmd->count() * sizeof(uint16_t) &&
+	len <= INTERNAL_ACNET_USER_PACKET_SIZE + sizeof(SendRequestsCommand) + cmd->count() * sizeof(uint16_t)) {
+	static uint8_t swapped[INTERNAL_ACNET_USER_PACKET_SIZE + 1];
+	RequestPool& reqPool = taskPool().reqPool;
+	size_t const msgLen = len - sizeof(SendRequestsCommand) - cmd->count() * sizeof(uint16_t);
+	uint32_t const tmo = cmd->timeout() ? cmd->timeout() : REQUEST_TIMEOUT * 1000u;
+	uint16_t const flags = ACNET_FLG_REQ | ((cmd->flags() & REQ_M_MULTRPY) ? ACNET_FLG_MLT : 0);
+
+	(void) swapPayload(swapped, cmd->data(), msgLen);
+
+	ack.setCount(cmd->count());
+	for (size_t ii = 0; ii < cmd->count(); ++ii) {
+	    trunknode_t node = cmd->addr(ii);
+	    status_t status = ACNET_SUCCESS;
+	    reqid_t reqid;
+
+	    if (node.isBlank())
+		node = taskPool().node();
+
+	    if (getAddr(node)) {
+		try {
+		    ReqInfo* const req = reqPool.alloc(this, cmd->task(), taskPool().node(), node, cmd->flags(), tmo);
+		    AcnetHeader const hdr(flags, ACNET_SUCCESS, node, taskPool().node(), cmd->task(), id(), req->id(),
+					  sizeof(AcnetHeader) + MSG_LENGTH(msgLen));
+
+		    sendDataToNetwork(hdr, swapped, msgLen, true);
+		    ++stats.reqXmt;
+		    ++taskPool().stats.reqXmt;
+		    reqid = req->id();
+		} catch (status_t err) {
+		    status = err;
+		} catch (...) {
+		    status = ACNET_NLM;
+		    ++taskPool().stats.reqQLimit;
+		}
+	    } else
+		status = ACNET_NO_NODE;
+
+	    ack.setEntry(ii, status, reqid);
+
+	    // The header's status reports the first node that couldn't be sent the request.
+
+	    if (status != ACNET_SUCCESS && ack.status() == ACNET_SUCCESS)
+		ack.setStatus(status);
+	}
+    } else
+	ack.setStatus(ACNET_IVM);
+
+    if (!sendAckToClient(&ack, ack.size()))
+	taskPool().removeTask(this);
+}
+
+void ExternalTask::handleSendReplies(SendRepliesCommand const *cmd, size_t const len)
+{
+    AckSendReplies ack;
+
+    // The command must hold the full list of reply IDs and the payload must not be bigger than INTERNAL_ACNET_USER_PACKET.
+
+    if (len >= sizeof(SendRepliesCommand) && cmd->count() <= MAX_REPLY_FANOUT &&
+	len >= sizeof(SendRepliesCommand) + cmd->count() * sizeof(uint16_t) &&
+	len <= INTERNAL_ACNET_USER_PACKET_SIZE + sizeof(SendRepliesCommand) + cmd->count() * sizeof(uint16_t)) {
+	static uint8_t swapped[INTERNAL_ACNET_USER_PACKET_SIZE + 1];
+	ReplyPool& rpyPool = taskPool().rpyPool;
+	size_t const msgLen = len - sizeof(SendRepliesCommand) - cmd->count() * sizeof(uint16_t);
+
+	// Swap the payload once. Each reply then only copies it into its outgoing packet.
+
+	(void) swapPayload(swapped, cmd->data(), msgLen);
+
+	ack.setCount(cmd->count());
+	for (size_t ii = 0; ii < cmd->count(); ++ii) {
+	    status_t const tmp = rpyPool.sendReplyToNetwork(this, cmd->rpyid(ii), cmd->status(), swapped, msgLen,
+							    cmd->flags() & RPY_M_ENDMULT, true);
+
+	    ack.setStatus(ii, tmp);
+
+	    // The header's status reports the first reply that couldn't be sent.
+
+	    if (tmp != ACNET_SUCCESS && ack.status() == ACNET_SUCCESS)
+		ack.setStatus(tmp);
+	}
+    } else
+	ack.setStatus(ACNET_IVM);
+
+    if (!ackSuppressed(ack.status()) && !sendAckToClient(&ack, ack.size()))
 	taskPool().removeTask(this);
 }
 
@@ -303,31 +566,62 @@ void ExternalTask::handleIgnoreRequest(IgnoreRequestCommand const *cmd)
 	taskPool().removeTask(this);
 }
 
+status_t ExternalTask::ackRequest(rpyid_t const rpyid)
+{
+    RpyInfo* const rep = taskPool().rpyPool.rpyInfo(rpyid);
+
+    if (rep && rep->task().equals(this)) {
+	status_t const status = (rep->beenAcked() || !decrementPendingRequests()) ? ACNET_BUG : ACNET_SUCCESS;
+
+	rep->ackIt();
+	return status;
+    }
+
+#ifdef DEBUG
+    syslog(LOG_INFO, "ACK REQUEST: Reply id = 0x%04x -- ERROR! Client tried to ACK nonexistent request.", rpyid.raw());
+#endif
+    return ACNET_NSR;
+}
+
 void ExternalTask::handleRequestAck(RequestAckCommand const *cmd)
 {
     Ack ack;
 
     if (!acceptsRequests())
 	ack.setStatus(ACNET_IVM);
-    else {
-	RpyInfo* const rep = taskPool().rpyPool.rpyInfo(cmd->rpyid());
-
-	if (rep && rep->task().equals(this)) {
-	    if (rep->beenAcked() || !decrementPendingRequests())
-		ack.setStatus(ACNET_BUG);
-	    rep->ackIt();
-	} else {
-#ifdef DEBUG
-	    syslog(LOG_INFO, "ACK REQUEST: Reply id = 0x%04x -- ERROR! Client tried to ACK nonexistent request.", cmd->rpyid().raw());
-#endif
-	    ack.setStatus(ACNET_NSR);
-	}
-    }
+    else
+	ack.setStatus(ackRequest(cmd->rpyid()));
 
     if (!sendAckToClient(&ack, sizeof(ack)))
 	taskPool().removeTask(this);
 }
 
+void ExternalTask::handleRequestAcks(RequestAcksCommand const *cmd, size_t const len)
+{
+    AckRequestAcks ack;
+
+    if (!acceptsRequests())
+	ack.setStatus(ACNET_IVM);
+    else if (len >= sizeof(RequestAcksCommand) && cmd->count() <= MAX_REPLY_FANOUT &&
+	     len >= sizeof(RequestAcksCommand) + cmd->count() * sizeof(uint16_t)) {
+	ack.setCount(cmd->count());
+	for (size_t ii = 0; ii < cmd->count(); ++ii) {
+	    status_t const tmp = ackRequest(cmd->rpyid(ii));
+
+	    ack.setStatus(ii, tmp);
+
+	    // The header's status reports the first request that couldn't be acked.
+
+	    if (tmp != ACNET_SUCCESS && ack.status() == ACNET_SUCCESS)
+		ack.setStatus(tmp);
+	}
+    } else
+	ack.setStatus(ACNET_IVM);
+
+    if (!sendAckToClient(&ack, ack.size()))
+	taskPool().removeTask(this);
+}
+
 void ExternalTask::handleCancel(CancelCommand const *cmd)
 {
     Ack ack;
@@ -377,6 +671,66 @@ void ExternalTask::handleRenameTask(RenameTaskCommand const *cmd)
 	taskPool().removeTask(this);
 }
 
+void ExternalTask::handleSetOptions(SetOptionsCommand const *cmd, size_t const len)
+{
+    AckSetOptions ack;
+
+    if (len >= sizeof(SetOptionsCommand)) {
+	options_ = cmd->options() & CONN_M_ALL;
+
+	// Without sequence numbers, an unsolicited ack can't be told
+	// apart from the ack of the next command, so error-only acks
+	// are only granted along with pipelining.
+
+	if (!(options_ & CONN_M_PIPELINE))
+	    options_ &= ~CONN_M_ERRACKS;
+	ack.setOptions(options_);
+	if (len >= sizeof(SetOptionsCreditsCommand))
+	    credits = ((SetOptionsCreditsCommand const*) cmd)->credits();
+    } else
+	ack.setStatus(ACNET_IVM);
+
+    if (!sendAckToClient(&ack, sizeof(ack)) || !sendPendingData())
+	taskPool().removeTask(this);
+
+    // If pipelining was just turned off, get the outstanding acks to
+    // the client before any untagged ones.
+
+    else if (!(options_ & CONN_M_PIPELINE) && !flushAcks())
+	taskPool().removeTask(this);
+}
+
+void ExternalTask::handleGrantCredits(GrantCreditsCommand const *cmd, size_t const len)
+{
+    Ack ack;
+
+    if (len >= sizeof(GrantCreditsCommand)) {
+	uint32_t const n = cmd->credits();
+
+	credits = (credits > UINT32_MAX - n) ? UINT32_MAX : credits + n;
+    } else
+	ack.setStatus(ACNET_IVM);
+
+    if ((!ackSuppressed(ack.status()) && !sendAckToClient(&ack, sizeof(ack))) || !sendPendingData())
+	taskPool().removeTask(this);
+}
+
+void ExternalTask::handleSetFilter(SetFilterCommand const *cmd, size_t const len)
+{
+    Ack ack;
+
+    if (len >= sizeof(SetFilterCommand) && cmd->count() <= MAX_FILTER_RULES &&
+	len >= sizeof(SetFilterCommand) + cmd->count() * sizeof(FilterRule)) {
+	filter.assign(&cmd->rule(0), &cmd->rule(0) + cmd->count());
+	filterMatches.assign(cmd->count(), StatCounter());
+	filterRejects = StatCounter();
+    } else
+	ack.setStatus(ACNET_IVM);
+
+    if (!sendAckToClient(&ack, sizeof(ack)))
+	taskPool().removeTask(this);
+}
+
 void ExternalTask::handleUnknownCommand(CommandHeader const *cmd, size_t const len)
 {
     syslog(LOG_WARNING, "task %s sent unknown command: %04x length:%ld",
@@ -386,10 +740,29 @@ void ExternalTask::handleUnknownCommand(CommandHeader const *cmd, size_t const l
 	taskPool().removeTask(this);
 }
 
-void ExternalTask::handleClientCommand(CommandHeader const* const cmd, size_t const len)
+void ExternalTask::handleClientCommand(CommandHeader const* const cmd, size_t len)
  {
      commandReceived();
 
+     // Pipelined clients append a sequence number to each command.
+     // Strip it off so the handlers see the usual command layout.
+
+     seqTagged = options_ & CONN_M_PIPELINE;
+     if (seqTagged) {
+	 if (len < sizeof(CommandHeader) + sizeof(seq)) {
+	     seqTagged = false;
+	     if (!sendErrorToClient(ACNET_IVM))
+		 taskPool().removeTask(this);
+	     return;
+	 }
+
+	 uint16_t tmp;
+
+	 len -= sizeof(tmp);
+	 memcpy(&tmp, (uint8_t const*) cmd + len, sizeof(tmp));
+	 seq = ntohs(tmp);
+     }
+
      switch (cmd->cmd()) {
       case CommandList::cmdKeepAlive:
          handleKeepAlive();
@@ -419,6 +792,10 @@ void ExternalTask::handleClientCommand(CommandHeader const* const cmd, size_t co
          handleSendRequest((SendRequestCommand const*) cmd, len);
          break;
 
+      case CommandList::cmdSendRequests:
+         handleSendRequests((SendRequestsCommand const*) cmd, len);
+         break;
+
       case CommandList::cmdSendRequestWithTimeout:
          handleSendRequestWithTimeout((SendRequestWithTimeoutCommand const*) cmd, len);
          break;
@@ -427,6 +804,10 @@ void ExternalTask::handleClientCommand(CommandHeader const* const cmd, size_t co
          handleSendReply((SendReplyCommand const*) cmd, len);
          break;
 
+      case CommandList::cmdSendReplies:
+         handleSendReplies((SendRepliesCommand const*) cmd, len);
+         break;
+
       case CommandList::cmdIgnoreRequest:
          handleIgnoreRequest((IgnoreRequestCommand const*) cmd);
          break;
@@ -435,6 +816,10 @@ void ExternalTask::handleClientCommand(CommandHeader const* const cmd, size_t co
          handleRequestAck((RequestAckCommand const*) cmd);
          break;
 
+      case CommandList::cmdRequestAcks:
+         handleRequestAcks((RequestAcksCommand const*) cmd, len);
+         break;
+
       case CommandList::cmdCancel:
          handleCancel((CancelCommand const*) cmd);
          break;
@@ -451,15 +836,34 @@ void ExternalTask::handleClientCommand(CommandHeader const* const cmd, size_t co
          handleRenameTask((RenameTaskCommand const*) cmd);
          break;
 
+      case CommandList::cmdSetOptions:
+         handleSetOptions((SetOptionsCommand const*) cmd, len);
+         break;
+
+      case CommandList::cmdGrantCredits:
+         handleGrantCredits((GrantCreditsCommand const*) cmd, len);
+         break;
+
+      case CommandList::cmdSetFilter:
+         handleSetFilter((SetFilterCommand const*) cmd, len);
+         break;
+
       default:
 	handleUnknownCommand(cmd, len);
         break;
     }
+
+    // Removing a task drops the acks still batched for it. When the
+    // command removed its own task (a Disconnect, say), the batch,
+    // with the command's own ack, has to go out now.
+
+    if (seqTagged && taskPool().getTask(id()) != this)
+	(void) flushAcks();
 }
 
 size_t ExternalTask::totalProp() const
 {
-    return 3;
+    return 10;
 }
 
 char const* ExternalTask::propName(size_t idx) const
@@ -467,7 +871,14 @@ char const* ExternalTask::propName(size_t idx) const
     static char const* const lbl[] = {
 	"Command Port",
 	"Data Port",
-	"Total Socket Errors"
+	"Total Socket Errors",
+	"Connect Options",
+	"Credits",
+	"Credit Stalls",
+	"Pending Packets",
+	"Max Pending Packets",
+	"Pending Drops",
+	"Delivery Filter"
     };
 
     return (idx < sizeof(lbl) / sizeof(*lbl)) ? lbl[idx] : 0;
@@ -489,6 +900,41 @@ std::string ExternalTask::propVal(size_t idx) const
      case 2:
 	os << totalSocketErrors;
 	return os.str();
+
+     case 3:
+	os << "0x" << std::hex << options_;
+	return os.str();
+
+     case 4:
+	os << credits;
+	return os.str();
+
+     case 5:
+	os << creditStalls;
+	return os.str();
+
+     case 6:
+	os << pendingData.size() << " (" << pendingBytes << " bytes)";
+	return os.str();
+
+     case 7:
+	os << maxPendingDepth;
+	return os.str();
+
+     case 8:
+	os << pendingDrops;
+	return os.str();
+
+     case 9:
+	if (filter.empty())
+	    os << "none";
+	else {
+	    os << filter.size() << " rules, matched:";
+	    for (size_t ii = 0; ii < filterMatches.size(); ++ii)
+		os << ' ' << (uint32_t) filterMatches[ii];
+	    os << ", rejected: " << (uint32_t) filterRejects;
+	}
+	return os.str();
     }
 
     return "";
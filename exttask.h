@@ -13,13 +13,49 @@ class ExternalTask : public TaskInfo {
     int contSocketErrors;
     uint32_t totalSocketErrors;
     mutable int64_t lastCommandTime, lastAliveCheckTime;
+    uint32_t options_;
+
+    // Pipelining state: whether the command being handled carried a
+    // sequence number (and its value) and the acks waiting to be sent
+
+    bool seqTagged;
+    uint16_t seq;
+    std::vector<uint8_t> ackBatch;
+
+    // Flow control state: the credits the client has granted us and
+    // the packets waiting for more of them
+
+    uint32_t credits;
+    std::queue<std::vector<uint8_t> > pendingData;
+    size_t pendingBytes;
+    size_t maxPendingDepth;
+    mutable uint32_t creditStalls;
+    uint32_t pendingDrops;
+
+    // Delivery filter and its counters
+
+    std::vector<FilterRule> filter;
+    mutable std::vector<StatCounter> filterMatches;
+    mutable StatCounter filterRejects;
 
     ExternalTask();
 
     bool checkResult(ssize_t);
+    bool xmitAck(void const*, size_t);
+    bool xmitData(AcnetHeader const*);
+    void queueData(AcnetHeader const*);
+    bool sendPendingData();
+    status_t ackRequest(rpyid_t);
 
  protected:
 
+    // Writes a packet to the client's command or data socket.
+    // Subclasses that reach their client some other way override
+    // these.
+
+    virtual ssize_t sendToCommandSocket(void const*, size_t);
+    virtual ssize_t sendToDataSocket(void const*, size_t);
+
     // Client command handlers
 
     virtual void handleCancel(CancelCommand const *);
@@ -29,10 +65,16 @@ class ExternalTask : public TaskInfo {
     virtual void handleBlockRequests();
     virtual void handleRenameTask(RenameTaskCommand const *);
     virtual void handleRequestAck(RequestAckCommand const *);
+    virtual void handleRequestAcks(RequestAcksCommand const *, size_t const);
+    virtual void handleSetOptions(SetOptionsCommand const *, size_t const);
+    virtual void handleGrantCredits(GrantCreditsCommand const *, size_t const);
+    virtual void handleSetFilter(SetFilterCommand const *, size_t const);
     virtual void handleSendReply(SendReplyCommand const *, size_t const);
+    virtual void handleSendReplies(SendRepliesCommand const *, size_t const);
     virtual void handleIgnoreRequest(IgnoreRequestCommand const *);
     virtual void handleSendRequest(SendRequestCommand const *, size_t const);
     virtual void handleSendRequestWithTimeout(SendRequestWithTimeoutCommand const*, size_t const);
+    virtual void handleSendRequests(SendRequestsCommand const*, size_t const);
     virtual void handleSend(SendCommand const *, size_t const);
     virtual void handleTaskPid();
     virtual void handleNodeStats();
@@ -40,6 +82,7 @@ class ExternalTask : public TaskInfo {
     virtual void handleUnknownCommand(CommandHeader const *, size_t len);
 
     void commandReceived() const { lastCommandTime = now(); }
+    bool ackSuppressed(status_t s) const { return (options_ & CONN_M_ERRACKS) && s == ACNET_SUCCESS; }
     bool sendErrorToClient(status_t);
     bool sendAckToClient(void const*, size_t);
     bool sendMessageToClient(AcnetClientMessage*);
@@ -50,13 +93,18 @@ class ExternalTask : public TaskInfo {
 
     bool stillAlive(int = 0) const;
     bool isPromiscuous() const { return false; }
+    bool implicitRequestAck() const { return options_ & CONN_M_IMPLICITACK; }
+    bool hasCredit() const;
+    bool passesFilter(AcnetHeader const&) const;
 
     pid_t pid() const { return pid_; }
     uint16_t commandPort() const { return ntohs(saCmd.sin_port); }
     uint16_t dataPort() const { return ntohs(saData.sin_port); }
+    uint32_t options() const { return options_; }
 
     void handleClientCommand(CommandHeader const* const, size_t const);
     bool sendDataToClient(AcnetHeader const*);
+    bool flushAcks();
 
     bool equals(TaskInfo const*) const;
     bool needsToBeThrottled() const { return true; }
@@ -19,6 +19,7 @@ const status_t ACNET_TRP(1, -32);
 const status_t ACNET_NOTASK(1, -33);
 const status_t ACNET_DISCONNECTED(1, -34);
 const status_t ACNET_LEVEL2(1, -35);
+const status_t ACNET_QUOTA(1, -36);
 const status_t ACNET_NODE_DOWN(1, -42);
 const status_t ACNET_BUG(1, -45);
 const status_t ACNET_INVARG(1, -50);
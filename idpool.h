@@ -6,14 +6,17 @@
 #include <bitset>
 
 // Template to create pool of objects referenced by id. The size of the pool needs to be a power
-// of two.
+// of two. An ID is the entry's index with a bank in the bits above it (see bankGen()), so a pool
+// can have at most 32768 entries.
 
 template<class T, class R, size_t SIZE,
 	 bool = (SIZE > 0 && (((~SIZE + 1) & SIZE) ^ SIZE) == 0) >
 class IdPool {
 
+    static_assert(SIZE <= 0x8000, "IdPool IDs need a bank bit above the index");
+
     class CircBuf {
-	size_t item[SIZE];
+	uint16_t item[SIZE];
 	size_t nItems, head;
 
      public:
@@ -24,7 +27,7 @@ class IdPool {
 	void push(size_t id)
 	{
 	    assert(nItems < SIZE);
-	    item[(head + nItems++) % SIZE] = id;
+	    item[(head + nItems++) % SIZE] = (uint16_t) id;
 	}
 
 	size_t pop()
@@ -43,6 +46,7 @@ class IdPool {
     T pool[SIZE];
     CircBuf freeList;
     size_t maxActiveIdCount_;
+    size_t exhaustedCount_;
 
  protected:
     std::bitset<SIZE> inUse;
@@ -57,7 +61,7 @@ class IdPool {
 
  public:
     IdPool() :
-	bank(bankGen()), maxActiveIdCount_(0)
+	bank(bankGen()), maxActiveIdCount_(0), exhaustedCount_(0)
     {
 	// Initially add all ids to the free list
 
@@ -93,6 +97,7 @@ class IdPool {
 	    maxActiveIdCount_ = std::max(maxActiveIdCount_, activeIdCount());
 	    return begin() + idx;
 	}
+	++exhaustedCount_;
 	throw std::bad_alloc();
     }
 
@@ -159,12 +164,28 @@ class IdPool {
 	return maxActiveIdCount_;
     }
 
+    // The number of times alloc() found the pool empty
+
+    size_t exhaustedCount() const
+    {
+	return exhaustedCount_;
+    }
+
+    static size_t capacity()
+    {
+	return SIZE;
+    }
+
  private:
     inline static uint16_t idToIndex(R const id)
     {
 	return id.raw() & (SIZE - 1);
     }
 
+    // The bits above the index are random, except the lowest of them, which is always set so
+    // no ID is 0. A stale ID is caught by its bank not matching, so the bigger the pool, the
+    // fewer of them are caught; a 32768-entry pool has the one fixed bit left.
+
     static uint16_t bankGen()
     {
       return (uint16_t) ((random() & ~(SIZE - 1)) | SIZE);
@@ -174,6 +195,82 @@ class IdPool {
 template<class T, class R, size_t SIZE>
 class IdPool<T, R, SIZE, false>;
 
+// Links that thread an entry of a pool onto an IdList. An entry can be on one list per link it has.
+
+template<class T>
+struct IdLink {
+    T* next;
+    T* prev;
+    bool linked;
+
+    IdLink() : next(0), prev(0), linked(false) {}
+};
+
+// Template of an intrusive, doubly linked list of pool entries, kept in the order they were added. The links live in
+// the entries themselves (the 'Link' member), so adding and removing an entry is constant time and never allocates.
+
+template<class T, IdLink<T> T::*Link>
+class IdList {
+    T* head;
+    T* tail;
+    size_t count;
+
+    IdList(IdList const&);
+    IdList& operator=(IdList const&);
+
+ public:
+    IdList() : head(0), tail(0), count(0) {}
+
+    bool empty() const { return !head; }
+    size_t size() const { return count; }
+    T* front() const { return head; }
+    static T* next(T const* const entry) { return (entry->*Link).next; }
+
+    // Adds an entry to the end of the list. Returns false if the entry is already on a list.
+
+    bool insert(T* const entry)
+    {
+	IdLink<T>& link = entry->*Link;
+
+	if (link.linked)
+	    return false;
+
+	link.next = 0;
+	link.prev = tail;
+	if (tail)
+	    (tail->*Link).next = entry;
+	else
+	    head = entry;
+	tail = entry;
+	link.linked = true;
+	++count;
+	return true;
+    }
+
+    // Removes an entry. Returns false if it wasn't on a list.
+
+    bool erase(T* const entry)
+    {
+	IdLink<T>& link = entry->*Link;
+
+	if (!link.linked)
+	    return false;
+
+	if (link.prev)
+	    (link.prev->*Link).next = link.next;
+	else
+	    head = link.next;
+	if (link.next)
+	    (link.next->*Link).prev = link.prev;
+	else
+	    tail = link.prev;
+	link.next = link.prev = 0;
+	link.linked = false;
+	--count;
+	return true;
+    }
+};
+
 #endif
 
 // Local Variables:
@@ -0,0 +1,176 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <unistd.h>
+#include <vector>
+#include "keyindex.h"
+
+// indexbench compares the reply pool's lookup table, which used to be
+// a std::multimap and is now a KeyIndex, on the path every reply takes
+// through it: added when the request arrives, looked up while it's
+// open and removed when it ends. The table starts out holding
+// 'entries' replies and each step ends one at random and starts
+// another. Every so often a key is added twice, as a multicast
+// request delivered to two local tasks would be. The heap
+// allocations made during the timed steps are counted too.
+
+using std::chrono::steady_clock;
+
+static size_t allocations = 0;
+
+void* operator new(size_t n)
+{
+    ++allocations;
+    if (void* const p = malloc(n ? n : 1))
+	return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+struct Reply {
+    uint32_t key;
+};
+
+#define POOL	8192
+
+typedef std::multimap<uint32_t, Reply*> ActiveMap;
+typedef KeyIndex<Reply, 2 * POOL> ActiveIndex;
+
+// A key as the reply pool builds it: the requesting node in the upper
+// half and its request ID in the lower. The requests come from 'nodes'
+// nodes, each with a few open at a time, so their IDs are the low
+// indexes of the node's pool under the bank that node's acnetd picked.
+// Many keys then share their lower half and differ only in the node.
+
+static size_t nodes = 512;
+
+static uint32_t newKey()
+{
+    uint32_t const node = uint32_t(random() % nodes);
+    uint32_t const bank = ((node * 0x2f) & 0x7) << 13 | 0x2000;
+
+    return ((node + 0x0a00) << 16) | bank | uint32_t(random() % 16);
+}
+
+static void usage(char const* prog)
+{
+    fprintf(stderr, "usage: %s [-n entries] [-m nodes] [-s steps]\n"
+	    "  -n entries\treplies kept open, at most %d (default 4096)\n"
+	    "  -m nodes\tnodes the requests come from (default 512)\n"
+	    "  -s steps\treplies to end and start (default 2000000)\n", prog, POOL);
+    exit(1);
+}
+
+// Runs the steps against one kind of table. 'add', 'find' and 'remove' adapt the table's interface.
+
+template<class Table, class Add, class Find, class Remove>
+static void run(char const* name, Table& table, std::vector<Reply>& replies, size_t entries,
+		std::vector<size_t> const& picks, Add add, Find find, Remove remove)
+{
+    for (size_t ii = 0; ii < entries; ++ii)
+	add(table, &replies[ii]);
+
+    size_t const before = allocations;
+    size_t missing = 0;
+    auto const start = steady_clock::now();
+
+    for (size_t ii = 0; ii < picks.size(); ++ii) {
+	Reply* const r = &replies[picks[ii]];
+
+	missing += !find(table, r->key);
+	remove(table, r);
+
+	// One reply in eight shares the key of the reply before it
+
+	r->key = ii % 8 ? newKey() : replies[picks[ii] ? picks[ii] - 1 : 1].key;
+	add(table, r);
+    }
+
+    double const ns = std::chrono::duration<double, std::nano>(steady_clock::now() - start).count() / picks.size();
+
+    printf("%-9s %6zu open replies: %6.1f ns per step, %.2f heap allocations per step%s\n", name, entries, ns,
+	   double(allocations - before) / picks.size(), missing ? "  LOOKUP FAILED" : "");
+    if (missing)
+	exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    size_t entries = 4096, steps = 2000000;
+    int ch;
+
+    while (-1 != (ch = getopt(argc, argv, "n:m:s:")))
+	switch (ch) {
+	 case 'n':
+	    entries = strtoul(optarg, 0, 0);
+	    break;
+
+	 case 'm':
+	    nodes = strtoul(optarg, 0, 0);
+	    break;
+
+	 case 's':
+	    steps = strtoul(optarg, 0, 0);
+	    break;
+
+	 default:
+	    usage(argv[0]);
+	}
+
+    if (entries < 2 || entries > POOL || !nodes || nodes > 0xf600)
+	usage(argv[0]);
+
+    std::vector<size_t> picks(steps);
+
+    srandom(1);
+    for (size_t ii = 0; ii < steps; ++ii)
+	picks[ii] = random() % entries;
+
+    std::vector<Reply> keys(entries);
+
+    for (size_t ii = 0; ii < entries; ++ii)
+	keys[ii].key = newKey();
+
+    {
+	std::vector<Reply> replies(keys);
+	ActiveMap map;
+
+	srandom(2);
+	run("multimap", map, replies, entries, picks,
+	    [](ActiveMap& m, Reply* r) { m.insert(ActiveMap::value_type(r->key, r)); },
+	    [](ActiveMap& m, uint32_t k) { return m.find(k) != m.end(); },
+	    [](ActiveMap& m, Reply* r) {
+		auto ii = m.equal_range(r->key);
+
+		for (; ii.first != ii.second; ++ii.first)
+		    if (ii.first->second == r) {
+			m.erase(ii.first);
+			break;
+		    }
+	    });
+    }
+
+    {
+	std::vector<Reply> replies(keys);
+	static ActiveIndex index;
+
+	srandom(2);
+	run("KeyIndex", index, replies, entries, picks,
+	    [](ActiveIndex& t, Reply* r) { t.insert(r->key, r); },
+	    [](ActiveIndex& t, uint32_t k) { return t.find(k) != 0; },
+	    [](ActiveIndex& t, Reply* r) { t.erase(r->key, r); });
+    }
+
+    return 0;
+}
+
+// Local Variables:
+// mode:c++
+// fill-column:125
+// End:
@@ -0,0 +1,127 @@
+#ifndef __KEYINDEX_H
+#define __KEYINDEX_H
+
+#include <cassert>
+#include <cstddef>
+#include <stdint.h>
+
+// Template of a hash table that maps 32-bit keys to pointers. It's an open-addressing table with linear probing whose
+// slots are allocated along with it, so adding and removing entries never touches the heap. SIZE has to be a power of
+// two and should be at least twice the most entries the table will hold; the table never grows. A key may be added more
+// than once, with different values. Removed entries are filled in by shifting later entries of the same probe sequence
+// back, so lookups never have to skip over deleted slots.
+
+// The number of bits in an index of a table of SIZE slots.
+
+template<size_t SIZE>
+struct KeyIndexBits {
+    enum { value = 1 + KeyIndexBits<SIZE / 2>::value };
+};
+
+template<>
+struct KeyIndexBits<1> {
+    enum { value = 0 };
+};
+
+template<class T, size_t SIZE>
+class KeyIndex {
+    struct Slot {
+	uint32_t key;
+	T* value;
+    };
+
+    static_assert(SIZE > 1 && (SIZE & (SIZE - 1)) == 0, "KeyIndex size must be a power of two");
+
+    Slot slots[SIZE];
+    size_t count;
+
+    KeyIndex(KeyIndex const&);
+    KeyIndex& operator=(KeyIndex const&);
+
+    // A key's home slot comes from the top bits of its product with
+    // the golden ratio, which depend on all of the key's bits. (The
+    // low bits of the product depend only on the key's low bits, and
+    // keys that differ only in their upper half would all collide.)
+
+    static size_t home(uint32_t key)
+    {
+	return uint32_t(key * 0x9e3779b1u) >> (32 - KeyIndexBits<SIZE>::value);
+    }
+
+    static size_t after(size_t ii)
+    {
+	return (ii + 1) & (SIZE - 1);
+    }
+
+    void removeAt(size_t ii)
+    {
+	size_t jj = ii;
+
+	while (slots[jj = after(jj)].value) {
+	    size_t const h = home(slots[jj].key);
+
+	    // The entry at jj may move back to the hole unless its home
+	    // slot lies after the hole, up to jj (going around the end
+	    // of the table.)
+
+	    if (ii <= jj ? (h <= ii || h > jj) : (h <= ii && h > jj)) {
+		slots[ii] = slots[jj];
+		ii = jj;
+	    }
+	}
+	slots[ii].value = 0;
+	--count;
+    }
+
+ public:
+    KeyIndex() : count(0)
+    {
+	for (size_t ii = 0; ii < SIZE; ++ii)
+	    slots[ii].value = 0;
+    }
+
+    size_t size() const { return count; }
+
+    void insert(uint32_t key, T* value)
+    {
+	assert(value);
+	assert(count < SIZE - 1);
+
+	size_t ii = home(key);
+
+	while (slots[ii].value)
+	    ii = after(ii);
+	slots[ii].key = key;
+	slots[ii].value = value;
+	++count;
+    }
+
+    // Returns the first value added under 'key' that's still in the table, or null.
+
+    T* find(uint32_t key) const
+    {
+	for (size_t ii = home(key); slots[ii].value; ii = after(ii))
+	    if (slots[ii].key == key)
+		return slots[ii].value;
+	return 0;
+    }
+
+    // Removes the entry that maps 'key' to 'value'. Returns false if there isn't one.
+
+    bool erase(uint32_t key, T const* value)
+    {
+	for (size_t ii = home(key); slots[ii].value; ii = after(ii))
+	    if (slots[ii].key == key && slots[ii].value == value) {
+		removeAt(ii);
+		return true;
+	    }
+	return false;
+    }
+};
+
+#endif
+
+// Local Variables:
+// mode:c++
+// fill-column:125
+// End:
@@ -21,7 +21,7 @@ void LocalTask::handleBlockRequests()
     receiving = false;
 
     while (!replies.empty())
-	taskPool().rpyPool.endRpyId(*replies.begin(), ACNET_DISCONNECTED);
+	taskPool().rpyPool.endRpyId(replies.front()->id(), ACNET_DISCONNECTED);
 
     Ack ack;
     if (!sendAckToClient(&ack, sizeof(ack)))
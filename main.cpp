@@ -28,6 +28,7 @@ static bool getResources();
 static bool isPacketSizeValid(size_t, uint16_t, size_t, ipaddr_t);
 static int normalConditions();
 static void releaseResources();
+static void sigChld(int);
 static void sigHup(int);
 static void sigInt(int);
 static int waitingForNodeTable();
@@ -44,6 +45,9 @@ TaskPoolMap taskPoolMap;
 
 static int sClientTcp = -1;
 static nodename_t tcpNodeName;
+#if THIS_TARGET == Linux_Target
+static TcpClientGateway* tcpGateway = 0;
+#endif
 static bool defaultNodeFallback = true;
 
 #ifndef NO_REPORT
@@ -51,6 +55,7 @@ static bool sendReport = false;
 #endif
 bool termSignal = false;
 static bool termApp = false;
+static bool childExited = false;
 static int (*nodeTableConstraints)() = waitingForNodeTable;
 static int64_t currTime = 0;
 
@@ -59,11 +64,12 @@ struct CmdLineArgs {
     bool standAlone;
     bool alternate;
     bool tcpClients;
+    bool forkTcpClients;
     uint16_t altPort;
     std::set<taskhandle_t> taskReject;
 
     CmdLineArgs() :
-	standAlone(false), alternate(false), tcpClients(false)
+	standAlone(false), alternate(false), tcpClients(false), forkTcpClients(false)
     {
     }
 
@@ -146,6 +152,10 @@ struct CmdLineArgs {
 			done = true;
 			break;
 
+		     case 'F':
+			forkTcpClients = true;
+			break;
+
 		     case 'r':
 			if (!*curPtr) {
 			    if (ii < argc - 1 && argv[ii + 1][0] != '-')
@@ -159,6 +169,54 @@ struct CmdLineArgs {
 			done = true;
 			break;
 
+		     case 'c':
+			if (!*curPtr) {
+			    if (ii < argc - 1 && argv[ii + 1][0] != '-')
+				curPtr = argv[++ii];
+			    else {
+				printf("missing limits argument to '-c' option\n\n");
+				return false;
+			    }
+			}
+			if (!tcpAdmission.setLimits(curPtr)) {
+			    printf("Bad TCP connection limits\n\n");
+			    return false;
+			}
+			done = true;
+			break;
+
+		     case 'q':
+			if (!*curPtr) {
+			    if (ii < argc - 1 && argv[ii + 1][0] != '-')
+				curPtr = argv[++ii];
+			    else {
+				printf("missing policy argument to '-q' option\n\n");
+				return false;
+			    }
+			}
+			if (!getSlowPolicy(curPtr)) {
+			    printf("Bad TCP client queue policy\n\n");
+			    return false;
+			}
+			done = true;
+			break;
+
+		     case 'l':
+			if (!*curPtr) {
+			    if (ii < argc - 1 && argv[ii + 1][0] != '-')
+				curPtr = argv[++ii];
+			    else {
+				printf("missing quota argument to '-l' option\n\n");
+				return false;
+			    }
+			}
+			if (!IdQuota::setLimits(curPtr)) {
+			    printf("Bad ID quota\n\n");
+			    return false;
+			}
+			done = true;
+			break;
+
 		     case 'f':
 			defaultNodeFallback = false;
 			syslog(LOG_NOTICE, "default node fallback is off");
@@ -187,7 +245,20 @@ struct CmdLineArgs {
 	       "   -s            stand-alone mode -- don't try to download\n"
 	       "                 ACNET node tables\n"
 	       "   -t name       allow TCP client connections on host name\n"
+	       "   -F            serve each TCP client from its own process\n"
 	       "   -r list       comma seperated list of task handles to reject on TCP connections\n"
+	       "   -c rate[:burst[:per-host]]\n"
+	       "                 limit new TCP connections to rate per second, with\n"
+	       "                 bursts of up to burst, and per-host open connections\n"
+	       "                 from any one host; 0 turns a limit off\n"
+	       "   -q policy[:high[:low]]\n"
+	       "                 what to do with TCP clients whose send queue grows past\n"
+	       "                 high bytes (disconnect, busy or drop) until it drains to\n"
+	       "                 low bytes; sizes may end in k, m or g\n"
+	       "   -l task[:handle]\n"
+	       "                 let each client task hold at most task request IDs and\n"
+	       "                 task reply IDs, and all the tasks with one handle at\n"
+	       "                 most handle of each; 0 turns a limit off\n"
 	       "   -H name       sets the ACNET host name of this node\n"
 	       "   -n TRUNKNODE  sets the current trunk and node to the\n"
 	       "                 specified four hex digits\n"
@@ -195,6 +266,46 @@ struct CmdLineArgs {
 	       "   -a port       use alternate port\n");
     }
 
+    static bool getSize(std::string const& s, size_t& size)
+    {
+	char* end;
+
+	size = strtoul(s.c_str(), &end, 0);
+	if (end == s.c_str())
+	    return false;
+
+	char const* const units = "kmg";
+	char const* const unit = *end ? strchr(units, tolower(*end)) : 0;
+
+	if (unit) {
+	    size <<= 10 * (unit - units + 1);
+	    ++end;
+	}
+	return !*end;
+    }
+
+    // Parses "policy[:high[:low]]" for the TCP client slow-consumer
+    // policy.
+
+    bool getSlowPolicy(std::string s)
+    {
+	std::string policy;
+	size_t high = 0, low = 0;
+	std::istringstream is(s);
+
+	getline(is, policy, ':');
+	if (getline(is, s, ':') && !getSize(s, high))
+	    return false;
+	if (getline(is, s, ':') && !getSize(s, low))
+	    return false;
+	if (!TcpClientProtocolHandler::setSlowPolicy(policy.c_str(), high, low))
+	    return false;
+
+	syslog(LOG_NOTICE, "TCP clients more than %ld bytes behind: %s", TcpClientProtocolHandler::highWater,
+	       policy.c_str());
+	return true;
+    }
+
     void getTaskRejectList(std::string s)
     {
 	std::string name;
@@ -307,9 +418,23 @@ static bool getResources()
 	    setMyIp();
 
 	    if (cmdLineArgs.tcpClients) {
-		if (-1 != (sClientTcp = allocClientTcpSocket(INADDR_ANY, ACNET_CLIENT_PORT, 128 * 1024, 128 * 1024)))
+		if (-1 != (sClientTcp = allocClientTcpSocket(INADDR_ANY, ACNET_CLIENT_PORT, 128 * 1024, 128 * 1024))) {
 		    syslog(LOG_NOTICE, "TCP client interface enabled");
-		else
+
+#if THIS_TARGET == Linux_Target
+		    // Unless asked to fork, the TCP clients are served
+		    // from our own event loop.
+
+		    if (!cmdLineArgs.forkTcpClients) {
+			tcpGateway = new TcpClientGateway(tcpNodeName);
+			if (!tcpGateway->valid()) {
+			    syslog(LOG_ERR, "forking a process for each TCP client");
+			    delete tcpGateway;
+			    tcpGateway = 0;
+			}
+		    }
+#endif
+		} else
 		    syslog(LOG_ERR, "unable to allocate client TCP socket -- %m");
 	    }
 
@@ -320,8 +445,13 @@ static bool getResources()
     return false;
 }
 
+// A node going away can end many requests and replies at once. The
+// faked EMRs and CANCELs for each TCP client are held and written to
+// it together.
+
 void cancelReqToNode(trunknode_t const tn)
 {
+    TcpClientProtocolHandler::Hold const hold;
     auto ii = taskPoolMap.begin();
 
     while (ii != taskPoolMap.end())
@@ -330,6 +460,7 @@ void cancelReqToNode(trunknode_t const tn)
 
 void endRpyToNode(trunknode_t const tn)
 {
+    TcpClientProtocolHandler::Hold const hold;
     auto ii = taskPoolMap.begin();
 
     while (ii != taskPoolMap.end())
@@ -339,14 +470,17 @@ void endRpyToNode(trunknode_t const tn)
 static void handleAcnetUsm(TaskPool *taskPool, AcnetHeader& hdr)
 {
     // We have a regular USM. We look up the destination task and, if it
-    // is listening, deliver the packet to it.
+    // is listening and its delivery filter passes the packet, deliver the
+    // packet to it. TCP clients that can't take the packet right away
+    // all queue the same copy of it.
 
+    SharedPacket const shared(&hdr, hdr.msgLen());
     auto ii = taskPool->tasks(hdr.svrTaskName());
 
     while (ii.first != ii.second) {
 	TaskInfo * const task = ii.first->second;
 
-	if (task->acceptsUsm())
+	if (task->acceptsUsm() && task->passesFilter(hdr))
 	    if (task->sendDataToClient(&hdr))
 		++task->stats.usmRcv;
 
@@ -468,8 +602,12 @@ static void handleAcnetRequest(TaskPool *taskPool, AcnetHeader& hdr)
 	    sendError = false;
 
 	    // Even if the task is alive, it may not be a listening task.
+	    // Tasks using flow control that have run out of credits are
+	    // considered busy.
 
-	    if (task->acceptsRequests()) {
+	    if (task->acceptsRequests() && !task->hasCredit())
+		result = ACNET_BUSY;
+	    else if (task->acceptsRequests()) {
 
 #ifdef DEBUG
 		syslog(LOG_NOTICE, "NEW REQUEST: id = 0x%04x", hdr.msgId().raw());
@@ -505,6 +643,9 @@ static void handleAcnetRequest(TaskPool *taskPool, AcnetHeader& hdr)
 		    result = ACNET_BUSY;
 		    taskPool->rpyPool.endRpyId(rpy->id(), ACNET_DISCONNECTED);
 		}
+		catch (status_t err) {
+		    result = err;
+		}
 		catch (...) {
 		    result = ACNET_NOREMMEM;
 		}
@@ -919,144 +1060,152 @@ static void handleNetworkDatagram(uint8_t const* const buf, ssize_t const len, i
     }
 }
 
-static void sendClientError(sockaddr_in const& in, status_t err)
+static void sendClientError(CommandSource& src, status_t err)
 {
     Ack ack;
 
     ack.setStatus(err);
-    (void) sendto(sClient, &ack, sizeof(ack), 0, (sockaddr*) &in, sizeof(in));
+    src.sendAck(&ack, sizeof(ack));
 }
 
-static bool handleClientCommand()
+// Handles a command from a client. The caller has made sure the
+// command is at least as big as a CommandHeader.
+
+void handleClientCommand(CommandSource& src, CommandHeader const* const cmdHdr, size_t const recvLen)
 {
-    static char buf[64 * 1024];
-    sockaddr_in in;
-    socklen_t in_len = sizeof(in);
-    ssize_t recvLen;
+    // Check for adding a node to the node table since it doesn't
+    // require a TaskPool
 
-    // Make sure we were able to successfully read from the socket. If we
-    // couldn't, we're in a bad state and need to report the problem (over
-    // and over and over, probably.)
+    if (CommandList::cmdAddNode == cmdHdr->cmd()) {
+	Ack ack;
+	AddNodeCommand const* const cmd = static_cast<AddNodeCommand const*>(cmdHdr);
 
-    if ((recvLen = recvfrom(sClient, buf, sizeof(buf), 0, reinterpret_cast<sockaddr*>(&in), &in_len)) > 0) {
+	trunknode_t const node = cmd->addr();
+	nodename_t const name = cmd->nodeName();
+	ipaddr_t const addr = cmd->ipAddr();
 
-        // Make sure the packet is at least the size of a minimum packet. If
-        // it is at least the size of the CommandHeader base class, then we
-        // can look at the typecode. (TP-1)
+	if (myHostName() == name)
+	    setMyIp(addr); 
 
-        if ((size_t) recvLen >= sizeof(CommandHeader)) {
-            CommandHeader* const cmdHdr = reinterpret_cast<CommandHeader*>(buf);
+	if (node.isBlank() && name.isBlank() && addr.value() == 0) {
+	    if (!lastNodeTableDownloadTime())
+		generateKillerMessages();
+	    setLastNodeTableDownloadTime();
+	} else
+	    updateAddr(node, name, addr);
 
-	    // Check for adding a node to the node table since it doesn't
-	    // require a TaskPool
+	src.sendAck(&ack, sizeof(ack));
+    } else {
 
-	    if (CommandList::cmdAddNode == cmdHdr->cmd()) {
-		Ack ack;
-		AddNodeCommand const* const cmd = static_cast<AddNodeCommand const*>(cmdHdr);
+	// All commands at this point need a valid TaskPool
 
-		trunknode_t const node = cmd->addr();
-		nodename_t const name = cmd->nodeName();
-		ipaddr_t const addr = cmd->ipAddr();
+	TaskPool* const taskPool = getTaskPool(cmdHdr->virtualNodeName());
 
-		if (myHostName() == name)
-		    setMyIp(addr); 
+	if (!taskPool)
+	    sendClientError(src, ACNET_NO_NODE);
+	else if (CommandList::cmdConnect == cmdHdr->cmd() || CommandList::cmdConnectExt == cmdHdr->cmd() 
+					|| CommandList::cmdTcpConnectExt == cmdHdr->cmd()) {
 
-		if (node.isBlank() && name.isBlank() && addr.value() == 0) {
-		    if (!lastNodeTableDownloadTime())
-			generateKillerMessages();
-		    setLastNodeTableDownloadTime();
-		} else
-		    updateAddr(node, name, addr);
+	    // Make sure the packet size is correct. (TP-3)
 
-		(void) sendto(sClient, &ack, sizeof(ack), 0, (sockaddr*) &in, in_len);
-	    } else {
+	    if ((size_t) recvLen < sizeof(ConnectCommand))
+		sendClientError(src, ACNET_INVARG);
+	    else
+		taskPool->handleConnect(src, static_cast<ConnectCommand const*>(cmdHdr), recvLen);
 
-		// All commands at this point need a valid TaskPool
+	} else if (CommandList::cmdNameLookup == cmdHdr->cmd()) {
 
-		TaskPool* const taskPool = getTaskPool(cmdHdr->virtualNodeName());
+	    // Name Lookup commands don't require a valid connection
+	    // either. Make sure the packet size is correct.
 
-		if (!taskPool)
-		    sendClientError(in, ACNET_NO_NODE);
-		else if (CommandList::cmdConnect == cmdHdr->cmd() || CommandList::cmdConnectExt == cmdHdr->cmd() 
-						|| CommandList::cmdTcpConnectExt == cmdHdr->cmd()) {
+	    if ((size_t) recvLen != sizeof(NameLookupCommand))
+		sendClientError(src, ACNET_INVARG);
+	    else {
+		AckNameLookup ack;
+		trunknode_t addr;
+		NameLookupCommand const* const cmd = static_cast<NameLookupCommand const*>(cmdHdr);
 
-		    // Make sure the packet size is correct. (TP-3)
+		ack.setStatus(nameLookup(cmd->name(), addr) ?
+			      (ack.setTrunkNode(addr), ACNET_SUCCESS) : ACNET_NO_NODE);
 
-		    if ((size_t) recvLen < sizeof(ConnectCommand))
-			sendClientError(in, ACNET_INVARG);
-		    else
-			taskPool->handleConnect(in, static_cast<ConnectCommand const*>(cmdHdr), recvLen);
+		src.sendAck(&ack, sizeof(ack));
+	    }
+	}
 
-		} else if (CommandList::cmdNameLookup == cmdHdr->cmd()) {
+	// Yet another command that doesn't require a valid connection.
 
-		    // Name Lookup commands don't require a valid connection
-		    // either. Make sure the packet size is correct.
+	else if (CommandList::cmdNodeLookup == cmdHdr->cmd()) {
 
-		    if ((size_t) recvLen != sizeof(NameLookupCommand))
-			sendClientError(in, ACNET_INVARG);
-		    else {
-			AckNameLookup ack;
-			trunknode_t addr;
-			NameLookupCommand const* const cmd = static_cast<NameLookupCommand const*>(cmdHdr);
+	    // Make sure the packet size is correct.
 
-			ack.setStatus(nameLookup(cmd->name(), addr) ?
-				      (ack.setTrunkNode(addr), ACNET_SUCCESS) : ACNET_NO_NODE);
+	    if ((size_t) recvLen != sizeof(NodeLookupCommand))
+		sendClientError(src, ACNET_INVARG);
+	    else {
+		AckNodeLookup ack;
+		nodename_t name;
+		NodeLookupCommand const* const cmd = static_cast<NodeLookupCommand const*>(cmdHdr);
 
-			(void) sendto(sClient, &ack, sizeof(ack), 0, (sockaddr*) &in, in_len);
-		    }
-		}
+		ack.setStatus(nodeLookup(cmd->addr(), name) ?
+			      (ack.setNodeName(name), ACNET_SUCCESS) : ACNET_NO_NODE);
+		src.sendAck(&ack, sizeof(ack));
+	    }
+	}
 
-		// Yet another command that doesn't require a valid connection.
+	// Get the local node
 
-		else if (CommandList::cmdNodeLookup == cmdHdr->cmd()) {
+	else if (CommandList::cmdLocalNode == cmdHdr->cmd()) {
+	    AckNameLookup ack;
 
-		    // Make sure the packet size is correct.
+	    ack.setTrunkNode(taskPool->node());
+	    src.sendAck(&ack, sizeof(ack));
+	}
 
-		    if ((size_t) recvLen != sizeof(NodeLookupCommand))
-			sendClientError(in, ACNET_INVARG);
-		    else {
-			AckNodeLookup ack;
-			nodename_t name;
-			NodeLookupCommand const* const cmd = static_cast<NodeLookupCommand const*>(cmdHdr);
+	// Get the default node
 
-			ack.setStatus(nodeLookup(cmd->addr(), name) ?
-				      (ack.setNodeName(name), ACNET_SUCCESS) : ACNET_NO_NODE);
-			(void) sendto(sClient, &ack, sizeof(ack), 0, (sockaddr*) &in, in_len);
-		    }
-		}
+	else if (CommandList::cmdDefaultNode == cmdHdr->cmd()) {
+	    AckNameLookup ack;
 
-		// Get the local node
+	    ack.setTrunkNode(myNode());
+	    src.sendAck(&ack, sizeof(ack));
+	}
 
-		else if (CommandList::cmdLocalNode == cmdHdr->cmd()) {
-		    AckNameLookup ack;
 
-		    ack.setTrunkNode(taskPool->node());
-		    (void) sendto(sClient, &ack, sizeof(ack), 0, (sockaddr*) &in, in_len);
-		}
+	// All other commands require a taskname connected by the
+	// same client.
 
-		// Get the default node
+	else {
+	    ExternalTask* const task = dynamic_cast<ExternalTask *>
+				(src.findTask(*taskPool, cmdHdr->clientName()));
 
-		else if (CommandList::cmdDefaultNode == cmdHdr->cmd()) {
-		    AckNameLookup ack;
+	    if (task)
+		task->handleClientCommand(cmdHdr, recvLen);
+	    else
+		sendClientError(src, ACNET_NCN);
+	}
+    }
+}
 
-		    ack.setTrunkNode(myNode());
-		    (void) sendto(sClient, &ack, sizeof(ack), 0, (sockaddr*) &in, in_len);
-		}
+static bool handleClientCommand()
+{
+    static char buf[64 * 1024];
+    sockaddr_in in;
+    socklen_t in_len = sizeof(in);
+    ssize_t recvLen;
 
+    // Make sure we were able to successfully read from the socket. If we
+    // couldn't, we're in a bad state and need to report the problem (over
+    // and over and over, probably.)
 
-		// All other commands require a taskname connected to
-		// received port.
+    if ((recvLen = recvfrom(sClient, buf, sizeof(buf), 0, reinterpret_cast<sockaddr*>(&in), &in_len)) > 0) {
 
-		else {
-		    ExternalTask* const task = dynamic_cast<ExternalTask *>
-					(taskPool->getTask(cmdHdr->clientName(), ntohs(in.sin_port)));
+        // Make sure the packet is at least the size of a minimum packet. If
+        // it is at least the size of the CommandHeader base class, then we
+        // can look at the typecode. (TP-1)
 
-		    if (task)
-			task->handleClientCommand(cmdHdr, recvLen);
-		    else
-			sendClientError(in, ACNET_NCN);
-		}
-	    }
+        if ((size_t) recvLen >= sizeof(CommandHeader)) {
+	    ClientSocketSource src(in);
+
+	    handleClientCommand(src, reinterpret_cast<CommandHeader*>(buf), recvLen);
 	} else
 	    syslog(LOG_WARNING, "received %d bytes (too short to be a command)", in_len);
 	return true;
@@ -1124,6 +1273,10 @@ static void releaseResources()
 	close(sClientTcp);
 	sClientTcp = -1;
     }
+#if THIS_TARGET == Linux_Target
+    delete tcpGateway;
+    tcpGateway = 0;
+#endif
     networkTerm();
 }
 
@@ -1134,6 +1287,23 @@ static void sigUsr(int)
 #endif
 }
 
+// Child processes are reaped in the main loop, which also returns
+// their TCP connections' charges to admission control.
+
+static void sigChld(int)
+{
+    childExited = true;
+}
+
+static void reapChildren()
+{
+    pid_t pid;
+
+    childExited = false;
+    while ((pid = waitpid(-1, 0, WNOHANG)) > 0)
+	tcpAdmission.reaped(pid);
+}
+
 // This handler gets called when a HUP is sent to the process.
 
 static void sigHup(int)
@@ -1256,27 +1426,54 @@ void generateReport()
 
 extern void handleTcpClient(int, nodename_t);
 
-pid_t handleClientTcpConnect()
+// Accepts the connections waiting on the TCP client port. Only
+// ACCEPT_BATCH are taken per pass of the main loop, after its packets
+// have been handled, so a reconnect storm can't hold up ACNET
+// traffic. Connections that admission control turns away are closed
+// right after they're accepted.
+
+#define ACCEPT_BATCH	16
+
+static void handleClientTcpConnects()
 {
-    sockaddr addr;
-    socklen_t addrLen = sizeof(sockaddr);
+    for (int ii = 0; ii < ACCEPT_BATCH; ++ii) {
+	sockaddr_in addr;
+	socklen_t addrLen = sizeof(addr);
+	int const s = accept(sClientTcp, (sockaddr*) &addr, &addrLen);
 
-    int s = accept(sClientTcp, &addr, &addrLen);
+	if (s == -1)
+	    break;
 
-    if (s != -1) {
-	pid_t pid;
+	ipaddr_t const ip(ntohl(addr.sin_addr.s_addr));
 
-	if (!(pid = fork())) {
+	if (!tcpAdmission.admit(ip, now())) {
+	    close(s);
+	    continue;
+	}
+
+#if THIS_TARGET == Linux_Target
+	if (tcpGateway) {
+	    tcpGateway->addClient(s);
+	    continue;
+	}
+#endif
+
+	pid_t const pid = fork();
+
+	if (!pid) {
 	    close(sNetwork);
 	    close(sClient);
+	    close(sClientTcp);
 	    handleTcpClient(s, tcpNodeName);
-	} else {
-	    close(s);
-	    return pid;
 	}
-    }
 
-    return -1;
+	close(s);
+	if (pid == -1) {
+	    syslog(LOG_ERR, "couldn't fork a TCP client handler -- %m");
+	    tcpAdmission.release(ip);
+	} else
+	    tcpAdmission.forked(pid, ip);
+    }
 }
 
 int main(int argc, char** argv)
@@ -1291,7 +1488,8 @@ int main(int argc, char** argv)
     // Register our signal handlers.
 
     signal(SIGUSR1, sigUsr);
-    signal(SIGCHLD, SIG_IGN);
+    signal(SIGCHLD, sigChld);
+    signal(SIGPIPE, SIG_IGN);
     signal(SIGHUP, sigHup);
     signal(SIGINT, sigInt);
     signal(SIGTERM, sigInt);
@@ -1320,8 +1518,14 @@ int main(int argc, char** argv)
 		{ sNetwork, POLLIN, 0 },
 		{ sClient, POLLIN, 0 },
 		{ sClientTcp, POLLIN, 0 },
+		{ -1, POLLIN, 0 },
 	    };
 
+#if THIS_TARGET == Linux_Target
+	    if (tcpGateway)
+		pfd[3].fd = tcpGateway->fd();
+#endif
+
 	    getCurrentTime();
 
 	    if (cmdLineArgs.standAlone)
@@ -1347,6 +1551,11 @@ int main(int argc, char** argv)
 		    termSignal = false;
 		    termApp = true;
 
+#if THIS_TARGET == Linux_Target
+		    if (tcpGateway)
+			tcpGateway->shutdown();
+#endif
+
 		    auto ii = taskPoolMap.begin();
 
 		    while (ii != taskPoolMap.end())
@@ -1373,6 +1582,11 @@ int main(int argc, char** argv)
 #endif
 		}
 
+#if THIS_TARGET == Linux_Target
+		if (tcpGateway)
+		    updateTimeout(pollTimeout, tcpGateway->checkClients());
+#endif
+
 		// Send all pending packets destined for the network
 		// interface. If sendPendingPackets() returns false, then we
 		// still have outgoing packets that didn't reach the network
@@ -1391,11 +1605,18 @@ int main(int argc, char** argv)
 		else if (termApp)
 		    break;
 
-		poll(pfd, sizeof(pfd) / sizeof(*pfd), pollTimeout);
+		// A signal leaves the previous pass's events in place
+
+		if (-1 == poll(pfd, sizeof(pfd) / sizeof(*pfd), pollTimeout))
+		    for (size_t jj = 0; jj < sizeof(pfd) / sizeof(*pfd); ++jj)
+			pfd[jj].revents = 0;
 
 		getCurrentTime();
 
-		while ((pfd[0].revents | pfd[1].revents | pfd[2].revents) & POLLIN) {
+		if (childExited)
+		    reapChildren();
+
+		while ((pfd[0].revents | pfd[1].revents) & POLLIN) {
 		    // Check to see if there are any client commands sent to
 		    // us.
 
@@ -1409,6 +1630,16 @@ int main(int argc, char** argv)
 
 			if (!count)
 			    pfd[1].revents &= ~POLLIN;
+			else {
+
+			    // Send the acks batched up for pipelined
+			    // clients.
+
+			    auto ii = taskPoolMap.begin();
+
+			    while (ii != taskPoolMap.end())
+				(*ii++).second->flushPendingAcks();
+			}
 		    }
 
 
@@ -1426,11 +1657,20 @@ int main(int argc, char** argv)
 			} else
 			    pfd[0].revents &= ~POLLIN;
 		    }
-		    if (!termSignal && (pfd[2].revents & POLLIN) != 0) {
-			handleClientTcpConnect();
-			pfd[2].revents &= ~POLLIN;
-		    }
 		}
+
+		// New TCP clients are let in once the packets are handled
+
+		if (!termSignal && (pfd[2].revents & POLLIN) != 0)
+		    handleClientTcpConnects();
+
+#if THIS_TARGET == Linux_Target
+		// Service the TCP clients. The commands they pass on are
+		// picked up from the client socket on the next pass.
+
+		if (tcpGateway && (pfd[3].revents & POLLIN) != 0)
+		    tcpGateway->handleEvents();
+#endif
 	    }
 	    syslog(LOG_WARNING, "process was asked to terminate");
 
@@ -16,46 +16,59 @@ static inline uint16_t swap(uint16_t v)
     return (v >> 8) + (v << 8);
 }
 
-class DataOut {
-    trunknode_t tgt;
-    size_t total;
-    uint8_t data[INTERNAL_ACNET_PACKET_SIZE];
+// Copies 'n' bytes of data into 'out', swapping bytes to the network's byte order. The number of bytes written is returned
+// (odd-sized data gets padded to an even size.)
 
-    void addData(void const* d, size_t const n) throw()
-    {
+static size_t swapCopy(uint8_t* const out, void const* const d, size_t const n) throw()
+{
 #ifdef NO_SWAP
-	memcpy(data + total, d, n);
-	total += n;
+    memcpy(out, d, n);
+    return n;
 #else
-	uint8_t* ptr = data + total;
-	size_t const end = n & ~1;
+    size_t const end = n & ~1;
 
-	// When we copy the new data to our outgoing buffer, we need to swap bytes.
+    // When we copy the new data to our outgoing buffer, we need to swap bytes.
 
-	std::transform(reinterpret_cast<uint16_t const*>(d),
-	      reinterpret_cast<uint16_t const*>(d) + end / 2,
-	      reinterpret_cast<uint16_t*>(ptr),
-	      swap);
+    std::transform(reinterpret_cast<uint16_t const*>(d),
+	  reinterpret_cast<uint16_t const*>(d) + end / 2,
+	  reinterpret_cast<uint16_t*>(out),
+	  swap);
 
-	if (end != n) {
-	    ptr[end] = 0;
-	    ptr[end + 1] = ((uint8_t *) d)[n - 1]; 
-	    total += n + 1;
-	} else
-	    total += n;
+    if (end != n) {
+	out[end] = 0;
+	out[end + 1] = ((uint8_t *) d)[n - 1];
+	return n + 1;
+    } else
+	return n;
 #endif
+}
+
+class DataOut {
+    trunknode_t tgt;
+    size_t total;
+    uint8_t data[INTERNAL_ACNET_PACKET_SIZE];
+
+    void addData(void const* d, size_t const n) throw()
+    {
+	total += swapCopy(data + total, d, n);
     }
 
  public:
     DataOut() : total(0) { }
 
-    bool addData(AcnetHeader const& hdr, void const* d, size_t const n) throw()
+    // If 'swapped' is true, the payload was already passed through swapPayload() and only needs to be copied.
+
+    bool addData(AcnetHeader const& hdr, void const* d, size_t const n, bool const swapped) throw()
     {
 	assert(d || !n);
 
 	if (((n + 1) & ~1) + sizeof(AcnetHeader) <= sizeof(data) - total) {
 	    addData(&hdr, sizeof(AcnetHeader));
-	    addData(d, n);
+	    if (swapped) {
+		memcpy(data + total, d, MSG_LENGTH(n));
+		total += MSG_LENGTH(n);
+	    } else
+		addData(d, n);
 	    return true;
 	}
 	return false;
@@ -290,7 +303,15 @@ void dumpPacket(const char* pktType, AcnetHeader const& hdr, void const* d,
 	   dumpBuffer(d, msgLen - sizeof(AcnetHeader)));
 }
 
-int sendDataToNetwork(AcnetHeader const& hdr, void const* d, size_t n)
+// Converts a payload to the network's byte order so it can be passed to sendDataToNetwork() more than once without being
+// swapped each time. 'out' must have room for MSG_LENGTH(n) bytes. Returns the size of the converted payload.
+
+size_t swapPayload(void* const out, void const* const d, size_t const n)
+{
+    return swapCopy(reinterpret_cast<uint8_t*>(out), d, n);
+}
+
+int sendDataToNetwork(AcnetHeader const& hdr, void const* d, size_t n, bool const swapped)
 {
     trunknode_t const dst = ((hdr.flags() & ACNET_FLG_TYPE) == ACNET_FLG_RPY) ?
 	    hdr.client() : hdr.server();
@@ -303,14 +324,14 @@ int sendDataToNetwork(AcnetHeader const& hdr, void const* d, size_t n)
     // We need to allocate a new packet under two conditions: if there isn't a partial buffer associated with the target
     // node or if we can't add our data block to the current buffer.
 
-    if (!ptr || !ptr->addData(hdr, d, n)) {
+    if (!ptr || !ptr->addData(hdr, d, n, swapped)) {
 	try {
 	    ptr = allocPacket(dst);
 
 	    // Now we try to add our data again. This should never fail because the packets are sized to support our
 	    // largest datagram and we just allocated an empty packet. If it fails, complain loudly to the log!
 
-	    if (!ptr->addData(hdr, d, n)) {
+	    if (!ptr->addData(hdr, d, n, swapped)) {
 		syslog(LOG_ERR, "sendDataToNetwork() couldn't add data to a packet -- packet has been lost");
 		return 0;
 	    }
@@ -33,69 +33,71 @@ struct TypedTcpBuffer : public TcpBuffer<Typ> {
 };
 
 RawProtocolHandler::RawProtocolHandler(int sTcp, int sCmd, int sData, nodename_t tcpNode) :
-					TcpClientProtocolHandler(sTcp, sCmd, sData, tcpNode)
+					TcpClientProtocolHandler(sTcp, sCmd, sData, tcpNode), discard(0)
 {
 }
 
-bool RawProtocolHandler::handleDataSocket()
+// Handles each complete frame in the buffer and returns the number of
+// bytes used. A frame is a 32-bit size followed by a 16-bit type and
+// the payload; the size covers the type and the payload.
+
+size_t RawProtocolHandler::handleFrames(uint8_t* d, size_t n, bool& done)
 {
-    bool done = false;
-    TcpBuffer<ACNETD_DATA> data;
-    ssize_t const len = recv(sData, data.data, sizeof(data.data), 0);
+    size_t used = std::min(discard, n);
 
-    // Test for errors and correct length.
+    discard -= used;
 
-    if (len < 0) {
-	syslog(LOG_ERR, "error receiving data from acnetd -- %m");
-	done = true;
-    } else {
-	data.hdr.size = htonl(len + sizeof(data.hdr.type));
-	if (!send(&data, len + sizeof(data.hdr))) {
-	    syslog(LOG_ERR, "error sending data to client -- %m");
-	    done = true;
-	}
-    }
+    while (!done && enabledTraffic == AllTraffic && n - used >= sizeof(uint32_t)) {
+	uint32_t size;
 
-    return done;
-}
+	memcpy(&size, d + used, sizeof(size));
+	size = ntohl(size);
 
-bool RawProtocolHandler::handleClientSocket()
-{
-    bool done = false;
-    TcpBuffer<ACNETD_COMMAND> buf;
+	// An oversized packet is skipped as it arrives
 
-    // Read the size
+	if (size > sizeof(TcpBuffer<ACNETD_COMMAND>::data) + sizeof(uint16_t)) {
+	    syslog(LOG_ERR, "invalid packet size %d from client", size);
+	    used += sizeof(size);
+	    discard = size;
 
-    if (readBytes(&buf.hdr.size, sizeof(buf.hdr.size))) {
-	buf.hdr.size = ntohl(buf.hdr.size);
+	    size_t const skip = std::min(discard, n - used);
 
-	// If the packet size is within the buffer limits then read the packet size in
+	    used += skip;
+	    discard -= skip;
+	    continue;
+	}
 
-	if (buf.hdr.size <= (sizeof(buf.data) + sizeof(buf.hdr.type))) {
-	    if (readBytes(&buf.hdr.type, buf.hdr.size)) {
-		size_t len = buf.hdr.size - sizeof(buf.hdr.type);
+	if (n - used < sizeof(size) + size)
+	    break;
 
-		// If it's an ACNETD_COMMAND and at least the the size of command header then
-		// check for certain commands
+	uint8_t* const pkt = d + used + sizeof(size);
+	uint16_t type;
 
-		if (ntohs(buf.hdr.type) == ACNETD_COMMAND && len >= sizeof(CommandHeader))
-		    done = handleClientCommand((CommandHeader *) buf.data, len);
-		else {
-		    syslog(LOG_ERR, "invalid command/size from client");
-		    done = true;
-		}
-	    } else {
-		syslog(LOG_INFO, "unable to read %d bytes from client", buf.hdr.size);
-		done = true;
+	used += sizeof(size) + size;
+	++frames;
+
+	// If it's an ACNETD_COMMAND and at least the the size of command header then
+	// check for certain commands
+
+	if (size >= sizeof(type) + sizeof(CommandHeader)) {
+	    memcpy(&type, pkt, sizeof(type));
+	    if (ntohs(type) == ACNETD_COMMAND) {
+		done = handleClientCommand((CommandHeader *) (pkt + sizeof(type)), size - sizeof(type));
+		continue;
 	    }
-	} else {
-	    syslog(LOG_ERR, "invalid packet size %d from client", buf.hdr.size);
-	    //done = true;
 	}
-    } else
+
+	syslog(LOG_ERR, "invalid command/size from client");
 	done = true;
+    }
 
-    return done;
+    return used;
+}
+
+void RawProtocolHandler::restart()
+{
+    TcpClientProtocolHandler::restart();
+    discard = 0;
 }
 
 bool RawProtocolHandler::handleCommandSocket()
@@ -120,6 +122,18 @@ bool RawProtocolHandler::handleCommandSocket()
     return done;
 }
 
+// Frames a packet for the client, whether it came from acnetd's data
+// socket or from one of an in-process client's tasks.
+
+bool RawProtocolHandler::sendPacket(uint16_t type, void const* d, size_t n)
+{
+    TcpHeader<ACNETD_DATA> hdr;
+
+    hdr.size = htonl(n + sizeof(hdr.type));
+    hdr.type = htons(type);
+    return send(&hdr, sizeof(hdr), d, n);
+}
+
 bool RawProtocolHandler::handleClientPing()
 {
     TcpHeader<TCP_CLIENT_PING> png;
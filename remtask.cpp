@@ -33,7 +33,7 @@ void RemoteTask::handleBlockRequests()
     receiving = false;
 
     while (!replies.empty())
-	taskPool().rpyPool.endRpyId(*replies.begin(), ACNET_DISCONNECTED);
+	taskPool().rpyPool.endRpyId(replies.front()->id(), ACNET_DISCONNECTED);
 
     Ack ack;
     if (!sendAckToClient(&ack, sizeof(ack)))
@@ -58,6 +58,12 @@ void RemoteTask::handleSendRequestWithTimeout(SendRequestWithTimeoutCommand cons
 	ExternalTask::handleSendRequestWithTimeout(cmd, len);
 }
 
+void RemoteTask::handleSendRequests(SendRequestsCommand const* cmd, size_t const len)
+{
+    if (len < sizeof(SendRequestsCommand) || !rejectTask(cmd->task()))
+	ExternalTask::handleSendRequests(cmd, len);
+}
+
 size_t RemoteTask::totalProp() const
 {
     return ExternalTask::totalProp() + 1;
@@ -18,6 +18,7 @@ class RemoteTask : public ExternalTask {
 protected:
     void handleSendRequest(SendRequestCommand const *, size_t const);
     void handleSendRequestWithTimeout(SendRequestWithTimeoutCommand const*, size_t const);
+    void handleSendRequests(SendRequestsCommand const*, size_t const);
     void handleSend(SendCommand const *, size_t const);
     void handleReceiveRequests();
     void handleBlockRequests();
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstring>
 #ifndef NO_REPORT
 #include <iomanip>
@@ -10,6 +11,13 @@ ReqInfo *RequestPool::alloc(TaskInfo* task, taskhandle_t taskName,
 {
     assert(task);
 
+    auto const held = IdQuota::perHandle ? handleUse.find(task->handle()) : handleUse.end();
+
+    if (!IdQuota::allows(task, task->requestCount(), held == handleUse.end() ? 0 : held->second)) {
+	++task->stats.idRefused;
+	throw ACNET_QUOTA;
+    }
+
     ReqInfo *req = idPool.alloc();
 
     req->task_ = task;
@@ -27,9 +35,31 @@ ReqInfo *RequestPool::alloc(TaskInfo* task, taskhandle_t taskName,
 	req->mcast = in && IN_MULTICAST(htonl(in->sin_addr.s_addr));
     }
 
-    if (task->addRequest(idPool.id(req)))
+    // The lookups that can throw are done before the request is
+    // linked anywhere.
+
+    NodeList* nodeList;
+    IdQuota::HandleUse::iterator use;
+
+    try {
+	nodeList = &byNode[remNode];
+	use = IdQuota::perHandle ?
+	    handleUse.insert(IdQuota::HandleUse::value_type(task->handle(), 0)).first : handleUse.end();
+    }
+    catch (...) {
+	idPool.release(req);
+	throw;
+    }
+
+    if (task->addRequest(req)) {
+	nodeList->insert(req);
+	req->handleUse = use;
+	if (use != handleUse.end())
+	    ++use->second;
 	update(req);
-    else {
+    } else {
+	if (use != handleUse.end() && !use->second)
+	    handleUse.erase(use);
 	idPool.release(req);
 //	free(req);	// JD:  Both I and the compiler think this is iffy.
 			// These items look like they are allocated out of
@@ -43,6 +73,10 @@ ReqInfo *RequestPool::alloc(TaskInfo* task, taskhandle_t taskName,
 
 void RequestPool::release(ReqInfo *req)
 {
+    assert(!req->taskLink.linked);
+    byNode[req->remNode()].erase(req);
+    if (req->handleUse != handleUse.end() && !--req->handleUse->second)
+	handleUse.erase(req->handleUse);
     req->detach();
     idPool.release(req);
 }
@@ -52,43 +86,52 @@ reqid_t ReqInfo::id() const
     return task().taskPool().reqPool.idPool.id(this);
 }
 
-ReqInfo* RequestPool::oldest()
-{
-    Node* const tmp = root.next();
-
-    return tmp != &root ? dynamic_cast<ReqInfo*>(tmp) : 0;
-}
+// Ends every open request to a node that has gone away. Each
+// requesting task gets a faked EMR so it can clean up its resources.
+// Tasks whose clients can't take it are removed after the pass, since
+// removing a task ends its other requests too.
 
 void RequestPool::cancelReqToNode(trunknode_t const tn)
 {
-    ReqInfo* req = 0;
+    auto const ii = byNode.find(tn);
+
+    if (ii == byNode.end() || ii->second.empty())
+	return;
+
+    NodeList& list = ii->second;
+    std::vector<TaskInfo*> failed;
+#ifdef DEBUG
+    size_t const total = list.size();
+#endif
 
-    while (0 != (req = idPool.next(req)))
-	if (req->remNode() == tn) {
-	    if (dumpOutgoing)
-		syslog(LOG_INFO, "sending faked EMR for request 0x%04x", req->id().raw());
+    while (!list.empty()) {
+	ReqInfo* const req = list.front();
 
-	    // Send a faked out EMR reply to the local client so that it can gracefully clean up its resources.
+	if (dumpOutgoing)
+	    syslog(LOG_INFO, "sending faked EMR for request 0x%04x", req->id().raw());
 
-	    AcnetHeader const hdr(ACNET_FLG_RPY, ACNET_DISCONNECTED, req->remNode(), req->lclNode(), req->taskName(),
-				  req->task().id(), req->id(), sizeof(AcnetHeader));
+	AcnetHeader const hdr(ACNET_FLG_RPY, ACNET_DISCONNECTED, req->remNode(), req->lclNode(), req->taskName(),
+			      req->task().id(), req->id(), sizeof(AcnetHeader));
 
-	    TaskInfo& task = req->task();
-	    bool failed = !task.sendDataToClient(&hdr);
-	    ++task.stats.rpyRcv;
-	    ++task.taskPool().stats.rpyRcv;
+	TaskInfo& task = req->task();
 
-	    // Clean up our local resources associated with the request.
+	if (!task.sendDataToClient(&hdr) && std::find(failed.begin(), failed.end(), &task) == failed.end())
+	    failed.push_back(&task);
+	++task.stats.rpyRcv;
+	++task.taskPool().stats.rpyRcv;
 
-	    (void) req->task().removeRequest(req->id());
-	    release(req);
+	// Clean up our local resources associated with the request.
 
-	    if (failed)
-		task.taskPool().removeTask(&task);
-	    break;
-	}
+	(void) task.removeRequest(req);
+	release(req);
+    }
+
+    for (auto task : failed)
+	if (task->taskPool().getTask(task->id()) == task)
+	    task->taskPool().removeTask(task);
 #ifdef DEBUG
-    syslog(LOG_INFO, "Released several request structures -- %d active requests remaining", (int) idPool.activeIdCount());
+    syslog(LOG_INFO, "Released %d request structures -- %d active requests remaining", (int) total,
+	   (int) idPool.activeIdCount());
 #endif
 }
 
@@ -99,7 +142,7 @@ bool RequestPool::cancelReqId(reqid_t id, bool xmt, bool sendLastReply)
     ReqInfo* const req = idPool.entry(id);
 
     if (req) {
-	if (!req->task().removeRequest(id))
+	if (!req->task().removeRequest(req))
 	    syslog(LOG_WARNING, "didn't remove REQ ID 0x%04x from task %d", id.raw(), req->task().id().raw());
 
 	if (xmt) {
@@ -137,40 +180,39 @@ bool RequestPool::cancelReqId(reqid_t id, bool xmt, bool sendLastReply)
     return false;
 }
 
+// Handles the requests that have timed out and returns how long the
+// main loop may sleep before calling again, or -1 if there are no
+// requests.
+
 int RequestPool::sendRequestTimeoutsAndGetNextTimeout()
 {
     ReqInfo* req;
 
-    while (0 != (req = oldest())) {
-	int64_t const expiration = req->expiration();
-
-	if (expiration <= now()) {
-	    const bool mult = req->wantsMultReplies();
-	    const uint16_t flags = mult ? (ACNET_FLG_RPY | ACNET_FLG_MLT) : ACNET_FLG_RPY;
-	    const status_t status = mult ? ACNET_PEND : ACNET_TMO;
+    while (0 != (req = static_cast<ReqInfo*>(timers.expired(now())))) {
+	const bool mult = req->wantsMultReplies();
+	const uint16_t flags = mult ? (ACNET_FLG_RPY | ACNET_FLG_MLT) : ACNET_FLG_RPY;
+	const status_t status = mult ? ACNET_PEND : ACNET_TMO;
 
-	    AcnetHeader const hdr(flags, status, req->remNode(), req->lclNode(),
-				  req->taskName(), req->task().id(), req->id(), sizeof(AcnetHeader));
+	AcnetHeader const hdr(flags, status, req->remNode(), req->lclNode(),
+			      req->taskName(), req->task().id(), req->id(), sizeof(AcnetHeader));
 #ifdef DEBUG
-	    syslog(LOG_DEBUG, "Time-out waiting for reply for request 0x%04x ...  cancelling", req->id().raw());
+	syslog(LOG_DEBUG, "Time-out waiting for reply for request 0x%04x ...  cancelling", req->id().raw());
 #endif
-	    TaskInfo& task = req->task();
-	    bool failed = !task.sendDataToClient(&hdr);
+	TaskInfo& task = req->task();
+	bool failed = !task.sendDataToClient(&hdr);
 
-	    ++task.stats.rpyRcv;
-	    ++task.taskPool().stats.rpyRcv;
+	++task.stats.rpyRcv;
+	++task.taskPool().stats.rpyRcv;
 
-	    if (!mult)
-		cancelReqId(req->id(), true);
-	    else
-		req->update(&root);
+	if (!mult)
+	    cancelReqId(req->id(), true);
+	else
+	    update(req);
 
-	    if (failed)
-		task.taskPool().removeTask(&task);
-	} else
-	    return expiration - now();
+	if (failed)
+	    task.taskPool().removeTask(&task);
     }
-    return -1;
+    return timers.timeout(now());
 }
 
 static bool reqInList(ReqInfo const* const req, uint8_t subType, uint16_t const* data, uint16_t n)
@@ -216,7 +258,7 @@ void RequestPool::fillActiveRequests(AcnetReqList& rl, uint8_t subType, uint16_t
     ReqInfo const* req = 0;
 
     rl.total = 0;
-    while (0 != (req = idPool.next(req)))
+    while (rl.total < sizeof(rl.ids) / sizeof(*rl.ids) && 0 != (req = idPool.next(req)))
 	if (!n || reqInList(req, subType, data, n))
 	    rl.ids[rl.total++] = htoas(req->id().raw());
 }
@@ -247,8 +289,11 @@ void RequestPool::generateReqReport(std::ostream& os)
 
     ReqInfo const* req = 0;
 
+    os << "<br>Request ID pool size: " << idPool.capacity();
     os << "<br>Active request IDs: " << idPool.activeIdCount();
-    os << "<br>Max active request IDs: " << idPool.maxActiveIdCount() << "<br>";
+    os << "<br>Max active request IDs: " << idPool.maxActiveIdCount();
+    os << "<br>Times the pool ran out: " << idPool.exhaustedCount();
+    os << "<br>Quota per task: " << IdQuota::perTask << ", per handle: " << IdQuota::perHandle << " (0 is none)<br>";
 
     while (0 != (req = idPool.next(req))) {
 
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <map>
 #include <cstring>
 #ifndef NO_REPORT
@@ -11,7 +12,7 @@ rpyid_t RpyInfo::id() const
 }
 
 bool RpyInfo::xmitReply(status_t status, void const* const data,
-			size_t const n, bool const emr)
+			size_t const n, bool const emr, bool const swapped)
 {
     bool repDone = false;
 
@@ -19,19 +20,23 @@ bool RpyInfo::xmitReply(status_t status, void const* const data,
 		    reqId(), sizeof(AcnetHeader) + MSG_LENGTH(n));
 
     // If the request wasn't ACKed yet, then the client's ACK didn't happen.
-    // Go ahead and ack it here since we're sending a reply.
+    // Go ahead and ack it here since we're sending a reply. Clients that
+    // connected with CONN_M_IMPLICITACK rely on this, so only complain
+    // about the others.
 
     if (!beenAcked()) {
 	ackIt();
 	task().decrementPendingRequests();
 
-	char tname[128];
+	if (!task().implicitRequestAck()) {
+	    char tname[128];
 
-	syslog(LOG_WARNING, "un-acked request id:0x%04x rpyid:0x%04x task:%s remNode:0x%04x lclNode:0x%05x flags:0x%04x mcast:%s rpylen:%d emr:%s",
-						reqId_.raw(), id().raw(), taskName_.str(tname), remNode_.raw(), lclNode_.raw(), 
-						flags, (mcast ? "y" : "n"), (int) n, (emr ? "y" : "n"));
-	
-	dumpPacket("Outgoing", hdr, data, hdr.msgLen());
+	    syslog(LOG_WARNING, "un-acked request id:0x%04x rpyid:0x%04x task:%s remNode:0x%04x lclNode:0x%05x flags:0x%04x mcast:%s rpylen:%d emr:%s",
+						    reqId_.raw(), id().raw(), taskName_.str(tname), remNode_.raw(), lclNode_.raw(), 
+						    flags, (mcast ? "y" : "n"), (int) n, (emr ? "y" : "n"));
+
+	    dumpPacket("Outgoing", hdr, data, hdr.msgLen());
+	}
     }
 
     // We handle the response differently based upon whether the reply is a
@@ -61,27 +66,20 @@ bool RpyInfo::xmitReply(status_t status, void const* const data,
     if (!mcast)
 	task().taskPool().rpyPool.update(this);
 
-    sendDataToNetwork(hdr, data, n);
+    sendDataToNetwork(hdr, data, n, swapped);
 
     return repDone;
 }
 
-RpyInfo* ReplyPool::getOldest()
-{
-    Node* const tmp = root.next();
-
-    return tmp != &root ? dynamic_cast<RpyInfo*>(tmp) : 0;
-}
-
 status_t ReplyPool::sendReplyToNetwork(TaskInfo const* const task,
 				     rpyid_t const id, status_t const status,
 				     void const* const data, size_t const n,
-				     bool const emr)
+				     bool const emr, bool const swapped)
 {
     RpyInfo* const rpy = rpyInfo(id);
 
     if (rpy && rpy->task().equals(task)) {
-	if (rpy->xmitReply(status, data, n, emr))
+	if (rpy->xmitReply(status, data, n, emr, swapped))
 	    endRpyId(id);
 
 	++task->stats.rpyXmt;
@@ -101,6 +99,13 @@ RpyInfo* ReplyPool::alloc(TaskInfo* task, reqid_t msgId, taskid_t tId,
 {
     assert(task);
 
+    auto const held = IdQuota::perHandle ? handleUse.find(task->handle()) : handleUse.end();
+
+    if (!IdQuota::allows(task, task->replyCount(), held == handleUse.end() ? 0 : held->second)) {
+	++task->stats.idRefused;
+	throw ACNET_QUOTA;
+    }
+
     RpyInfo *rpy = idPool.alloc();
 
     rpy->task_ = task;
@@ -123,20 +128,27 @@ RpyInfo* ReplyPool::alloc(TaskInfo* task, reqid_t msgId, taskid_t tId,
     // Insert the data into our lookup table. If the insert was successful,
     // we're done.
 
-    activeMap.insert(ActiveMap::value_type(request_key_t(remNode, msgId), rpy));
+    activeIndex.insert(request_key_t(remNode, msgId).raw(), rpy);
 
     try {
 #ifdef PINGER
-	auto const ii = targetMap.find(remNode);
+	auto const ii = targetMap.insert(ActiveTargetMap::value_type(remNode, 0)).first;
 
-	if (ii != targetMap.end())
-	    ++(ii->second);
-	else
-	    targetMap.insert(ActiveTargetMap::value_type(remNode, 1));
+	++(ii->second);
 
 	try {
 #endif
-	    if (task->addReply(rpy->id())) {
+	    // Everything that can throw is done before the reply is
+	    // linked anywhere, so a failure only has to undo the
+	    // lookup table and target counts. The handle's count is
+	    // only charged once nothing else can fail.
+
+	    NodeList& nodeList = byNode[remNode];
+	    IdQuota::HandleUse::iterator const use = IdQuota::perHandle ?
+		handleUse.insert(IdQuota::HandleUse::value_type(task->handle(), 0)).first : handleUse.end();
+
+	    if (task->addReply(rpy)) {
+		nodeList.insert(rpy);
 
 		// If the reply is not part of a multicast request, then we
 		// add it to the timeout list so we generate periodic
@@ -152,17 +164,22 @@ RpyInfo* ReplyPool::alloc(TaskInfo* task, reqid_t msgId, taskid_t tId,
 		       (int) idPool.activeIdCount());
 #endif
 	    }
+	    rpy->handleUse = use;
+	    if (use != handleUse.end())
+		++use->second;
 #ifdef PINGER
 	}
 	catch (...) {
 	    if (!--(ii->second))
-		targetMap.erase(remNode);
+		targetMap.erase(ii);
 	    throw;
 	}
 #endif
     }
     catch (...) {
-	activeMap.erase(request_key_t(remNode, msgId));
+	activeIndex.erase(request_key_t(remNode, msgId).raw(), rpy);
+	rpy->task_ = 0;
+	idPool.release(rpy);
 	throw;
     }
 
@@ -180,7 +197,11 @@ void ReplyPool::release(RpyInfo *rpy)
 	targetMap.erase(rpy->remNode());
 #endif
 
-    activeMap.erase(request_key_t(rpy->remNode(), rpy->reqId()));
+    assert(!rpy->taskLink.linked);
+    byNode[rpy->remNode()].erase(rpy);
+    if (rpy->handleUse != handleUse.end() && !--rpy->handleUse->second)
+	handleUse.erase(rpy->handleUse);
+    activeIndex.erase(request_key_t(rpy->remNode(), rpy->reqId()).raw(), rpy);
     rpy->task_ = 0;
     rpy->detach();
     idPool.release(rpy);
@@ -193,47 +214,56 @@ RpyInfo* ReplyPool::rpyInfo(rpyid_t id)
 
 RpyInfo* ReplyPool::rpyInfo(trunknode_t node, reqid_t id)
 {
-    auto ii = activeMap.find(request_key_t(node, id));
-
-    return ii != activeMap.end() ? ii->second : 0;
+    return activeIndex.find(request_key_t(node, id).raw());
 }
 
+// Ends every open reply to a node that has gone away. Each replying
+// task gets a faked CANCEL so it can clean up its resources. As in
+// RequestPool::cancelReqToNode(), tasks whose clients can't take it
+// are removed after the pass.
+
 void ReplyPool::endRpyToNode(trunknode_t const tn)
 {
-    RpyInfo* rpy = 0;
+    auto const ii = byNode.find(tn);
+
+    if (ii == byNode.end() || ii->second.empty())
+	return;
 
-    while (0 != (rpy = idPool.next(rpy)))
-	if (rpy->remNode() == tn) {
-	    rpyid_t const id = rpy->id();
+    NodeList& list = ii->second;
+    std::vector<TaskInfo*> failed;
+#ifdef DEBUG
+    size_t const total = list.size();
+#endif
 
-	    if (dumpOutgoing)
-		syslog(LOG_INFO, "sending faked CANCEL for reply 0x%04x",
-		       id.raw());
+    while (!list.empty()) {
+	RpyInfo* const rpy = list.front();
 
-	    // Send a faked out CANCEL reply to the local client so that
-	    // it can gracefully clean up its resources.
+	if (dumpOutgoing)
+	    syslog(LOG_INFO, "sending faked CANCEL for reply 0x%04x", rpy->id().raw());
 
-	    AcnetHeader const hdr(ACNET_FLG_CAN, ACNET_SUCCESS, rpy->lclNode(),
-				  rpy->remNode(), rpy->taskName(), rpy->taskId(),
-				  rpy->reqId(), sizeof(AcnetHeader));
+	AcnetHeader const hdr(ACNET_FLG_CAN, ACNET_SUCCESS, rpy->lclNode(),
+			      rpy->remNode(), rpy->taskName(), rpy->taskId(),
+			      rpy->reqId(), sizeof(AcnetHeader));
 
-	    TaskInfo& task = rpy->task();
-	    bool failed = !task.sendDataToClient(&hdr);
-	    ++task.stats.usmRcv;
-	    ++task.taskPool().stats.usmRcv;
+	TaskInfo& task = rpy->task();
 
-	    // Clean up our local resources.
+	if (!task.sendDataToClient(&hdr) && std::find(failed.begin(), failed.end(), &task) == failed.end())
+	    failed.push_back(&task);
+	++task.stats.usmRcv;
+	++task.taskPool().stats.usmRcv;
 
-	    (void) task.removeReply(id);
-	    release(rpy);
+	// Clean up our local resources.
 
-	    if (failed)
-		task.taskPool().removeTask(&task);
-	    break;
-	}
+	(void) task.removeReply(rpy);
+	release(rpy);
+    }
+
+    for (auto task : failed)
+	if (task->taskPool().getTask(task->id()) == task)
+	    task->taskPool().removeTask(task);
 #ifdef DEBUG
-    syslog(LOG_INFO, "Released (several) reply structures -- pool now has %d "
-	   "active replies", (int) idPool.activeIdCount());
+    syslog(LOG_INFO, "Released %d reply structures -- pool now has %d "
+	   "active replies", (int) total, (int) idPool.activeIdCount());
 #endif
 }
 
@@ -242,7 +272,7 @@ void ReplyPool::endRpyId(rpyid_t id, status_t status)
     RpyInfo* const rpy = rpyInfo(id);
 
     if (rpy) {
-	if (!rpy->task().removeReply(rpy->id()))
+	if (!rpy->task().removeReply(rpy))
 	    syslog(LOG_WARNING, "didn't remove RPY ID 0x%04x from task %d", id.raw(), rpy->task().id().raw());
 
 #ifdef DEBUG
@@ -281,39 +311,21 @@ void ReplyPool::endRpyId(rpyid_t id, status_t status)
 	    ++rpy->task().stats.usmRcv;
 	    ++rpy->task().taskPool().stats.usmRcv;
 	}
-
-	// Find the entry in the active map that referrs to this reply info
-	// object and erase it.
-
-	ActiveRangeIterator ii =
-	    activeMap.equal_range(request_key_t(rpy->remNode(), rpy->reqId()));
-
-	while (ii.first != ii.second) {
-	    auto const current = ii.first;
-
-	    if (current->second == rpy) {
-		activeMap.erase(current);
-		break;
-	    } else
-		++(ii.first);
-	}
 	release(rpy);
     }
 }
 
+// Sends ACNET_PEND for the replies that have gone quiet too long
+// and returns how long the main loop may sleep before calling again,
+// or -1 if there are no replies to watch.
+
 int ReplyPool::sendReplyPendsAndGetNextTimeout()
 {
     RpyInfo* rpy;
 
-    while (0 != (rpy = getOldest())) {
-	int64_t const expiration = rpy->expiration();
-
-	if (expiration <= now())
-	    rpy->xmitReply(ACNET_PEND, 0, 0, false);
-	else
-	    return expiration - now();
-    }
-    return -1;
+    while (0 != (rpy = static_cast<RpyInfo*>(timers.expired(now()))))
+	rpy->xmitReply(ACNET_PEND, 0, 0, false);
+    return timers.timeout(now());
 }
 
 static bool rpyInList(RpyInfo const* const rpy, uint8_t subType,
@@ -361,7 +373,7 @@ void ReplyPool::fillActiveReplies(AcnetRpyList& rl, uint8_t subType, uint16_t co
     RpyInfo const* rpy = 0;
 
     rl.total = 0;
-    while (0 != (rpy = idPool.next(rpy)))
+    while (rl.total < sizeof(rl.ids) / sizeof(*rl.ids) && 0 != (rpy = idPool.next(rpy)))
 	if (!n || rpyInList(rpy, subType, data, n))
 	    rl.ids[rl.total++] = htoas(rpy->id().raw());
 }
@@ -393,8 +405,11 @@ void ReplyPool::generateRpyReport(std::ostream& os)
 
     RpyInfo const* rpy = 0;
 
+    os << "<br>Reply ID pool size: " << idPool.capacity();
     os << "<br>Active reply IDs: " << idPool.activeIdCount();
-    os << "<br>Max active reply IDs: " << idPool.maxActiveIdCount() << "<br>";
+    os << "<br>Max active reply IDs: " << idPool.maxActiveIdCount();
+    os << "<br>Times the pool ran out: " << idPool.exhaustedCount();
+    os << "<br>Quota per task: " << IdQuota::perTask << ", per handle: " << IdQuota::perHandle << " (0 is none)<br>";
 
     while (0 != (rpy = idPool.next(rpy))) {
 
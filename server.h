@@ -20,9 +20,12 @@
 #include <memory>
 #include <stdexcept>
 #include "idpool.h"
+#include "keyindex.h"
 #include "trunknode.h"
 
 class TaskPool;
+class TcpClientProtocolHandler;
+struct z_stream_s;
 
 // These symbols will help us port the code to several Unix operating
 // systems that we use. We're trying to keep the conditional code to a
@@ -292,6 +295,7 @@ struct TaskStats {
     StatCounter reqXmt;
     StatCounter rpyXmt;
     StatCounter lostPkt;
+    StatCounter idRefused;
 };
 
 struct NodeStats {
@@ -371,8 +375,16 @@ class QueueAdaptor : protected BufferQueue {
 #define	RPY_M_ENDMULT		(0x02)		// terminate multiple reply request
 #define	REQ_M_MULTRPY		(0x01)		// multiple reply request
 
+// The number of request and reply IDs in each node's pools. They can
+// be set when acnetd is built (see the Makefile) to a power of two up
+// to 32768.
+
+#ifndef N_REQID
 #define N_REQID			8192
+#endif
+#ifndef N_RPYID
 #define N_RPYID			8192
+#endif
 
 // ACNET protocol packet header
 
@@ -430,6 +442,7 @@ extern const status_t ACNET_TRP;
 extern const status_t ACNET_NOTASK;
 extern const status_t ACNET_DISCONNECTED;
 extern const status_t ACNET_LEVEL2;
+extern const status_t ACNET_QUOTA;
 extern const status_t ACNET_NODE_DOWN;
 extern const status_t ACNET_BUG;
 extern const status_t ACNET_INVARG;
@@ -478,7 +491,14 @@ enum class CommandList : uint16_t {
 	cmdTcpConnect  			= be16(21),
 	cmdTcpConnectExt		= be16(23),
 
-	cmdDefaultNode 			= be16(22)
+	cmdDefaultNode 			= be16(22),
+
+	cmdSendReplies			= be16(24),
+	cmdSetOptions			= be16(25),
+	cmdRequestAcks			= be16(26),
+	cmdGrantCredits			= be16(27),
+	cmdSetFilter			= be16(28),
+	cmdSendRequests			= be16(29)
 };
 
 enum class AckList : uint16_t {
@@ -495,6 +515,13 @@ enum class AckList : uint16_t {
 
 	ackTaskPid			= be16(6),
 	ackNodeStats			= be16(7),
+
+	ackSendReplies			= be16(8),
+
+	ackSetOptions			= be16(9),
+	ackBatch			= be16(10),
+	ackRequestAcks			= be16(11),
+	ackSendRequests			= be16(12),
 };
 
 // This is the command header for all commands send from the client to
@@ -655,6 +682,9 @@ struct SendCommand : public CommandHeaderBase<CommandList::cmdSend> {
     inline trunknode_t addr() const { return trunknode_t(ntohs(addr_)); }
     inline taskhandle_t task() const { return taskhandle_t(ntohl(task_)); }
     inline uint8_t const *data() const { return data_; }
+
+    inline void setAddr(trunknode_t addr) { addr_ = htons(addr.raw()); }
+    inline void setTask(taskhandle_t task) { task_ = htonl(task.raw()); }
 } __attribute__((packed));
 
 ASSERT_SIZE(SendCommand, 16);
@@ -725,6 +755,10 @@ struct SendRequestCommand :
     inline taskhandle_t task() const { return taskhandle_t(ntohl(task_)); }
     inline uint16_t flags() const { return ntohs(flags_); }
     inline uint8_t const *data() const { return data_; }
+
+    inline void setAddr(trunknode_t addr) { addr_ = htons(addr.raw()); }
+    inline void setTask(taskhandle_t task) { task_ = htonl(task.raw()); }
+    inline void setFlags(uint16_t flags) { flags_ = htons(flags); }
 } __attribute__((packed));
 
 ASSERT_SIZE(SendRequestCommand, 18);
@@ -749,6 +783,41 @@ struct SendRequestWithTimeoutCommand :
 
 ASSERT_SIZE(SendRequestWithTimeoutCommand, 22);
 
+// Sent by a client that wants to send the same request to several
+// nodes. The list of nodes immediately follows the fixed fields and
+// the payload follows the list. A timeout of 0 selects the default
+// request timeout. An AckSendRequests, holding a request ID and a
+// status for each node, is sent back to the client.
+
+#define MAX_REQUEST_FANOUT	1024
+
+struct SendRequestsCommand :
+    public CommandHeaderBase<CommandList::cmdSendRequests> {
+
+ private:
+    uint32_t task_;
+    uint16_t flags_;
+    uint32_t timeout_;
+    uint16_t count_;
+    uint16_t addrs_[];
+
+ public:
+    inline taskhandle_t task() const { return taskhandle_t(ntohl(task_)); }
+    inline uint16_t flags() const { return ntohs(flags_); }
+    inline uint32_t timeout() const { return ntohl(timeout_); }
+    inline uint16_t count() const { return ntohs(count_); }
+    inline trunknode_t addr(size_t ii) const { return trunknode_t(ntohs(addrs_[ii])); }
+    inline uint8_t const *data() const { return (uint8_t const*) (addrs_ + count()); }
+
+    inline void setTask(taskhandle_t task) { task_ = htonl(task.raw()); }
+    inline void setFlags(uint16_t flags) { flags_ = htons(flags); }
+    inline void setTimeout(uint32_t timeout) { timeout_ = htonl(timeout); }
+    inline void setCount(uint16_t count) { count_ = htons(count); }
+    inline void setAddr(size_t ii, trunknode_t addr) { addrs_[ii] = htons(addr.raw()); }
+} __attribute__((packed));
+
+ASSERT_SIZE(SendRequestsCommand, 22);
+
 struct SendReplyCommand : public CommandHeaderBase<CommandList::cmdSendReply> {
  private:
     uint16_t rpyid_;
@@ -761,10 +830,46 @@ struct SendReplyCommand : public CommandHeaderBase<CommandList::cmdSendReply> {
     inline uint16_t flags() const { return ntohs(flags_); }
     inline status_t status() const { return status_t(ntohs(status_)); }
     inline uint8_t const *data() const { return data_; }
+
+    inline void setRpyid(rpyid_t rpyid) { rpyid_ = htons(rpyid.raw()); }
+    inline void setFlags(uint16_t flags) { flags_ = htons(flags); }
+    inline void setStatus(status_t status) { status_ = htons(status.raw()); }
 } __attribute__((packed));
 
 ASSERT_SIZE(SendReplyCommand, 16);
 
+// Sent by a client that wants to send the same reply payload to
+// several of its reply IDs. The list of reply IDs immediately follows
+// the fixed fields and the payload follows the list. An
+// AckSendReplies, holding a status for each reply ID, is sent back to
+// the client.
+
+#define MAX_REPLY_FANOUT	1024
+
+struct SendRepliesCommand :
+    public CommandHeaderBase<CommandList::cmdSendReplies> {
+
+ private:
+    uint16_t flags_;
+    int16_t status_;
+    uint16_t count_;
+    uint16_t rpyids_[];
+
+ public:
+    inline uint16_t flags() const { return ntohs(flags_); }
+    inline status_t status() const { return status_t(ntohs(status_)); }
+    inline uint16_t count() const { return ntohs(count_); }
+    inline rpyid_t rpyid(size_t ii) const { return rpyid_t(ntohs(rpyids_[ii])); }
+    inline uint8_t const *data() const { return (uint8_t const*) (rpyids_ + count()); }
+
+    inline void setFlags(uint16_t flags) { flags_ = htons(flags); }
+    inline void setStatus(status_t status) { status_ = htons(status.raw()); }
+    inline void setCount(uint16_t count) { count_ = htons(count); }
+    inline void setRpyid(size_t ii, rpyid_t rpyid) { rpyids_[ii] = htons(rpyid.raw()); }
+} __attribute__((packed));
+
+ASSERT_SIZE(SendRepliesCommand, 16);
+
 struct IgnoreRequestCommand :
     public CommandHeaderBase<CommandList::cmdIgnoreRequest> {
 
@@ -783,6 +888,7 @@ struct CancelCommand : public CommandHeaderBase<CommandList::cmdCancel> {
 
  public:
     inline reqid_t reqid() const { return reqid_t(ntohs(reqid_)); }
+    inline void setReqid(reqid_t reqid) { reqid_ = htons(reqid.raw()); }
 } __attribute__((packed));
 
 ASSERT_SIZE(CancelCommand, 12);
@@ -805,6 +911,23 @@ struct RequestAckCommand :
 
 ASSERT_SIZE(RequestAckCommand, 12);
 
+// Acknowledges several requests at once. An AckRequestAcks, holding a
+// status for each reply ID, is sent back to the client.
+
+struct RequestAcksCommand :
+    public CommandHeaderBase<CommandList::cmdRequestAcks> {
+
+ private:
+    uint16_t count_;
+    uint16_t rpyids_[];
+
+ public:
+    inline uint16_t count() const { return ntohs(count_); }
+    inline rpyid_t rpyid(size_t ii) const { return rpyid_t(ntohs(rpyids_[ii])); }
+} __attribute__((packed));
+
+ASSERT_SIZE(RequestAcksCommand, 12);
+
 struct AddNodeCommand : public CommandHeaderBase<CommandList::cmdAddNode> {
  private:
     uint32_t ipAddr_;
@@ -833,6 +956,134 @@ struct NodeStatsCommand :
 
 ASSERT_SIZE(NodeStatsCommand, 10);
 
+// Connection options. A client sends a SetOptions command right after
+// it connects to select the options it wants; the AckSetOptions holds
+// the options actually in effect, so older acnetd's simply report the
+// bits they don't know about as cleared.
+//
+// CONN_M_PIPELINE: every following command datagram ends with a
+// 16-bit, big-endian sequence number chosen by the client. Acks are no
+// longer sent one per command but are returned, tagged with that
+// sequence number, in AckBatch messages so the client may have many
+// commands in flight. Commands that don't need a connection (name and
+// node lookups, etc.) are never tagged.
+//
+// CONN_M_ERRACKS: Send, SendReply, SendReplies and GrantCredits
+// commands are only acked when they fail. The AckSendReply of a failed reply holds its
+// reply ID; a failed Send can only be matched to its command through
+// the sequence number, so the option is only granted along with
+// CONN_M_PIPELINE.
+//
+// CONN_M_IMPLICITACK: the client doesn't send RequestAck commands;
+// the first reply to a request acknowledges it. (Without the option
+// acnetd still does this, but logs the request as un-acked.)
+//
+// CONN_M_CREDITS: each packet sent to the client's data socket uses up
+// one credit. The client hands out credits with GrantCredits commands
+// (and may pass an initial amount in SetOptionsCredits.) Without
+// credits, incoming requests are refused with ACNET_BUSY while replies
+// and other packets are queued, up to MAX_PENDING_BYTES, until credits
+// arrive.
+
+#define CONN_M_PIPELINE		(0x0001)
+#define CONN_M_ERRACKS		(0x0002)
+#define CONN_M_IMPLICITACK	(0x0004)
+#define CONN_M_CREDITS		(0x0008)
+#define CONN_M_ALL		(CONN_M_PIPELINE | CONN_M_ERRACKS | CONN_M_IMPLICITACK | CONN_M_CREDITS)
+
+#define MAX_PENDING_BYTES	(1024 * 1024)
+
+struct SetOptionsCommand :
+    public CommandHeaderBase<CommandList::cmdSetOptions> {
+
+ private:
+    uint32_t options_;
+
+ public:
+    inline uint32_t options() const { return ntohl(options_); }
+    inline void setOptions(uint32_t options) { options_ = htonl(options); }
+} __attribute__((packed));
+
+ASSERT_SIZE(SetOptionsCommand, 14);
+
+struct SetOptionsCreditsCommand : public SetOptionsCommand {
+ private:
+    uint32_t credits_;
+
+ public:
+    inline uint32_t credits() const { return ntohl(credits_); }
+} __attribute__((packed));
+
+ASSERT_SIZE(SetOptionsCreditsCommand, 18);
+
+// Adds to the number of packets the client is willing to receive on
+// its data socket (see CONN_M_CREDITS.) An Ack is sent back to the
+// client.
+
+struct GrantCreditsCommand :
+    public CommandHeaderBase<CommandList::cmdGrantCredits> {
+
+ private:
+    uint32_t credits_;
+
+ public:
+    inline uint32_t credits() const { return ntohl(credits_); }
+    inline void setCredits(uint32_t credits) { credits_ = htonl(credits); }
+} __attribute__((packed));
+
+ASSERT_SIZE(GrantCreditsCommand, 14);
+
+// A delivery filter is a list of rules that USMs (including multicasts)
+// must pass before acnetd hands them to the client. A packet passes if
+// it matches any rule; it matches a rule if it satisfies every test
+// enabled in the rule's flags. The tests compare the sending node, the
+// first word of the payload (its type code, in ACNET byte order) and
+// the leading bytes of the payload. An empty filter passes everything.
+
+#define FILTER_M_NODE		(0x0001)
+#define FILTER_M_TYPECODE	(0x0002)
+#define FILTER_M_PREFIX		(0x0004)
+
+#define FILTER_PREFIX_SIZE	8
+#define MAX_FILTER_RULES	16
+
+struct FilterRule {
+ private:
+    uint16_t flags_;
+    uint16_t node_;
+    uint16_t typeCode_;
+    uint16_t prefixLen_;
+    uint8_t prefix_[FILTER_PREFIX_SIZE];
+
+ public:
+    inline uint16_t flags() const { return ntohs(flags_); }
+    inline trunknode_t node() const { return trunknode_t(ntohs(node_)); }
+    inline uint16_t typeCode() const { return ntohs(typeCode_); }
+    inline size_t prefixLen() const { return ntohs(prefixLen_) < FILTER_PREFIX_SIZE ? ntohs(prefixLen_) : FILTER_PREFIX_SIZE; }
+    inline uint8_t const* prefix() const { return prefix_; }
+
+    bool matches(AcnetHeader const&) const;
+} __attribute__((packed));
+
+ASSERT_SIZE(FilterRule, 16);
+
+// Replaces the task's delivery filter. Sending zero rules removes the
+// filter. An Ack is sent back to the client.
+
+struct SetFilterCommand :
+    public CommandHeaderBase<CommandList::cmdSetFilter> {
+
+ private:
+    uint16_t count_;
+    FilterRule rules_[];
+
+ public:
+    inline uint16_t count() const { return ntohs(count_); }
+    inline FilterRule const& rule(size_t ii) const { return rules_[ii]; }
+} __attribute__((packed));
+
+ASSERT_SIZE(SetFilterCommand, 12);
+
 class AckHeader {
  private:
     AckList const cmd_;
@@ -867,6 +1118,8 @@ struct AckConnect : public AckHeader {
 
  public:
     AckConnect() : AckHeader(AckList::ackConnect) { }
+    taskid_t taskId() const { return taskid_t(id_); }
+    taskhandle_t clientName() const { return taskhandle_t(ntohl(clientName_)); }
     void setTaskId(taskid_t id) { id_ = (uint8_t) id.raw(); }
     void setClientName(taskhandle_t clientName) { clientName_ = htonl(clientName.raw()); }
 } __attribute__((packed));
@@ -892,6 +1145,7 @@ struct AckSendRequest : public AckHeader {
 
  public:
     AckSendRequest() : AckHeader(AckList::ackSendRequest) { }
+    reqid_t requestId() const { return reqid_t(ntohs(reqid_)); }
     void setRequestId(reqid_t reqid) { reqid_ = htons(reqid.raw()); }
 } __attribute__((packed));
 
@@ -899,14 +1153,119 @@ ASSERT_SIZE(AckSendRequest, 6);
 
 struct AckSendReply : public AckHeader {
  private:
-    uint16_t _flags;
+    uint16_t rpyid_;
 
  public:
-    AckSendReply() : AckHeader(AckList::ackSendReply) { }
+    AckSendReply() : AckHeader(AckList::ackSendReply), rpyid_(0) { }
+    rpyid_t replyId() const { return rpyid_t(ntohs(rpyid_)); }
+    void setReplyId(rpyid_t rpyid) { rpyid_ = htons(rpyid.raw()); }
 } __attribute__((packed));
 
 ASSERT_SIZE(AckSendReply, 6);
 
+// Acks that hold a status for each ID of a bulk command. Only the
+// first 'count' entries of the status array are sent to the client
+// (see size().)
+
+template<AckList Cmd>
+struct AckStatusList : public AckHeader {
+ private:
+    uint16_t count_;
+    int16_t status_[MAX_REPLY_FANOUT];
+
+ public:
+    AckStatusList() : AckHeader(Cmd), count_(0) { }
+    uint16_t count() const { return ntohs(count_); }
+    status_t status(size_t ii) const { return status_t(ntohs(status_[ii])); }
+    void setCount(uint16_t count) { count_ = htons(count); }
+    void setStatus(size_t ii, status_t status) { status_[ii] = htons(status.raw()); }
+    using AckHeader::status;
+    using AckHeader::setStatus;
+    size_t size() const { return sizeof(AckHeader) + sizeof(count_) + ntohs(count_) * sizeof(*status_); }
+} __attribute__((packed));
+
+typedef AckStatusList<AckList::ackSendReplies> AckSendReplies;
+typedef AckStatusList<AckList::ackRequestAcks> AckRequestAcks;
+
+ASSERT_SIZE(AckSendReplies, 6 + 2 * MAX_REPLY_FANOUT);
+ASSERT_SIZE(AckRequestAcks, 6 + 2 * MAX_REPLY_FANOUT);
+
+// The entries of an AckSendRequests are in the order of the
+// command's node list. Only the first 'count' entries are sent to the
+// client (see size().)
+
+struct AckSendRequests : public AckHeader {
+ private:
+    struct Entry {
+	int16_t status_;
+	uint16_t reqid_;
+    } __attribute__((packed));
+
+    uint16_t count_;
+    Entry entries_[MAX_REQUEST_FANOUT];
+
+ public:
+    AckSendRequests() : AckHeader(AckList::ackSendRequests), count_(0) { }
+    uint16_t count() const { return ntohs(count_); }
+    status_t status(size_t ii) const { return status_t(ntohs(entries_[ii].status_)); }
+    reqid_t requestId(size_t ii) const { return reqid_t(ntohs(entries_[ii].reqid_)); }
+    void setCount(uint16_t count) { count_ = htons(count); }
+    void setEntry(size_t ii, status_t status, reqid_t reqid)
+    {
+	entries_[ii].status_ = htons(status.raw());
+	entries_[ii].reqid_ = htons(reqid.raw());
+    }
+    using AckHeader::status;
+    size_t size() const { return sizeof(AckHeader) + sizeof(count_) + ntohs(count_) * sizeof(*entries_); }
+} __attribute__((packed));
+
+ASSERT_SIZE(AckSendRequests, 6 + 4 * MAX_REQUEST_FANOUT);
+
+struct AckSetOptions : public AckHeader {
+ private:
+    uint32_t options_;
+
+ public:
+    AckSetOptions() : AckHeader(AckList::ackSetOptions), options_(0) { }
+    uint32_t options() const { return ntohl(options_); }
+    void setOptions(uint32_t options) { options_ = htonl(options); }
+} __attribute__((packed));
+
+ASSERT_SIZE(AckSetOptions, 8);
+
+// Acks for pipelined clients are collected into an AckBatch which is
+// sent once acnetd has run out of queued commands (or the batch is
+// full.) The header is followed by 'count' entries, each being an
+// AckBatchEntry and then the ack exactly as a lock-step client would
+// have received it.
+
+#define MAX_ACK_BATCH		(16 * 1024)
+
+struct AckBatch : public AckHeader {
+ private:
+    uint16_t count_;
+
+ public:
+    AckBatch() : AckHeader(AckList::ackBatch), count_(0) { }
+    uint16_t count() const { return ntohs(count_); }
+    void setCount(uint16_t count) { count_ = htons(count); }
+} __attribute__((packed));
+
+ASSERT_SIZE(AckBatch, 6);
+
+struct AckBatchEntry {
+ private:
+    uint16_t seq_;
+    uint16_t len_;
+
+ public:
+    AckBatchEntry(uint16_t seq, uint16_t len) : seq_(htons(seq)), len_(htons(len)) { }
+    uint16_t seq() const { return ntohs(seq_); }
+    uint16_t len() const { return ntohs(len_); }
+} __attribute__((packed));
+
+ASSERT_SIZE(AckBatchEntry, 4);
+
 struct AckNameLookup : public AckHeader {
  private:
     uint8_t trunk;
@@ -914,6 +1273,7 @@ struct AckNameLookup : public AckHeader {
 
  public:
     AckNameLookup() : AckHeader(AckList::ackNameLookup) { }
+    trunknode_t trunkNode() const { return trunknode_t(trunk_t(size_t(trunk)), node_t(size_t(node))); }
     void setTrunkNode(trunknode_t addr) { trunk = addr.trunk().raw(); node = addr.node().raw(); }
 } __attribute__((packed));
 
@@ -995,6 +1355,7 @@ ASSERT_SIZE(AcnetClientMessage, 9);
 // Project-wide types...
 
 class TaskInfo;
+class ExternalTask;
 
 struct reqDetail {
     uint16_t id;
@@ -1005,25 +1366,56 @@ struct reqDetail {
     uint32_t lastUpdate;
 };
 
+// Lists of active IDs sent in reply to the ACNET task. A list has to
+// fit in one reply, which holds fewer IDs than the largest pools.
+
+#define MAX_ID_LIST(n)	((n) < INTERNAL_ACNET_USER_PACKET_SIZE / 2 ? (n) : INTERNAL_ACNET_USER_PACKET_SIZE / 2)
+
 struct AcnetReqList {
     uint16_t total;
-    uint16_t ids[N_REQID];
+    uint16_t ids[MAX_ID_LIST(N_REQID)];
 };
 
 struct AcnetRpyList {
     uint16_t total;
-    uint16_t ids[N_RPYID];
+    uint16_t ids[MAX_ID_LIST(N_RPYID)];
 };
 
 #include "timesensitive.h"
 
 class RequestPool;
 
+// IdQuota
+//
+// Caps on the IDs that client tasks can hold at once: a task can
+// hold at most perTask request IDs and perTask reply IDs, and all the
+// tasks connected under one handle (the listeners of a multicast
+// group share theirs) at most perHandle of each. A cap of 0 is no
+// cap. The pools refuse IDs past a cap with ACNET_QUOTA,
+// so one runaway client can't use up the IDs every other task on the
+// node shares. acnetd's own tasks aren't held to the caps.
+//
+struct IdQuota {
+    static size_t perTask, perHandle;
+
+    // When there's a per-handle cap, each pool counts the IDs held
+    // under every handle. An ID keeps the iterator of the count it
+    // was charged to, so that's the one credited when it's released,
+    // and a count is dropped when it reaches zero. Without the cap
+    // nothing is counted and IDs hold the map's end().
+
+    typedef std::map<taskhandle_t, size_t> HandleUse;
+
+    static bool setLimits(char const*);
+    static bool allows(TaskInfo const*, size_t, size_t);
+};
+
 // This class encompasses all the information related to request ids.
 
 class ReqInfo : public TimeSensitive {
  friend class IdPool<ReqInfo, reqid_t, N_REQID>;
  friend class RequestPool;
+ friend class TaskInfo;
 
  private:
     ReqInfo() : task_(0), flags(0), tmoMs(0), initTime_(0) {}
@@ -1036,6 +1428,9 @@ class ReqInfo : public TimeSensitive {
     uint32_t tmoMs;
     bool mcast;
     int64_t initTime_;
+    IdLink<ReqInfo> taskLink;
+    IdLink<ReqInfo> nodeLink;
+    IdQuota::HandleUse::iterator handleUse;
 
 public:
     mutable StatCounter totalPackets;
@@ -1056,8 +1451,16 @@ class RequestPool {
  friend class ReqInfo;
 
  private:
+    // The open requests to each remote node, so they can all be
+    // ended when the node goes away. A node's list is kept once it's
+    // been made, so opening requests doesn't touch the heap.
+
+    typedef IdList<ReqInfo, &ReqInfo::nodeLink> NodeList;
+
     IdPool<ReqInfo, reqid_t, N_REQID> idPool;
-    Node root;
+    TimerWheel timers;
+    std::map<trunknode_t, NodeList> byNode;
+    IdQuota::HandleUse handleUse;
     void release(ReqInfo *);
 
  public:
@@ -1070,8 +1473,12 @@ class RequestPool {
     ReqInfo *next(ReqInfo const * const req) const 	{ return idPool.next(req); }
     ReqInfo *entry(reqid_t const id) 			{ return idPool.entry(id); }
 
-    ReqInfo *oldest();
-    void update(ReqInfo* req) 				{ req->update(&root); }
+    size_t capacity() const				{ return idPool.capacity(); }
+    size_t activeIdCount() const			{ return idPool.activeIdCount(); }
+    size_t maxActiveIdCount() const			{ return idPool.maxActiveIdCount(); }
+    size_t exhaustedCount() const			{ return idPool.exhaustedCount(); }
+
+    void update(ReqInfo* req) 				{ req->update(timers); }
 
     void fillActiveRequests(AcnetReqList&l, uint8_t, uint16_t const*, uint16_t);
     bool fillRequestDetail(reqid_t, reqDetail* const);
@@ -1095,6 +1502,7 @@ class ReplyPool;
 class RpyInfo : public TimeSensitive {
  friend class IdPool<RpyInfo, rpyid_t, N_RPYID>;
  friend class ReplyPool;
+ friend class TaskInfo;
 
  private:
     RpyInfo() : task_(0), flags(0), taskId_(0), initTime_(0) {}
@@ -1109,6 +1517,9 @@ class RpyInfo : public TimeSensitive {
     reqid_t reqId_;
     int64_t initTime_;
     bool acked;
+    IdLink<RpyInfo> taskLink;
+    IdLink<RpyInfo> nodeLink;
+    IdQuota::HandleUse::iterator handleUse;
 
  public:
     mutable StatCounter totalPackets;
@@ -1135,7 +1546,7 @@ class RpyInfo : public TimeSensitive {
     reqid_t reqId() const		{ return reqId_; }
     int64_t initTime() const		{ return initTime_; }
 
-    bool xmitReply(status_t, void const*, size_t, bool);
+    bool xmitReply(status_t, void const*, size_t, bool, bool = false);
 };
 
 class ReplyPool {
@@ -1173,15 +1584,25 @@ class ReplyPool {
 	bool operator< (request_key_t const o) const { return key_ < o.key_; }
 	bool operator== (request_key_t const o) const { return key_ == o.key_; }
 	bool operator!= (request_key_t const o) const { return key_ != o.key_; }
+	uint32_t raw() const { return key_; }
     };
 
-    typedef std::multimap<request_key_t, RpyInfo*> ActiveMap;
-    typedef std::pair<ActiveMap::iterator, ActiveMap::iterator> ActiveRangeIterator;
+    // Finds the reply for an incoming request's node and request ID.
+    // Multicast requests can give several local tasks a reply for the
+    // same key.
+
+    typedef KeyIndex<RpyInfo, 2 * N_RPYID> ActiveIndex;
+
+    // The open replies to each remote node (see RequestPool::NodeList.)
 
-    IdPool<RpyInfo, rpyid_t, N_REQID> idPool;
-    Node root;
+    typedef IdList<RpyInfo, &RpyInfo::nodeLink> NodeList;
 
-    ActiveMap activeMap;
+    IdPool<RpyInfo, rpyid_t, N_RPYID> idPool;
+    TimerWheel timers;
+
+    ActiveIndex activeIndex;
+    std::map<trunknode_t, NodeList> byNode;
+    IdQuota::HandleUse handleUse;
 
     #ifdef PINGER
     ActiveTargetMap targetMap;
@@ -1204,13 +1625,17 @@ class ReplyPool {
 
     RpyInfo *next(RpyInfo const * const rpy) const 	{ return idPool.next(rpy); }
 
-    status_t sendReplyToNetwork(TaskInfo const*, rpyid_t, status_t, void const*, size_t, bool);
+    size_t capacity() const				{ return idPool.capacity(); }
+    size_t activeIdCount() const			{ return idPool.activeIdCount(); }
+    size_t maxActiveIdCount() const			{ return idPool.maxActiveIdCount(); }
+    size_t exhaustedCount() const			{ return idPool.exhaustedCount(); }
+
+    status_t sendReplyToNetwork(TaskInfo const*, rpyid_t, status_t, void const*, size_t, bool, bool = false);
     void endRpyToNode(trunknode_t const);
     void endRpyId(rpyid_t, status_t = ACNET_SUCCESS);
     int sendReplyPendsAndGetNextTimeout();
 
-    RpyInfo *getOldest();
-    void update(RpyInfo* rpy) 		{ rpy->update(&root); }
+    void update(RpyInfo* rpy) 		{ rpy->update(timers); }
 
     void fillActiveReplies(AcnetRpyList&, uint8_t, uint16_t const*, uint16_t);
     bool fillReplyDetail(rpyid_t, rpyDetail* const);
@@ -1228,10 +1653,7 @@ class Noncopyable {
     ~Noncopyable() {}
 };
 
-typedef std::set<reqid_t> ReqList;
-typedef std::set<rpyid_t> RpyList;
-
-#define	MAX_TASKS		(N_REQID / 4)
+#define	MAX_TASKS		2048
 
 // TaskInfo
 //
@@ -1252,6 +1674,13 @@ class TaskInfo : private Noncopyable {
     TaskInfo();
 
  protected:
+
+    // A task's open requests and replies are threaded through their
+    // pool entries.
+
+    typedef IdList<ReqInfo, &ReqInfo::taskLink> ReqList;
+    typedef IdList<RpyInfo, &RpyInfo::taskLink> RpyList;
+
     ReqList requests;
     RpyList replies;
 
@@ -1275,6 +1704,14 @@ class TaskInfo : private Noncopyable {
     virtual bool needsToBeThrottled() const = 0;
     virtual bool stillAlive(int = 0) const = 0;
     virtual bool equals(TaskInfo const* o) const = 0;
+
+    // Returns true if the other task was connected by the same client
+    // (all of its tasks are removed together by TaskPool::removeTask().)
+
+    virtual bool sameClient(TaskInfo const* o) const { return pid() == o->pid(); }
+    virtual bool implicitRequestAck() const { return false; }
+    virtual bool hasCredit() const { return true; }
+    virtual bool passesFilter(AcnetHeader const&) const { return true; }
     TaskPool& taskPool() const	{ return taskPool_; }
     taskhandle_t handle() const	{ return handle_; }
     taskid_t id() const 	{ return id_; }
@@ -1287,12 +1724,12 @@ class TaskInfo : private Noncopyable {
 
     // Request/reply
 
-    bool addReply(rpyid_t id)			{ return replies.insert(id).second; }
-    bool addRequest(reqid_t id)			{ return requests.insert(id).second; }
+    bool addReply(RpyInfo* rpy)			{ return replies.insert(rpy); }
+    bool addRequest(ReqInfo* req)		{ return requests.insert(req); }
     size_t requestCount() const			{ return requests.size(); }
     size_t replyCount() const			{ return replies.size(); }
-    bool removeReply(rpyid_t id)		{ return replies.erase(id) != 0; }
-    bool removeRequest(reqid_t id)		{ return requests.erase(id) != 0; }
+    bool removeReply(RpyInfo* rpy)		{ return replies.erase(rpy); }
+    bool removeRequest(ReqInfo* req)		{ return requests.erase(req); }
     bool decrementPendingRequests();
     void testPendingRequestsAndIncrement();
 
@@ -1323,6 +1760,7 @@ class InternalTask : public TaskInfo {
     virtual ~InternalTask() {}
 
     pid_t pid() const;
+    bool sameClient(TaskInfo const* o) const { return o == this; }
     bool acceptsUsm() const { return true; }
     bool acceptsRequests() const { return true; }
     bool needsToBeThrottled() const { return false; }
@@ -1374,7 +1812,7 @@ class AcnetTask : public InternalTask {
     void killerMessageHandler(rpyid_t, uint8_t, uint16_t const* const, uint16_t);
     void tasksHandler(rpyid_t, uint8_t);
     void pingHandler(rpyid_t);
-    void taskResourcesHandler(rpyid_t);
+    void taskResourcesHandler(rpyid_t, uint8_t);
     void resetStats();
     void nodeStatsHandler(rpyid_t, uint8_t);
     void tasksStatsHandler(rpyid_t, uint8_t);
@@ -1401,6 +1839,36 @@ typedef std::multimap<taskhandle_t, TaskInfo*> TaskHandleMap;
 typedef std::pair<TaskHandleMap::const_iterator, TaskHandleMap::const_iterator> TaskRangeIterator;
 typedef std::vector<TaskInfo*> TaskList;
 
+// CommandSource
+//
+// The client a command came from. Local clients send their commands
+// to the client socket; the TCP clients served by the gateway hand
+// theirs over directly. Acks that aren't sent by a task go back
+// through the source, and the source decides which tasks of a pool
+// are its own and what kind of task a connect creates.
+//
+class CommandSource {
+ public:
+    virtual ~CommandSource() {}
+
+    virtual void sendAck(void const*, size_t) = 0;
+    virtual TaskInfo* findTask(TaskPool&, taskhandle_t) const = 0;
+    virtual TaskInfo* newTask(TaskPool&, taskhandle_t, taskid_t, ConnectCommand const*, size_t, ipaddr_t) = 0;
+};
+
+// A client that sent its command to the client socket.
+
+class ClientSocketSource : public CommandSource {
+    sockaddr_in const& in;
+
+ public:
+    explicit ClientSocketSource(sockaddr_in const& in) : in(in) {}
+
+    void sendAck(void const*, size_t);
+    TaskInfo* findTask(TaskPool&, taskhandle_t) const;
+    TaskInfo* newTask(TaskPool&, taskhandle_t, taskid_t, ConnectCommand const*, size_t, ipaddr_t);
+};
+
 // TaskPool
 //
 // This class holds the entire state of an ACNET node allowing acnetd
@@ -1413,6 +1881,7 @@ class TaskPool : private Noncopyable {
     TaskInfo *tasks_[MAX_TASKS];
     TaskHandleMap active;
     TaskList removed;
+    std::vector<ExternalTask*> ackPending;
 
     taskid_t nextFreeTaskId(ConnectCommand const* const);
     void removeInactiveTasks();
@@ -1426,7 +1895,7 @@ class TaskPool : private Noncopyable {
     TaskPool(trunknode_t, nodename_t);
     ~TaskPool() {}
 
-    void handleConnect(sockaddr_in const&, ConnectCommand const* const, size_t);
+    void handleConnect(CommandSource&, ConnectCommand const* const, size_t);
     void addTask(TaskInfo *);
 
     trunknode_t node() const { return node_; }
@@ -1434,6 +1903,7 @@ class TaskPool : private Noncopyable {
 
     size_t fillBufferWithTaskInfo(uint8_t, uint16_t[]);
     size_t fillBufferWithTaskStats(uint8_t, void*);
+    size_t fillBufferWithTaskIdUsage(void*);
 
 #ifndef NO_REPORT
     void generateReport();
@@ -1451,8 +1921,11 @@ class TaskPool : private Noncopyable {
     bool taskExists(taskhandle_t) const;
     TaskRangeIterator tasks(taskhandle_t) const;
     void removeAllTasks();
+    void queueAckFlush(ExternalTask *);
+    void flushPendingAcks();
     void removeTask(TaskInfo *);
     void removeOnlyThisTask(TaskInfo *, status_t = ACNET_DISCONNECTED, bool = false);
+    void removeClientTasks(TcpClientProtocolHandler const*);
     bool rename(TaskInfo *, taskhandle_t);
     bool isPromiscuous(taskhandle_t) const;
 };
@@ -1468,73 +1941,138 @@ struct pollfd;
 #define ACNETD_ACK	(2)
 #define ACNETD_DATA	(3)
 
-#define SOCKET_BUFSIZE		(128 * 1024)
-#define MAX_SOCKET_QUESIZE	((500 * 1024 * 1024) / SOCKET_BUFSIZE)
+// Carries the token of a resumable session (see TcpClientGateway) to
+// a client that asked for one in its handshake.
 
-class SocketBuffer {
-    size_t _length;
-    size_t _remaining;
-    uint8_t _buffer[SOCKET_BUFSIZE];
+#define ACNETD_SESSION	(4)
 
-  public:
-    SocketBuffer(const void *buf, const size_t len)
-    {
-	this->_remaining = len;
-	this->_length = len;
-	memcpy(this->_buffer, buf, len);
-    }
+// Default high- and low-water marks, in bytes, of a TCP client's send
+// queue (see the -q option.)
 
-    const void *data()
-    {
-	return _buffer + (_length - _remaining);
-    }
+#define DEFAULT_QUEUE_HIGH_WATER	(32 * 1024 * 1024)
+#define DEFAULT_QUEUE_LOW_WATER		(8 * 1024 * 1024)
 
-    size_t remaining()
-    {
-	return _remaining;
-    }
+// Under the policies that keep a slow client connected, it's still
+// dropped once its queue reaches this many times the high-water mark.
 
-    SocketBuffer *append(const void *buf, const size_t len)
-    {
-	const size_t free = sizeof(_buffer) - _length;
-
-	if (free >= len) {
-	    memcpy(_buffer + _length, buf, len);
-	    _length += len;
-	    _remaining += len;
-	    return 0;
-	} else {
-	    memcpy(_buffer + _length, buf, free);
-	    _length += free;
-	    _remaining += free;
-	    return new SocketBuffer(((uint8_t *) buf) + free, len - free);
-	}
-    }
+#define QUEUE_LIMIT_FACTOR	4
 
-    void consume(const size_t len)
-    {
-	assert(_remaining >= len);
-	_remaining -= len;
-    }
+// SocketBuffer
+//
+// A reference counted copy of bytes waiting to be written to a TCP
+// client. Buffers are sized to what they hold, and one buffer can sit
+// in the queues of several clients (see SharedPacket.)
+//
+class SocketBuffer : private Noncopyable {
+    size_t refs;
+    size_t const _length;
+    uint8_t _data[];
 
-    bool empty()
-    {
-	return _remaining == 0;
-    }
+    explicit SocketBuffer(size_t len) : refs(1), _length(len) {}
+
+ public:
+    static SocketBuffer* create(void const*, size_t, void const* = 0, size_t = 0);
+
+    SocketBuffer* acquire() { ++refs; return this; }
+    void release();
+
+    uint8_t const* data() const { return _data; }
+    size_t length() const { return _length; }
+};
+
+// The send queue of a TCP client holds references to buffers along
+// with how much of each has already been written. A frame may span
+// more than one chunk; 'first' marks the chunk that starts one.
+
+struct SocketChunk {
+    SocketBuffer* buf;
+    size_t offset;
+    bool first;
+
+    uint8_t const* data() const { return buf->data() + offset; }
+    size_t remaining() const { return buf->length() - offset; }
 };
 
-typedef QueueAdaptor< SocketBuffer > SocketQueue;
+typedef std::deque<SocketChunk> SocketQueue;
+
+// SharedPacket
+//
+// Marks a packet that is about to be sent to several clients. While
+// the object is in scope, the TCP clients that can't write the packet
+// right away queue references to one copy of it instead of copying it
+// themselves.
+//
+class SharedPacket : private Noncopyable {
+    static SharedPacket* current;
+
+    void const* const pkt;
+    size_t const len;
+    SocketBuffer* buf;
 
-class TcpClientProtocolHandler : private Noncopyable
+ public:
+    SharedPacket(void const*, size_t);
+    ~SharedPacket();
+
+    static SocketBuffer* find(void const*, size_t);
+};
+
+class TcpClientProtocolHandler : private Noncopyable, public CommandSource
 {
     SocketQueue socketQ;
-    size_t maxSocketQSize;
+    size_t queuedBytes;
+    size_t maxQueuedBytes;
+
+    void enqueue(SocketBuffer*, size_t, bool);
+    void consume(size_t);
+
+    // A detached handler has lost its client but is waiting for it
+    // to resume its session. Its packets are queued until then.
+
+    bool detached;
+
+    // Slow-consumer state. A client is congested from the time its
+    // queue reaches the high-water mark until it drains to the
+    // low-water mark.
 
-    int getSocketPort(int);
+    bool congested, overflow;
+    uint64_t congestions, replyDrops;
+    mutable uint64_t busyRefusals;
+
+    // A forked handler frames everything it reads from acnetd's data
+    // socket in one pass before writing any of it to the client.
+
+    bool batching;
+    uint64_t dataWrites, dataPackets;
+
+    static bool holding;
+
+    // Anonymous tasks of an in-process client are named from an ID
+    // handed out when the handler is created. Unlike the descriptor,
+    // it isn't reused by the next connection while a detached
+    // session still holds the old tasks.
+
+    uint32_t const anonId;
+    static uint32_t nextAnonId;
 
  public:
     enum Traffic { AckTraffic, AllTraffic };
 
+    // What happens to a client whose queue reaches the high-water
+    // mark: it's disconnected; requests to its tasks are refused
+    // with ACNET_BUSY; or the replies in the middle of its
+    // multiple-reply streams are dropped. Only acnetd can refuse
+    // requests, so a forked client (-F) under the busy policy just
+    // keeps queueing until it hits the limit.
+
+    enum SlowPolicy { DisconnectSlow, BusySlow, DropSlow };
+
+    static SlowPolicy slowPolicy;
+    static size_t highWater, lowWater;
+
+    static bool setSlowPolicy(char const*, size_t, size_t);
+
+    static int socketPort(int);
+
  protected:
     int sTcp, sCmd, sData;
     nodename_t tcpNode;
@@ -1542,44 +2080,104 @@ class TcpClientProtocolHandler : private Noncopyable
 
     Traffic enabledTraffic;
 
-    bool readBytes(void *, size_t);
+    // Set when the client closes the connection on purpose, which
+    // also ends its session.
+
+    bool goodbye;
+
+    // Input from the client is read in large chunks and every complete
+    // frame in a chunk is handled before returning to the event loop.
+    // The start of a frame that hasn't fully arrived is held in rxBuf.
+
+    std::vector<uint8_t> rxBuf;
+    uint64_t reads, frames;
+    bool inputHeld;
+
+    virtual size_t handleFrames(uint8_t*, size_t, bool&) = 0;
+    virtual void restart();
     bool handleClientCommand(CommandHeader *, size_t);
 
     virtual bool handleCommandSocket() =  0;
     bool send(const void *, const size_t);
+    bool send(void const*, size_t, void const*, size_t);
 
  public:
     TcpClientProtocolHandler(int, int, int, nodename_t);
-    virtual ~TcpClientProtocolHandler() {}
+    virtual ~TcpClientProtocolHandler();
 
     Traffic whichTraffic() const { return enabledTraffic; }
 
     ipaddr_t remoteAddress() const { return remoteAddr; }
     void setRemoteAddress(ipaddr_t newRemoteAddr) { remoteAddr = newRemoteAddr; }
-    size_t maxQueueSize() const { return maxSocketQSize; }
-    size_t queueSize() const { return socketQ.size(); }
+    size_t maxQueueSize() const { return maxQueuedBytes; }
+    size_t queueSize() const { return queuedBytes; }
     bool anyPendingPackets() { return !socketQ.empty(); }
+    bool overflowed() const { return overflow; }
+    bool isDetached() const { return detached; }
+    bool saidGoodbye() const { return goodbye; }
+    void detach();
+    void attach(int, ipaddr_t, std::string const&);
+    bool paused() const { return congested && slowPolicy == BusySlow; }
+    bool refusesRequests() const;
+    bool dropsPacket(void const*, size_t);
     bool sendPendingPackets();
-    virtual bool handleClientSocket() =  0;
-    virtual bool handleDataSocket() =  0;
+    bool handleClientSocket();
+    bool receive(uint8_t*, size_t);
+    bool heldInput() const { return inputHeld && enabledTraffic == AllTraffic; }
+    double framesPerRead() const { return reads ? double(frames) / reads : 0.0; }
+    bool handleDataSocket();
     virtual bool handleClientPing() =  0;
     virtual void handleShutdown() = 0;
+    virtual void logStats() const;
 
     bool commandSocketData();
+
+    // A handler created without command and data sockets serves an
+    // in-process client: its commands are handled directly and its
+    // tasks hand their packets to sendPacket().
+
+    bool inProcess() const { return sCmd == -1; }
+    virtual bool sendPacket(uint16_t, void const*, size_t) = 0;
+
+    // Set whenever a handler starts queueing packets for its client
+
+    static bool newBacklog;
+
+    // While a Hold is in scope, packets for in-process clients are
+    // queued instead of written, so a burst of them goes out to each
+    // client in one write when the gateway next sees it's writable.
+
+    class Hold {
+	bool const prev;
+
+	Hold(Hold const&);
+	Hold& operator=(Hold const&);
+
+     public:
+	Hold() : prev(holding) { holding = true; }
+	~Hold() { holding = prev; }
+    };
+
+    void sendAck(void const*, size_t);
+    TaskInfo* findTask(TaskPool&, taskhandle_t) const;
+    TaskInfo* newTask(TaskPool&, taskhandle_t, taskid_t, ConnectCommand const*, size_t, ipaddr_t);
 };
 
 class RawProtocolHandler : public TcpClientProtocolHandler
 {
+    size_t discard;
+
     virtual bool handleCommandSocket();
+    virtual size_t handleFrames(uint8_t*, size_t, bool&);
+    virtual void restart();
 
  public:
     RawProtocolHandler(int, int, int, nodename_t);
     virtual ~RawProtocolHandler() {}
 
-    virtual bool handleClientSocket();
-    virtual bool handleDataSocket();
     virtual bool handleClientPing();
     virtual void handleShutdown();
+    virtual bool sendPacket(uint16_t, void const*, size_t);
 };
 
 class WebSocketProtocolHandler : public TcpClientProtocolHandler
@@ -1600,23 +2198,167 @@ class WebSocketProtocolHandler : public TcpClientProtocolHandler
     } __attribute__((packed));
 
     std::vector<uint8_t> payload;
-    bool readPayloadLength(uint8_t, uint64_t&);
-    bool readMask(bool, uint32_t&);
-    bool handleAcnetCommand(std::vector<uint8_t>&);
-    bool sendBinaryDataToClient(Pkt2 *, ssize_t, uint16_t);
+    bool handleFrame(uint8_t, uint8_t*, size_t);
+    bool handleAcnetCommand(uint8_t*, size_t);
+    bool sendBinaryDataToClient(uint16_t, void const*, size_t);
+
+    // permessage-deflate (RFC 7692) state. The zlib streams are only
+    // set up once the connection compresses or receives a message
+    // big enough to bother with.
+
+    bool deflateOn, deflateNoContext;
+    int deflateBits;
+    z_stream_s* deflater;
+    z_stream_s* inflater;
+    bool compressedMsg;
+    uint64_t msgsDeflated, rawOut, wireOut, msgsInflated, wireIn, rawIn;
+    int64_t deflateNs, inflateNs;
+
+    bool sendCompressed(uint16_t, void const*, size_t);
+    bool inflateMessage(uint8_t const*, size_t, uint8_t*&, size_t&);
 
     virtual bool handleCommandSocket();
+    virtual size_t handleFrames(uint8_t*, size_t, bool&);
+    virtual void restart();
 
  public:
     WebSocketProtocolHandler(int, int, int, nodename_t);
-    virtual ~WebSocketProtocolHandler() {}
+    virtual ~WebSocketProtocolHandler();
+
+    std::string negotiateExtensions(std::string const&);
 
-    virtual bool handleClientSocket();
-    virtual bool handleDataSocket();
     virtual bool handleClientPing();
     virtual void handleShutdown();
+    virtual void logStats() const;
+    virtual bool sendPacket(uint16_t, void const*, size_t);
 };
 
+// Default limits on connections to the TCP client port (see the -c
+// option.) A rate or a per-host limit of zero turns that check off.
+
+#define DEFAULT_ACCEPT_RATE	100
+#define DEFAULT_ACCEPT_BURST	200
+#define DEFAULT_HOST_CONNS	256
+
+// TcpAdmission
+//
+// Decides which connections to the TCP client port get served. New
+// connections are limited to a steady rate, with a burst allowance,
+// by a token bucket, and each source address may only hold so many
+// connections at once. A connection through a proxy is charged to
+// the proxy until its handshake names the client with
+// X-Forwarded-For; the in-process gateway then charges the client
+// instead. Forked handlers do their handshake after the fork, so
+// those stay charged to the address that connected.
+//
+class TcpAdmission : private Noncopyable {
+    double rate, tokens;
+    size_t burst, perHost;
+    int64_t lastRefill;
+    bool limiting;
+
+    // Hosts at their connection limit that have been turned away,
+    // with how many of their connections were. A host is logged when
+    // it's first turned away and when it drops below the limit;
+    // rejections in between only show up in a periodic summary.
+
+    std::map<ipaddr_t, uint32_t> rejecting;
+    int64_t lastHostSummary;
+    uint32_t hostRejectsLogged;
+
+    std::map<ipaddr_t, size_t> hosts;
+    std::map<pid_t, ipaddr_t> children;
+
+    void refill(int64_t);
+    bool hostFull(ipaddr_t) const;
+    void hostRejected(ipaddr_t, int64_t, char const*);
+
+ public:
+    StatCounter accepted, rateRejects, hostRejects;
+
+    TcpAdmission();
+
+    bool setLimits(char const*);
+
+    bool admit(ipaddr_t, int64_t);
+    bool move(ipaddr_t, ipaddr_t);
+    void release(ipaddr_t);
+
+    void forked(pid_t, ipaddr_t);
+    void reaped(pid_t);
+
+#ifndef NO_REPORT
+    void report(std::ostream&) const;
+#endif
+};
+
+extern TcpAdmission tcpAdmission;
+
+#if THIS_TARGET == Linux_Target
+
+// TcpClientGateway
+//
+// Serves all TCP and WebSocket clients from acnetd's own event loop
+// instead of forking a process for each connection. The client
+// sockets are kept in one epoll set whose descriptor the main loop
+// polls along with its other sockets. Commands read from a client
+// are handled on the spot and the client's tasks write their acks
+// and data straight to its connection, so nothing goes through the
+// client socket.
+//
+// A client may ask for a resumable session in its handshake. When
+// such a client's connection drops, its handler and tasks are kept
+// for a grace period, queueing what their requests return, and a new
+// connection that presents the session's token takes them over.
+// Packets the old socket had already accepted are lost with it.
+//
+class TcpClientGateway : private Noncopyable {
+    struct Connection {
+	int fd;
+	uint32_t events;
+	ipaddr_t remoteAddr;
+	std::string request;
+	TcpClientProtocolHandler* handler;
+	int64_t lastActivity;
+	bool closed;
+	std::string session;
+	int64_t detachedAt;
+    };
+
+    int const epfd;
+    nodename_t const tcpNode;
+    std::set<Connection*> clients;
+    std::vector<Connection*> closing;
+    std::map<std::string, Connection*> sessions;
+    int64_t nextCheck;
+    size_t maxClients;
+
+    void watch(Connection*, uint32_t);
+    void updateInterest(Connection*);
+    void watchBacklogs();
+    bool handleEvent(Connection*, uint32_t);
+    void startSession(Connection*);
+    void resumeSession(Connection*, Connection*);
+    void dropClient(Connection*);
+    void closeClient(Connection*);
+    void releaseClosed();
+
+ public:
+    TcpClientGateway(nodename_t);
+    ~TcpClientGateway();
+
+    bool valid() const { return epfd != -1; }
+    int fd() const { return epfd; }
+    size_t clientCount() const { return clients.size(); }
+
+    void addClient(int);
+    void handleEvents();
+    int checkClients();
+    void shutdown();
+};
+
+#endif
+
 // Inline functions...
 
 inline ipaddr_t octetsToIp(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
@@ -1654,11 +2396,12 @@ void networkTerm();
 DataOut* partialBuffer(trunknode_t);
 void generateKillerMessages();
 ssize_t readNextPacket(void *, size_t, sockaddr_in&);
-int sendDataToNetwork(AcnetHeader const&, void const*, size_t);
+int sendDataToNetwork(AcnetHeader const&, void const*, size_t, bool = false);
 void sendErrorToNetwork(AcnetHeader const&, status_t);
 void sendKillerMessage(trunknode_t const addr);
 void sendNodesRequestUsm(uint32_t);
 bool sendPendingPackets();
+size_t swapPayload(void*, void const*, size_t);
 void sendUsmToNetwork(trunknode_t, taskhandle_t, nodename_t, taskid_t, uint8_t const*, size_t);
 void setPartialBuffer(trunknode_t, DataOut*);
 bool validFromAddress(char const[], trunknode_t, ipaddr_t, ipaddr_t);
@@ -1694,6 +2437,10 @@ bool joinMulticastGroup(int, ipaddr_t);
 void dropMulticastGroup(int, ipaddr_t);
 uint32_t countMulticastGroup(ipaddr_t);
 
+// Client commands
+
+void handleClientCommand(CommandSource&, CommandHeader const*, size_t);
+
 // Misc
 
 bool rejectTask(taskhandle_t const);
@@ -1704,6 +2451,7 @@ void endRpyToNode(trunknode_t const);
 
 extern const taskid_t AcnetTaskId;
 extern bool termSignal;
+extern TaskPoolMap taskPoolMap;
 extern int sNetwork;
 extern int sClient;
 extern bool dumpIncoming;
@@ -50,6 +50,45 @@ void TaskInfo::testPendingRequestsAndIncrement()
     }
 }
 
+size_t IdQuota::perTask = 0;
+size_t IdQuota::perHandle = 0;
+
+// Parses the argument of the -l option: "perTask[:perHandle]"
+
+bool IdQuota::setLimits(char const* arg)
+{
+    char* end;
+    unsigned long const t = strtoul(arg, &end, 10);
+
+    if (end == arg)
+	return false;
+
+    unsigned long h = perHandle;
+
+    if (*end == ':') {
+	arg = end + 1;
+	h = strtoul(arg, &end, 10);
+	if (end == arg)
+	    return false;
+    }
+
+    if (*end)
+	return false;
+
+    perTask = t;
+    perHandle = h;
+    return true;
+}
+
+// Returns true if a task holding 'taskHeld' IDs of a kind, under a
+// handle whose tasks hold 'handleHeld' of them, may have another.
+
+bool IdQuota::allows(TaskInfo const* task, size_t taskHeld, size_t handleHeld)
+{
+    return !task->needsToBeThrottled() ||
+	((!perTask || taskHeld < perTask) && (!perHandle || handleHeld < perHandle));
+}
+
 #ifndef NO_REPORT
 void TaskInfo::report(std::ostream& os) const
 {
@@ -82,14 +121,17 @@ void TaskInfo::report(std::ostream& os) const
 	"\t\t\t<tr class=\"even\"><td class=\"label\">Requests Received</td><td>" << (uint32_t) stats.reqRcv << "</td></tr>\n" <<
 	"\t\t\t<tr><td class=\"label\">Replies Received</td><td>" << (uint32_t) stats.rpyRcv << "</td></tr>\n" <<
 	"\t\t\t<tr class=\"even\"><td class=\"label\">Dropped Packets</td><td>" << (uint32_t) stats.lostPkt << "</td></tr>\n" <<
-	"\t\t\t<tr><td class=\"label\">Connected</td><td>";
+	"\t\t\t<tr><td class=\"label\">Open Request IDs</td><td>" << requests.size() << "</td></tr>\n" <<
+	"\t\t\t<tr class=\"even\"><td class=\"label\">Open Reply IDs</td><td>" << replies.size() << "</td></tr>\n" <<
+	"\t\t\t<tr><td class=\"label\">IDs Refused by Quota</td><td>" << (uint32_t) stats.idRefused << "</td></tr>\n" <<
+	"\t\t\t<tr class=\"even\"><td class=\"label\">Connected</td><td>";
 
     printElapsedTime(os, now() - boot);
 
     os << "</td></tr>\n";
 
     for (size_t ii = 0; ii < totalProp(); ++ii)
-	os << "\t\t\t<tr" << (ii % 2 ? "" : " class=\"even\"") << "><td class=\"label\">" << propName(ii) <<
+	os << "\t\t\t<tr" << (ii % 2 ? " class=\"even\"" : "") << "><td class=\"label\">" << propName(ii) <<
 	    "</td><td>" << propVal(ii) << "</td></tr>\n";
 
     os << "\t\t\t</tbody>\n" << std::hex;
@@ -101,10 +143,10 @@ void TaskInfo::report(std::ostream& os) const
 	    "\t\t\t<tbody>\n"
 	    "\t\t\t<tr><td colspan=\"2\"><tt>";
 
-	for (auto ii = requests.begin(); ii != requests.end(); ++ii) {
-	    if (ii != requests.begin())
+	for (ReqInfo const* req = requests.front(); req; req = ReqList::next(req)) {
+	    if (req != requests.front())
 		os << ", ";
-	    os << "0x" << std::setw(4) << std::setfill('0') << (*ii).raw();
+	    os << "0x" << std::setw(4) << std::setfill('0') << req->id().raw();
 	}
 
 	os << "</tt></td></tr>\n"
@@ -118,10 +160,10 @@ void TaskInfo::report(std::ostream& os) const
 	    "\t\t\t<tbody>\n"
 	    "\t\t\t<tr><td colspan=\"2\"><tt>";
 
-	for (auto ii = replies.begin(); ii != replies.end(); ++ii) {
-	    if (ii != replies.begin())
+	for (RpyInfo const* rpy = replies.front(); rpy; rpy = RpyList::next(rpy)) {
+	    if (rpy != replies.front())
 		os << ", ";
-	    os << "0x" << std::setw(4) << std::setfill('0') << (*ii).raw();
+	    os << "0x" << std::setw(4) << std::setfill('0') << rpy->id().raw();
 	}
 
 	os << "</tt></td></tr>\n"
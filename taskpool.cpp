@@ -10,10 +10,12 @@
 #include <signal.h>
 #include <unistd.h>
 #endif
+#include <algorithm>
 #include "server.h"
 #include "lcltask.h"
 #include "remtask.h"
 #include "mctask.h"
+#include "tcptask.h"
 
 const taskid_t AcnetTaskId(0);
 
@@ -151,14 +153,40 @@ bool TaskPool::isPromiscuous(taskhandle_t name) const
     return false;
 }
 
+void ClientSocketSource::sendAck(void const* d, size_t n)
+{
+    (void) sendto(sClient, d, n, 0, (sockaddr const*) &in, sizeof(sockaddr_in));
+}
+
+// A local client's tasks are the ones connected through the port it
+// sent the command from.
+
+TaskInfo* ClientSocketSource::findTask(TaskPool& taskPool, taskhandle_t th) const
+{
+    return taskPool.getTask(th, ntohs(in.sin_port));
+}
+
+TaskInfo* ClientSocketSource::newTask(TaskPool& taskPool, taskhandle_t clientName, taskid_t taskId,
+				      ConnectCommand const* const cmd, size_t len, ipaddr_t mcAddr)
+{
+    uint16_t const cmdPort = ntohs(in.sin_port);
+
+    if (mcAddr.isMulticast())
+	return new MulticastTask(taskPool, clientName, taskId, cmd->pid(), cmdPort, cmd->dataPort(), mcAddr);
+    else if (len == sizeof(TcpConnectCommand))
+	return new RemoteTask(taskPool, clientName, taskId, cmd->pid(), cmdPort, cmd->dataPort(),
+			      ((TcpConnectCommand const*) cmd)->remoteAddr());
+    else
+	return new LocalTask(taskPool, clientName, taskId, cmd->pid(), cmdPort, cmd->dataPort());
+}
+
 // This function handles incoming Connect commands
 
-void TaskPool::handleConnect(sockaddr_in const& in, ConnectCommand const* const cmd, size_t len)
+void TaskPool::handleConnect(CommandSource& src, ConnectCommand const* const cmd, size_t len)
 {
     AckConnect ack;
     AckConnectExt ackExt;
     taskhandle_t clientName = cmd->clientName();
-    uint16_t cmdPort = ntohs(in.sin_port);
     uint16_t dataPort = cmd->dataPort();
 
     // (TP-4)
@@ -179,7 +207,7 @@ void TaskPool::handleConnect(sockaddr_in const& in, ConnectCommand const* const
 	    // Check to see if we are already connected and if we are, just
 	    // return our task id
 
-	    TaskInfo *task = getTask(clientName, cmdPort);
+	    TaskInfo *task = src.findTask(*this, clientName);
 
 	    if (!task) {
 		taskid_t taskId = nextFreeTaskId(cmd);
@@ -188,20 +216,14 @@ void TaskPool::handleConnect(sockaddr_in const& in, ConnectCommand const* const
 
 		ipaddr_t addr;
 
-		if (nameLookup(nodename_t(clientName), addr) && addr.isMulticast())
-		     task = new MulticastTask(*this, clientName, taskId, cmd->pid(),
-						cmdPort, dataPort, addr);
-		else {
+		if (!nameLookup(nodename_t(clientName), addr) || !addr.isMulticast()) {
 		    if (taskExists(clientName))
 			throw ACNET_NAME_IN_USE;
-
-		    if (len == sizeof(TcpConnectCommand))
-			task = new RemoteTask(*this, clientName, taskId, cmd->pid(), cmdPort, dataPort,
-						((TcpConnectCommand const*) cmd)->remoteAddr());
-		    else
-			task = new LocalTask(*this, clientName, taskId, cmd->pid(), cmdPort, dataPort);
+		    addr = ipaddr_t();
 		}
 
+		task = src.newTask(*this, clientName, taskId, cmd, len, addr);
+
 		active.insert(TaskHandleMap::value_type(task->handle(), task));
 		tasks_[taskId.raw()] = task;
 	    }
@@ -235,10 +257,10 @@ void TaskPool::handleConnect(sockaddr_in const& in, ConnectCommand const* const
     // Send ack back to the client
 
     if (cmd->cmd() == CommandList::cmdConnectExt || cmd->cmd() == CommandList::cmdTcpConnectExt) {
-	(void) sendto(sClient, &ackExt, sizeof(ackExt), 0, (sockaddr*) &in, sizeof(sockaddr_in));
+	src.sendAck(&ackExt, sizeof(ackExt));
 	syslog(LOG_WARNING, "send extended connect ack");
     } else
-	(void) sendto(sClient, &ack, sizeof(ack), 0, (sockaddr*) &in, sizeof(sockaddr_in));
+	src.sendAck(&ack, sizeof(ack));
 }
 
 size_t TaskPool::fillBufferWithTaskInfo(uint8_t subType, uint16_t rep[])
@@ -424,6 +446,46 @@ size_t TaskPool::fillBufferWithTaskStats(uint8_t subType, void* buf)
     return sizeof(TaskStatsReply) + sizeof(TaskStats) * count;
 }
 
+// Fills the buffer with the request and reply IDs each task holds and
+// the IDs it's been refused by the quota (see IdQuota.)
+
+size_t TaskPool::fillBufferWithTaskIdUsage(void* buf)
+{
+    typedef struct {
+	uint16_t taskId;
+	uint32_t hTask;
+	uint16_t requests;
+	uint16_t replies;
+	uint32_t refused;
+    } __attribute__((packed)) TaskIdUsage;
+
+    typedef struct {
+	uint16_t taskCount;
+	TaskIdUsage usage[];
+    } __attribute__((packed)) TaskIdUsageReply;
+
+    TaskIdUsageReply* const rpy = (TaskIdUsageReply*) buf;
+    TaskIdUsage* tu = rpy->usage;
+
+    for (int ii = 0; ii < MAX_TASKS; ii++) {
+	TaskInfo const* const task = tasks_[ii];
+
+	if (task) {
+	    tu->taskId = htoas(task->id().raw());
+	    tu->hTask = htoal(task->handle().raw());
+	    tu->requests = htoas((uint16_t) task->requestCount());
+	    tu->replies = htoas((uint16_t) task->replyCount());
+	    tu->refused = htoal((uint32_t) task->stats.idRefused);
+	    tu++;
+	}
+    }
+
+    size_t const count = tu - rpy->usage;
+
+    rpy->taskCount = htoas(count);
+    return sizeof(TaskIdUsageReply) + sizeof(TaskIdUsage) * count;
+}
+
 // Removes all tasks from the active list. This has the side effect of sending EMRs and CANCELs.
 
 void TaskPool::removeAllTasks()
@@ -456,23 +518,43 @@ void TaskPool::removeOnlyThisTask(TaskInfo* const task, status_t status, bool se
 
     // Now we can free up the resources associated with the task.
 
-    while (task->requests.begin() != task->requests.end())
-        reqPool.cancelReqId(*task->requests.begin(), true, sendLastReply);
-    while (task->replies.begin() != task->replies.end())
-        rpyPool.endRpyId(*task->replies.begin(), status);
+    while (!task->requests.empty())
+        reqPool.cancelReqId(task->requests.front()->id(), true, sendLastReply);
+    while (!task->replies.empty())
+        rpyPool.endRpyId(task->replies.front()->id(), status);
 
 #ifdef DEBUG
     syslog(LOG_DEBUG, "removing task '%s' (pid = %d)", task->handle().str(), task->pid());
 #endif
 
+    // Any acks still batched for the task are dropped.
+
+    ackPending.erase(std::remove(ackPending.begin(), ackPending.end(), task), ackPending.end());
+
     removed.push_back(task);
 }
 
-void TaskPool::removeTask(TaskInfo* const task)
+void TaskPool::queueAckFlush(ExternalTask* const task)
 {
-    pid_t const pid = task->pid();
+    ackPending.push_back(task);
+}
+
+// Sends the acks that pipelined clients accumulated while the command
+// socket was being drained.
 
-    if (0 == pid)
+void TaskPool::flushPendingAcks()
+{
+    std::vector<ExternalTask*> pending;
+
+    pending.swap(ackPending);
+    for (auto task : pending)
+	if (tasks_[task->id().raw()] == task && !task->flushAcks())
+	    removeTask(task);
+}
+
+void TaskPool::removeTask(TaskInfo* const task)
+{
+    if (0 == task->pid())
 
 	// If the task pid is 0 then only remove the given task
 
@@ -480,14 +562,27 @@ void TaskPool::removeTask(TaskInfo* const task)
     else {
 
 	// Otherwise, loop through all the active tasks removing everthing
-	// with the given pid
+	// connected by the same client
 
 	for (int ii = 0; ii < MAX_TASKS; ii++)
-	    if (tasks_[ii] && pid == tasks_[ii]->pid())
+	    if (tasks_[ii] && task->sameClient(tasks_[ii]))
 		removeOnlyThisTask(tasks_[ii]);
     }
 }
 
+// Removes the tasks of an in-process TCP client when its connection
+// goes away.
+
+void TaskPool::removeClientTasks(TcpClientProtocolHandler const* client)
+{
+    for (int ii = 0; ii < MAX_TASKS; ii++) {
+	TcpLink const* const link = dynamic_cast<TcpLink const*>(tasks_[ii]);
+
+	if (link && link->tcpClient() == client)
+	    removeOnlyThisTask(tasks_[ii]);
+    }
+}
+
 #ifndef NO_REPORT
 void TaskPool::generateNodeDataReport(std::ostream& os)
 {
@@ -615,6 +710,7 @@ void TaskPool::generateReport()
 	    reqPool.generateReqReport(os);
 	    rpyPool.generateRpyReport(os);
 	    generateIpReport(os);
+	    tcpAdmission.report(os);
 
 	    os << "\t</body>\n"
 		"</html>\n";
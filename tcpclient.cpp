@@ -1,45 +1,289 @@
 #include <cstring>
+#include <iomanip>
+#include <typeinfo>
+#include <strings.h>
 #include "server.h"
+#include "tcptask.h"
 #include <sys/socket.h>
 #include <signal.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <sha.h>
+#include <rand.h>
+#if THIS_TARGET == Linux_Target
+#include <sys/epoll.h>
+#endif
+
+// Only Linux has MSG_MORE. Elsewhere the send queue is written
+// without the hint.
+
+#ifndef MSG_MORE
+#define MSG_MORE		0
+#endif
+
+// The most a client may send in one read and the longest handshake
+// it may send.
+
+#define RECV_CHUNK		(128 * 1024)
+#define MAX_HANDSHAKE		(16 * 1024)
+
+// A forked handler reads up to DATA_BATCH packets at a time from
+// acnetd's data socket and keeps reading until the socket is empty or
+// DATA_BATCH_BYTES have been framed. Everything framed in one pass is
+// then written to the client at once.
+
+#define DATA_BATCH		64
+#define DATA_SLOT		(64 * 1024)
+#define DATA_BATCH_BYTES	(256 * 1024)
+
+// How long a new connection has to complete its handshake and how
+// long a connection may stay quiet before it is pinged.
+
+#define HANDSHAKE_TIMEOUT	2000
+#define PING_INTERVAL		10000
+
+// How long the gateway holds the tasks of a session whose client has
+// gone away.
+
+#define SESSION_GRACE		30000
+
+// How often rejections of hosts over their connection limit are
+// summarized in the log
+
+#define HOST_REJECT_SUMMARY	60000
+
+bool TcpClientProtocolHandler::newBacklog = false;
+bool TcpClientProtocolHandler::holding = false;
+uint32_t TcpClientProtocolHandler::nextAnonId = 0;
+TcpClientProtocolHandler::SlowPolicy TcpClientProtocolHandler::slowPolicy = DisconnectSlow;
+size_t TcpClientProtocolHandler::highWater = DEFAULT_QUEUE_HIGH_WATER;
+size_t TcpClientProtocolHandler::lowWater = DEFAULT_QUEUE_LOW_WATER;
 
 TcpClientProtocolHandler::TcpClientProtocolHandler(int sTcp, int sCmd, int sData,
 						   nodename_t tcpNode) :
-    maxSocketQSize(0), sTcp(sTcp), sCmd(sCmd), sData(sData), tcpNode(tcpNode),
-	enabledTraffic(AllTraffic)
+    queuedBytes(0), maxQueuedBytes(0), detached(false), congested(false), overflow(false), congestions(0), replyDrops(0),
+	busyRefusals(0), batching(false), dataWrites(0), dataPackets(0), anonId(nextAnonId++), sTcp(sTcp), sCmd(sCmd),
+	sData(sData), tcpNode(tcpNode), enabledTraffic(AllTraffic), goodbye(false), reads(0), frames(0), inputHeld(false)
 {
 }
 
-bool TcpClientProtocolHandler::readBytes(void *buf, size_t count)
+// Sets the slow-consumer policy from its name ("disconnect", "busy" or
+// "drop") and the water marks. A low-water mark of zero defaults to a
+// quarter of the high-water mark.
+
+bool TcpClientProtocolHandler::setSlowPolicy(char const* name, size_t high, size_t low)
 {
-    void * const end = ((uint8_t*) buf) + count;
+    if (!strcmp(name, "disconnect"))
+	slowPolicy = DisconnectSlow;
+    else if (!strcmp(name, "busy"))
+	slowPolicy = BusySlow;
+    else if (!strcmp(name, "drop"))
+	slowPolicy = DropSlow;
+    else
+	return false;
+
+    if (high) {
+	highWater = high;
+	lowWater = low ? low : high / 4;
+    }
+    return lowWater < highWater;
+}
 
-    while (buf < end) {
-	ssize_t const len = recv(sTcp, buf, (int8_t *) end - (int8_t *) buf, 0);
+// Requests for the tasks of a client that has been paused are refused
+// with ACNET_BUSY until its queue drains.
 
-	if (len > 0)
-	    buf = ((uint8_t*) buf) + len;
-	else if (len == 0)
+bool TcpClientProtocolHandler::refusesRequests() const
+{
+    if (paused()) {
+	++busyRefusals;
+	return true;
+    }
+    return false;
+}
+
+// Under the drop policy, a congested client loses the replies in the
+// middle of its multiple-reply streams. The reply that ends a stream
+// is always delivered, so requests are still closed out properly.
+
+bool TcpClientProtocolHandler::dropsPacket(void const* d, size_t n)
+{
+    if (!congested || slowPolicy != DropSlow || n < sizeof(AcnetHeader))
+	return false;
+
+    AcnetHeader hdr;
+
+    memcpy(&hdr, d, sizeof(hdr));
+    if (!PKT_IS_REPLY(hdr.flags()) || hdr.isEMR())
+	return false;
+
+    ++replyDrops;
+    return true;
+}
+
+void TcpClientProtocolHandler::logStats() const
+{
+    if (dataWrites)
+	syslog(LOG_NOTICE, "%" PRIu64 " packets from acnetd in %" PRIu64 " writes (%.1f per write)", dataPackets,
+	       dataWrites, double(dataPackets) / dataWrites);
+    if (congestions)
+	syslog(LOG_NOTICE, "queue passed %ld bytes %" PRIu64 " times; %" PRIu64 " requests refused, "
+	       "%" PRIu64 " replies dropped", highWater, congestions, busyRefusals, replyDrops);
+}
+
+TcpClientProtocolHandler::~TcpClientProtocolHandler()
+{
+    for (auto ii = socketQ.begin(); ii != socketQ.end(); ++ii)
+	ii->buf->release();
+}
+
+// Reads what the client has sent, up to a chunk, and handles the
+// complete frames in it. The client sockets are level-triggered so
+// anything left unread is picked up on the next pass, after the
+// other clients have had their turn. Returns true when the
+// connection should be closed.
+
+bool TcpClientProtocolHandler::handleClientSocket()
+{
+    static uint8_t chunk[RECV_CHUNK];
+    ssize_t len;
+
+    do
+	len = recv(sTcp, chunk, sizeof(chunk), 0);
+    while (len == -1 && errno == EINTR);
+
+    if (len > 0) {
+	++reads;
+	return receive(chunk, len);
+    } else if (len == -1) {
+	if (errno == EAGAIN || errno == EWOULDBLOCK)
 	    return false;
-	else if (len == -1) {
-	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-		poll(0, 0, 1);
-	    } else {
-		syslog(LOG_ERR, "error reading from the client -- %m");
-		return false;
+	syslog(LOG_ERR, "error reading from the client -- %m");
+    }
+    return true;
+}
+
+// Receives up to DATA_BATCH packets from acnetd's data socket without
+// blocking. Returns how many arrived, with their lengths in 'lens',
+// or -1 if none could be read. Linux takes them all in one call;
+// other platforms read them one at a time.
+
+static int receiveData(int s, uint8_t (*slots)[DATA_SLOT], size_t* lens)
+{
+#if THIS_TARGET == Linux_Target
+    mmsghdr msgs[DATA_BATCH];
+    iovec iov[DATA_BATCH];
+
+    for (size_t ii = 0; ii < DATA_BATCH; ++ii) {
+	iov[ii].iov_base = slots[ii];
+	iov[ii].iov_len = DATA_SLOT;
+	memset(&msgs[ii].msg_hdr, 0, sizeof(msgs[ii].msg_hdr));
+	msgs[ii].msg_hdr.msg_iov = iov + ii;
+	msgs[ii].msg_hdr.msg_iovlen = 1;
+    }
+
+    int const n = recvmmsg(s, msgs, DATA_BATCH, MSG_DONTWAIT, 0);
+
+    for (int ii = 0; ii < n; ++ii)
+	lens[ii] = msgs[ii].msg_len;
+    return n;
+#else
+    int n = 0;
+
+    while (n < DATA_BATCH) {
+	ssize_t const len = recvfrom(s, slots[n], DATA_SLOT, MSG_DONTWAIT, 0, 0);
+
+	if (len == -1)
+	    return n ? n : -1;
+	lens[n++] = (size_t) len;
+    }
+    return n;
+#endif
+}
+
+// Drains acnetd's data socket. The packets are framed into the send
+// queue and go out to the client in a single write rather than one
+// small TCP segment apiece. Returns true when the connection should
+// be closed.
+
+bool TcpClientProtocolHandler::handleDataSocket()
+{
+    static uint8_t slots[DATA_BATCH][DATA_SLOT];
+    size_t lens[DATA_BATCH];
+    size_t total = 0;
+    bool done = false;
+
+    batching = true;
+    while (!done && total < DATA_BATCH_BYTES) {
+	int const n = receiveData(sData, slots, lens);
+
+	if (n == -1) {
+	    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		syslog(LOG_ERR, "error receiving data from acnetd -- %m");
+		done = true;
 	    }
+	    break;
 	}
+
+	for (int ii = 0; ii < n && !done; ++ii) {
+	    size_t const len = lens[ii];
+
+	    total += len;
+	    ++dataPackets;
+	    if (!dropsPacket(slots[ii], len) && !sendPacket(ACNETD_DATA, slots[ii], len)) {
+		syslog(LOG_ERR, "error sending data to client -- %m");
+		done = true;
+	    }
+	}
+
+	if (n < DATA_BATCH)
+	    break;
     }
+    batching = false;
 
-    return true;
+    if (!done && anyPendingPackets()) {
+	++dataWrites;
+	done = sendPendingPackets();
+    }
+    return done;
+}
+
+// Handles the frames in data received from the client. A partial
+// frame at the end is kept until the rest of it arrives. A forked
+// handler also stops at each command it passes to acnetd and holds
+// the frames behind it until acnetd acks it.
+
+bool TcpClientProtocolHandler::receive(uint8_t* d, size_t n)
+{
+    bool done = false;
+
+    if (rxBuf.empty()) {
+	size_t const used = handleFrames(d, n, done);
+
+	if (!done && used < n)
+	    rxBuf.assign(d + used, d + n);
+    } else {
+	rxBuf.insert(rxBuf.end(), d, d + n);
+
+	size_t const used = handleFrames(rxBuf.data(), rxBuf.size(), done);
+
+	// Most clients go back to sending whole frames, so the buffer
+	// is freed rather than kept around at its largest size.
+
+	if (used == rxBuf.size())
+	    std::vector<uint8_t>().swap(rxBuf);
+	else
+	    rxBuf.erase(rxBuf.begin(), rxBuf.begin() + used);
+    }
+
+    inputHeld = !done && enabledTraffic == AckTraffic && !rxBuf.empty();
+    return done;
 }
 
-int TcpClientProtocolHandler::getSocketPort(int s)
+int TcpClientProtocolHandler::socketPort(int s)
 {
     struct sockaddr_in in;
     socklen_t in_len = (socklen_t) sizeof(in);
@@ -51,9 +295,25 @@ int TcpClientProtocolHandler::getSocketPort(int s)
 	return ntohs(in.sin_port);
 }
 
+// Builds the name of an in-process client's anonymous tasks. The ID
+// is spelled in letters so the name can't clash with the "%nnnnn"
+// names acnetd gives the anonymous tasks of local clients, which
+// come from their data ports. A name only comes around again after
+// 26^5 handlers.
+
+static taskhandle_t anonymousName(uint32_t id)
+{
+    char buf[8] = "%";
+
+    for (int ii = 5; ii > 0; --ii, id /= 26)
+	buf[ii] = 'A' + id % 26;
+    return taskhandle_t(ator(buf));
+}
+
 bool TcpClientProtocolHandler::handleClientCommand(CommandHeader *cmd, size_t len)
 {
-    int res = -1;
+    TcpConnectCommandExt tmpExt;
+    TcpConnectCommand tmp;
 
     // If a virtual node is not specified, then use the node that was
     // provided on the -t command line option
@@ -61,43 +321,53 @@ bool TcpClientProtocolHandler::handleClientCommand(CommandHeader *cmd, size_t le
     if (cmd->virtualNodeName().isBlank())
 	cmd->setVirtualNodeName(tcpNode);
 
+    // Connect commands are converted to TCP connects, which carry the
+    // client's address. An in-process client has no data socket, so
+    // its anonymous tasks are named here and the data port only has
+    // to be non-zero.
+
+    uint16_t const dataPort = inProcess() ? 1 : socketPort(sData);
+    taskhandle_t const clientName = inProcess() && cmd->clientName().isBlank() ?
+	anonymousName(anonId) : cmd->clientName();
+
     switch (cmd->cmd()) {
      case CommandList::cmdConnect:
      case CommandList::cmdTcpConnect:
-	{
-	    TcpConnectCommand tmp;
-
-	    tmp.setClientName(cmd->clientName());
-	    tmp.setVirtualNodeName(cmd->virtualNodeName());
-	    tmp.setPid(getpid());
-	    tmp.setDataPort(getSocketPort(sData));
-	    tmp.setRemoteAddr(remoteAddr);
-
-	    res = ::send(sCmd, &tmp, sizeof(tmp), 0);
-	}
+	tmp.setClientName(clientName);
+	tmp.setVirtualNodeName(cmd->virtualNodeName());
+	tmp.setPid(getpid());
+	tmp.setDataPort(dataPort);
+	tmp.setRemoteAddr(remoteAddr);
+
+	cmd = &tmp;
+	len = sizeof(tmp);
 	break;
 
      case CommandList::cmdConnectExt:
      case CommandList::cmdTcpConnectExt:
-	{
-	    TcpConnectCommandExt tmp;
-
-	    tmp.setClientName(cmd->clientName());
-	    tmp.setVirtualNodeName(cmd->virtualNodeName());
-	    tmp.setPid(getpid());
-	    tmp.setDataPort(getSocketPort(sData));
-	    tmp.setRemoteAddr(remoteAddr);
-
-	    res = ::send(sCmd, &tmp, sizeof(tmp), 0);
-	}
+	tmpExt.setClientName(clientName);
+	tmpExt.setVirtualNodeName(cmd->virtualNodeName());
+	tmpExt.setPid(getpid());
+	tmpExt.setDataPort(dataPort);
+	tmpExt.setRemoteAddr(remoteAddr);
+
+	cmd = &tmpExt;
+	len = sizeof(tmpExt);
 	break;
 
      default:
-	res = ::send(sCmd, cmd, len, 0);
 	break;
     }
 
-    if (res == -1) {
+    // In-process clients have their commands handled right away; the
+    // acks are already queued for the client when this returns.
+
+    if (inProcess()) {
+	::handleClientCommand(*this, cmd, len);
+	return false;
+    }
+
+    if (-1 == ::send(sCmd, cmd, len, 0)) {
 	syslog(LOG_ERR, "error sending command to acnetd -- %m");
 	return true;
     }
@@ -106,6 +376,25 @@ bool TcpClientProtocolHandler::handleClientCommand(CommandHeader *cmd, size_t le
     return false;
 }
 
+void TcpClientProtocolHandler::sendAck(void const* d, size_t n)
+{
+    (void) sendPacket(ACNETD_ACK, d, n);
+}
+
+TaskInfo* TcpClientProtocolHandler::findTask(TaskPool& taskPool, taskhandle_t th) const
+{
+    return TcpLink::find(taskPool, th, this);
+}
+
+TaskInfo* TcpClientProtocolHandler::newTask(TaskPool& taskPool, taskhandle_t clientName, taskid_t taskId,
+					    ConnectCommand const*, size_t, ipaddr_t mcAddr)
+{
+    if (mcAddr.isMulticast())
+	return new TcpMulticastTask(taskPool, clientName, taskId, this, mcAddr);
+    else
+	return new TcpTask(taskPool, clientName, taskId, this, remoteAddr);
+}
+
 static int createDataSocket()
 {
     int s;
@@ -203,45 +492,7 @@ static int createCommandSocket()
     return -1;
 }
 
-static ssize_t readHttpLine(int fd, void *buf, size_t n)
-{
-    size_t totRead = 0;
-    char *cp = (char *) buf;
-    char ch;
-    int64_t start = currentTimeMillis();
-
-    while (true) { 
-	pollfd pfd[] = {{ fd, POLLIN, 0 }};
-
-	if (poll(pfd, 1, 50) > 0) {
-	    read(fd, &ch, 1);
-	    if (totRead < n - 1) {
-		if (ch != '\r' && ch != '\n') {
-		    totRead++;
-		    *cp++ = ch;
-		}
-	    }
-
-	    if (ch == '\n')
-		break;
-	} else
-	    return -1;
-
-	if ((currentTimeMillis() - start) > 200)
-	    return -1;
-    }
-
-    *cp = 0;
-
-    return totRead;
-}
-
-static void sendStr(int s, const char *d)
-{
-    send(s, d, strlen(d), 0);
-}
-
-static void sendAcceptKey(int sTcp, const char *key)
+static std::string acceptKey(const char *key)
 {
     static char encodingTable[] = {'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
 				    'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
@@ -280,67 +531,153 @@ static void sendAcceptKey(int sTcp, const char *key)
     for (int ii = 0; ii < modTable[SHA_DIGEST_LENGTH % 3]; ii++)
         acceptKey[sizeof(acceptKey) - 1 - ii] = '=';
 
-    send(sTcp, acceptKey, sizeof(acceptKey), 0);
+    return std::string(acceptKey, sizeof(acceptKey));
 }
 
-static TcpClientProtocolHandler *handshake(int sTcp, int sCmd, int sData, nodename_t tcpNode, ipaddr_t remoteAddr)
+// Returns the value of a parameter in the query string of a request
+// target ("/acnet?session=new"), or an empty string.
+
+static std::string queryParam(char const* target, char const* name)
+{
+    char const* q = strchr(target, '?');
+    size_t const len = strlen(name);
+
+    while (q) {
+	++q;
+	if (!strncmp(q, name, len) && q[len] == '=') {
+	    q += len + 1;
+	    return std::string(q, strcspn(q, "& "));
+	}
+	q = strchr(q, '&');
+    }
+    return std::string();
+}
+
+// Reads what has arrived of a client's handshake into 'request'. The
+// handshake is a set of lines ending with a blank one. Until the
+// blank line arrives, null is returned and 'failed' tells whether the
+// connection should be dropped. Once it has arrived, the handshake is
+// answered and the handler for the client's protocol is returned;
+// 'request' is left holding whatever the client sent after the
+// handshake, which belongs to the handler. 'session' is set to what
+// the client asked of a resumable session: "new" or the token of the
+// one it's resuming. RAW clients ask with an X-Acnet-Session header
+// and browsers, which can't add headers, with a "session" parameter
+// in the request's query string.
+
+static TcpClientProtocolHandler *handshake(int sTcp, std::string& request, int sCmd, int sData,
+					   nodename_t tcpNode, ipaddr_t remoteAddr, std::string& session,
+					   bool& failed)
 {
     TcpClientProtocolHandler *handler = 0;
-    pollfd pfd[] = {{ sTcp, POLLIN, 0 }};
+    char buf[MAX_HANDSHAKE];
+    ssize_t len;
 
-    if (poll(pfd, 1, 100) > 0) {
+    failed = false;
 
-	// Handshake continues until we get a blank line
+    do
+	len = recv(sTcp, buf, sizeof(buf), 0);
+    while (len == -1 && errno == EINTR);
 
-	while (true) {
-	    char *cp;
-	    char line[16 * 1024];
-	    ssize_t len = readHttpLine(sTcp, line, sizeof(line));
+    if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	return 0;
+    if (len <= 0) {
+	failed = true;
+	return 0;
+    }
 
-	    if (len == 0)
-		break;
-	    else if (len == -1) {
-		handler = 0;
-		break;
-	    } else {
-		if (strcmp("RAW", line) == 0) {
-		    handler = new RawProtocolHandler(sTcp, sCmd, sData, tcpNode);
-		    syslog(LOG_NOTICE, "detected raw protocol");
-		} else if ((cp = strchr(line, ' '))) {
-		    *cp++ = 0;
-
-		    if (!handler) {
-			if (strcmp("Sec-WebSocket-Key:", line) == 0) {
-			    sendStr(sTcp, "HTTP/1.1 101 Switching Protocols\r\n");
-			    sendStr(sTcp, "Upgrade: websocket\r\n");
-			    sendStr(sTcp, "Connection: Upgrade\r\n");
-			    sendStr(sTcp, "Sec-WebSocket-Accept: ");
-			    sendAcceptKey(sTcp, cp);
-			    sendStr(sTcp, "\r\n");
-			    sendStr(sTcp, "Sec-WebSocket-Protocol: acnet-client\r\n\r\n");
-			    handler = new WebSocketProtocolHandler(sTcp, sCmd, sData, tcpNode);
-			    syslog(LOG_DEBUG, "detected websocket protocol");
-			}
-		    }
-
-		    // Check for proxied connections and report the forwarded address on the connection
-
-		    if (strcmp("X-Forwarded-For:", line) == 0) {
-			struct in_addr addr;
-
-			if (inet_pton(AF_INET, cp, &addr) == 1) {
-			    remoteAddr = ipaddr_t(ntohl(addr.s_addr));
-			    syslog(LOG_NOTICE, "detected proxy forward address: %s", remoteAddr.str().c_str());
-			}
-		    }
+    request.append(buf, len);
+
+    // Split the lines up to the blank one. Lines may end with CRLF or
+    // just LF.
+
+    std::vector<std::string> lines;
+    size_t pos = 0, nl;
+
+    while ((nl = request.find('\n', pos)) != std::string::npos) {
+	size_t const end = nl > pos && request[nl - 1] == '\r' ? nl - 1 : nl;
+
+	lines.push_back(request.substr(pos, end - pos));
+	pos = nl + 1;
+	if (lines.back().empty())
+	    break;
+    }
+
+    if (lines.empty() || !lines.back().empty()) {
+	failed = request.size() > MAX_HANDSHAKE;
+	return 0;
+    }
+
+    request.erase(0, pos);
+
+    std::string wsKey, wsExtensions;
+
+    for (auto ii = lines.begin(); ii != lines.end(); ++ii) {
+	char *cp;
+	char *line = &(*ii)[0];
+
+	if (strcmp("RAW", line) == 0) {
+	    handler = new RawProtocolHandler(sTcp, sCmd, sData, tcpNode);
+	    syslog(LOG_NOTICE, "detected raw protocol");
+	} else if ((cp = strchr(line, ' '))) {
+	    *cp++ = 0;
+
+	    if (ii == lines.begin() && strcmp("GET", line) == 0)
+		session = queryParam(cp, "session");
+
+	    if (strcasecmp("X-Acnet-Session:", line) == 0)
+		session = cp;
+
+	    if (strcasecmp("Sec-WebSocket-Key:", line) == 0)
+		wsKey = cp;
+
+	    // The extensions a client offers may be spread over several
+	    // header lines.
+
+	    if (strcasecmp("Sec-WebSocket-Extensions:", line) == 0)
+		wsExtensions += (wsExtensions.empty() ? "" : ",") + std::string(cp);
+
+	    // Check for proxied connections and report the forwarded address on the connection
+
+	    if (strcmp("X-Forwarded-For:", line) == 0) {
+		struct in_addr addr;
+
+		if (inet_pton(AF_INET, cp, &addr) == 1) {
+		    remoteAddr = ipaddr_t(ntohl(addr.s_addr));
+		    syslog(LOG_NOTICE, "detected proxy forward address: %s", remoteAddr.str().c_str());
 		}
 	    }
 	}
+    }
+
+    if (!handler && !wsKey.empty()) {
+	WebSocketProtocolHandler* const ws = new WebSocketProtocolHandler(sTcp, sCmd, sData, tcpNode);
+
+	// What was queued for a session can't be inflated by a client
+	// that resumes it with a fresh stream, so sessions go
+	// uncompressed.
+
+	std::string const extensions = session.empty() ? ws->negotiateExtensions(wsExtensions) : std::string();
+	std::string reply =
+	    "HTTP/1.1 101 Switching Protocols\r\n"
+	    "Upgrade: websocket\r\n"
+	    "Connection: Upgrade\r\n"
+	    "Sec-WebSocket-Accept: " + acceptKey(wsKey.c_str()) + "\r\n";
 
-	if (handler)
-	    handler->setRemoteAddress(remoteAddr);
+	if (!extensions.empty())
+	    reply += "Sec-WebSocket-Extensions: " + extensions + "\r\n";
+	reply += "Sec-WebSocket-Protocol: acnet-client\r\n\r\n";
+
+	send(sTcp, reply.data(), reply.size(), 0);
+	handler = ws;
+	syslog(LOG_DEBUG, "detected websocket protocol%s", extensions.empty() ? "" : " with compression");
     }
 
+    if (handler)
+	handler->setRemoteAddress(remoteAddr);
+    else
+	failed = true;
+
     return handler;
 }
 
@@ -357,38 +694,137 @@ static inline bool socketBufferFull()
 
 bool TcpClientProtocolHandler::send(const void *buf, const size_t len)
 {
-    if (socketQ.empty()) {
-	ssize_t sLen = ::send(sTcp, buf, len, 0);
+    return send(buf, len, 0, 0);
+}
 
-	if (-1 == sLen) {
+// Sends a frame header and its payload. Whatever the socket doesn't
+// take right away is copied into the send queue, after anything that
+// was already waiting there.
+
+bool TcpClientProtocolHandler::send(void const* hdr, size_t hLen, void const* data, size_t dLen)
+{
+    size_t sLen = 0;
+
+    // A client that's being dropped gets nothing more
+
+    if (overflow)
+	return true;
+
+    if (socketQ.empty() && !batching && !holding && !detached) {
+	iovec iov[] = {
+	    { (void*) hdr, hLen },
+	    { (void*) data, dLen }
+	};
+	ssize_t const res = writev(sTcp, iov, dLen ? 2 : 1);
+
+	if (-1 == res) {
 	    if (!socketBufferFull())
 		return false;
-	    sLen = 0;
-	}
+	} else if ((size_t) res == hLen + dLen)
+	    return true;
+	else
+	    sLen = res;
+    }
 
-	if ((size_t) sLen < len)
-	    socketQ.push(new SocketBuffer(((uint8_t *) buf) + sLen, len - sLen));
+    uint8_t const* const h = (uint8_t const*) hdr + std::min(sLen, hLen);
+    size_t const skip = sLen > hLen ? sLen - hLen : 0;
+    size_t const hRest = hLen - (h - (uint8_t const*) hdr);
+    SocketBuffer* const shared = SharedPacket::find(data, dLen);
 
-    } else {
-	SocketBuffer *sBuf = socketQ.current()->append(buf, len);
+    if (shared) {
+	if (hRest)
+	    enqueue(SocketBuffer::create(h, hRest), 0, !sLen);
+	enqueue(shared, skip, !sLen && !hRest);
+    } else
+	enqueue(SocketBuffer::create(h, hRest, (uint8_t const*) data + skip, dLen - skip), 0, !sLen);
+
+    return true;
+}
 
-	if (sBuf)
-	    socketQ.push(sBuf);
+void TcpClientProtocolHandler::enqueue(SocketBuffer* buf, size_t offset, bool first)
+{
+    SocketChunk const chunk = { buf, offset, first };
+
+    if (socketQ.empty())
+	newBacklog = true;
+
+    socketQ.push_back(chunk);
+    queuedBytes += chunk.remaining();
+    if (queuedBytes > maxQueuedBytes)
+	maxQueuedBytes = queuedBytes;
+
+    if (!congested && queuedBytes >= highWater) {
+	congested = true;
+	++congestions;
+	overflow = slowPolicy == DisconnectSlow;
+	syslog(LOG_WARNING, "host %s is %ld bytes behind%s", remoteAddress().str().c_str(), queuedBytes,
+	       overflow ? "; disconnecting" : slowPolicy == BusySlow ? "; pausing requests" :
+	       "; dropping intermediate replies");
     }
 
-    if (socketQ.size() > maxSocketQSize)
-	maxSocketQSize = socketQ.size();
-		
-    return true;
+    if (queuedBytes >= highWater * QUEUE_LIMIT_FACTOR && !overflow) {
+	overflow = true;
+	syslog(LOG_WARNING, "host %s is %ld bytes behind; disconnecting", remoteAddress().str().c_str(), queuedBytes);
+    }
+
+    // The gateway closes overflowing clients when it checks the
+    // backlogs.
+
+    if (overflow)
+	newBacklog = true;
 }
 
+// Drops 'len' bytes that have been written from the front of the
+// queue.
+
+void TcpClientProtocolHandler::consume(size_t len)
+{
+    queuedBytes -= len;
+    while (len) {
+	SocketChunk& chunk = socketQ.front();
+	size_t const n = std::min(len, chunk.remaining());
+
+	chunk.offset += n;
+	len -= n;
+	if (!chunk.remaining()) {
+	    chunk.buf->release();
+	    socketQ.pop_front();
+	}
+    }
+
+    if (congested && queuedBytes <= lowWater)
+	congested = false;
+}
+
+// Writes as much of the queue as the socket takes, handing the kernel
+// as many buffers per call as it accepts.
+
 bool TcpClientProtocolHandler::sendPendingPackets()
 {
+    if (detached)
+	return false;
+
     while (!socketQ.empty()) {
-	SocketBuffer* const sBuf = socketQ.peek();
+	iovec iov[IOV_MAX];
+	size_t total = 0;
+	int cnt = 0;
+
+	for (auto ii = socketQ.begin(); ii != socketQ.end() && cnt < IOV_MAX; ++ii, ++cnt) {
+	    iov[cnt].iov_base = (void*) ii->data();
+	    iov[cnt].iov_len = ii->remaining();
+	    total += ii->remaining();
+	}
+
+	// When the queue holds more than one call's worth, the kernel is
+	// told more is coming so it doesn't push out a short segment.
+
+	msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = cnt;
 
-	ssize_t const remaining = sBuf->remaining();
-	ssize_t const sLen = ::send(sTcp, sBuf->data(), remaining, 0);
+	ssize_t const sLen = sendmsg(sTcp, &msg, cnt == IOV_MAX && socketQ.size() > IOV_MAX ? MSG_MORE : 0);
 
 	if (-1 == sLen) {
 	    if (socketBufferFull()) {
@@ -399,31 +835,123 @@ bool TcpClientProtocolHandler::sendPendingPackets()
 	    }
 	}
 
-	sBuf->consume(sLen);
+	consume(sLen);
 
-	if (sBuf->empty())
-	    delete socketQ.pop();
-
-	if (sLen < remaining)
+	if ((size_t) sLen < total)
 	    return false;
     }
 
     return false;
 }
 
-void handleTcpClient(int sTcp, nodename_t tcpNode)
+// Called when the client of a resumable session goes away. The rest
+// of a frame that was partly written to the old socket is dropped so
+// the new connection starts on a frame boundary.
+
+void TcpClientProtocolHandler::detach()
 {
-    bool done = false;
- 
-    openlog("acnetd-tcp-fork", LOG_PID | LOG_NDELAY, LOG_LOCAL1);
+    detached = true;
+    sTcp = -1;
 
-    // Ignore SIGPIPE so we get socket errors when we try to
-    // write to the client TCP socket
+    while (!socketQ.empty() && !(socketQ.front().first && !socketQ.front().offset)) {
+	queuedBytes -= socketQ.front().remaining();
+	socketQ.front().buf->release();
+	socketQ.pop_front();
+    }
 
-    signal(SIGPIPE, SIG_IGN);
+    if (congested && queuedBytes <= lowWater)
+	congested = false;
+}
 
-    // Setup the client TCP socket
+// Hands a detached handler the connection of its resumed session.
+// The client hears the session's token before anything that was
+// queued while it was away.
+
+void TcpClientProtocolHandler::attach(int s, ipaddr_t addr, std::string const& token)
+{
+    SocketQueue held;
+    size_t const heldBytes = queuedBytes;
+
+    held.swap(socketQ);
+    queuedBytes = 0;
+
+    sTcp = s;
+    remoteAddr = addr;
+    detached = false;
+    restart();
+
+    (void) sendPacket(ACNETD_SESSION, token.data(), token.size());
+
+    if (!held.empty()) {
+	socketQ.insert(socketQ.end(), held.begin(), held.end());
+	queuedBytes += heldBytes;
+	if (queuedBytes > maxQueuedBytes)
+	    maxQueuedBytes = queuedBytes;
+	newBacklog = true;
+    }
+}
+
+// Forgets the partial frame the old connection left behind.
+
+void TcpClientProtocolHandler::restart()
+{
+    std::vector<uint8_t>().swap(rxBuf);
+    inputHeld = false;
+}
+
+SocketBuffer* SocketBuffer::create(void const* a, size_t aLen, void const* b, size_t bLen)
+{
+    void* const mem = ::operator new(sizeof(SocketBuffer) + aLen + bLen);
+    SocketBuffer* const buf = new (mem) SocketBuffer(aLen + bLen);
+
+    memcpy(buf->_data, a, aLen);
+    if (bLen)
+	memcpy(buf->_data + aLen, b, bLen);
+    return buf;
+}
+
+void SocketBuffer::release()
+{
+    if (!--refs) {
+	this->~SocketBuffer();
+	::operator delete(this);
+    }
+}
+
+SharedPacket* SharedPacket::current = 0;
+
+SharedPacket::SharedPacket(void const* pkt, size_t len) : pkt(pkt), len(len), buf(0)
+{
+    assert(!current);
+    current = this;
+}
+
+SharedPacket::~SharedPacket()
+{
+    if (buf)
+	buf->release();
+    current = 0;
+}
+
+// Returns a reference to the shared copy of the packet, making the
+// copy the first time it's needed, or null if the data isn't the
+// packet being shared.
+
+SocketBuffer* SharedPacket::find(void const* pkt, size_t len)
+{
+    if (!current || current->pkt != pkt || current->len != len)
+	return 0;
+
+    if (!current->buf)
+	current->buf = SocketBuffer::create(pkt, len);
+    return current->buf->acquire();
+}
 
+// Prepares a newly accepted client socket and returns the address of
+// the client.
+
+static ipaddr_t setupClientSocket(int sTcp)
+{
     int v = 1;
     if (-1 == setsockopt(sTcp, IPPROTO_TCP, TCP_NODELAY, &v, sizeof(v)))
 	syslog(LOG_WARNING, "couldn't set TCP_NODELAY for socket -- %m");
@@ -439,11 +967,6 @@ void handleTcpClient(int sTcp, nodename_t tcpNode)
     if (-1 == fcntl(sTcp, F_SETFL, O_NONBLOCK))
 	syslog(LOG_ERR, "unable to set socket non-blocking -- %m");
 
-    // Connect to acnetd
-
-    int sCmd = createCommandSocket();
-    int sData = createDataSocket();
-
     struct sockaddr_in addr;
     socklen_t len = sizeof(addr);
 
@@ -454,8 +977,44 @@ void handleTcpClient(int sTcp, nodename_t tcpNode)
     } else
 	syslog(LOG_NOTICE, "connection on socket: %d", sTcp);
 
+    return ip;
+}
+
+void handleTcpClient(int sTcp, nodename_t tcpNode)
+{
+    bool done = false;
+ 
+    openlog("acnetd-tcp-fork", LOG_PID | LOG_NDELAY, LOG_LOCAL1);
+
+    // Ignore SIGPIPE so we get socket errors when we try to
+    // write to the client TCP socket
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // Setup the client TCP socket
+
+    ipaddr_t const ip = setupClientSocket(sTcp);
+
+    // Connect to acnetd
+
+    int sCmd = createCommandSocket();
+    int sData = createDataSocket();
+
     if (sCmd != -1 && sData != -1) {
-	TcpClientProtocolHandler *handler = handshake(sTcp, sCmd, sData, tcpNode, ip);
+	TcpClientProtocolHandler *handler = 0;
+	std::string request, session;
+	bool failed = false;
+	int64_t const start = currentTimeMillis();
+
+	while (!handler && !failed) {
+	    pollfd pfd[] = {{ sTcp, POLLIN, 0 }};
+	    int64_t const left = HANDSHAKE_TIMEOUT - (currentTimeMillis() - start);
+
+	    if (left <= 0 || poll(pfd, 1, left) == 0)
+		failed = true;
+	    else
+		handler = handshake(sTcp, request, sCmd, sData, tcpNode, ip, session, failed);
+	}
 
 	if (!handler) {
 	    syslog(LOG_ERR, "closing on invalid handshake");
@@ -465,9 +1024,20 @@ void handleTcpClient(int sTcp, nodename_t tcpNode)
 	    exit(1);
 	}
 
-	// Handle TCP client and acnetd messages
+	// A forked handler's tasks go with its process, so there's no
+	// session to resume. The client just never gets a token.
+
+	if (!session.empty())
+	    syslog(LOG_NOTICE, "host %s asked for a resumable session, which forked clients don't support",
+		   handler->remoteAddress().str().c_str());
 
-	while (!done) {
+	if (!request.empty())
+	    done = handler->receive((uint8_t*) &request[0], request.size());
+
+	// Handle TCP client and acnetd messages. A client that falls too
+	// far behind is dropped.
+
+	while (!done && !handler->overflowed()) {
 	    pollfd pfd[] = {
 		{ sCmd, POLLIN, 0 },
 		{ sTcp, POLLIN, 0 },
@@ -477,8 +1047,12 @@ void handleTcpClient(int sTcp, nodename_t tcpNode)
 	    if (handler->anyPendingPackets())
 		pfd[1].events |= POLLOUT;
 
+	    // Once a command is acked, the ones held behind it are handled
+	    // without waiting for more input from the client.
+
+	    bool const held = handler->heldInput();
 	    int const n = handler->whichTraffic() == TcpClientProtocolHandler::AckTraffic ? 1 : sizeof(pfd) / sizeof(pfd[0]);
-	    int const pollStat = poll(pfd, n, 10000);
+	    int const pollStat = poll(pfd, n, held ? 0 : 10000);
 
 	    if (termSignal) {
 		handler->handleShutdown();
@@ -490,7 +1064,7 @@ void handleTcpClient(int sTcp, nodename_t tcpNode)
 		done = handler->sendPendingPackets();
 
 	    if (!done) {
-		if (pollStat > 0) {
+		if (pollStat > 0 || held) {
 
 		    // Check data socket from acnetd
 
@@ -501,6 +1075,8 @@ void handleTcpClient(int sTcp, nodename_t tcpNode)
 
 		    if (pfd[1].revents & POLLIN)
 			done = handler->handleClientSocket();
+		    else if (held)
+			done = handler->receive(0, 0);
 
 		    // Check for command acks from acnetd
 
@@ -516,8 +1092,10 @@ void handleTcpClient(int sTcp, nodename_t tcpNode)
 	    }
 	}
 
-	syslog(LOG_ERR, "disconnect from host %s (max queue size %ld)", 
-				handler->remoteAddress().str().c_str(), handler->maxQueueSize());
+	syslog(LOG_ERR, "disconnect from host %s (max queue %ld bytes, %.1f frames per read)",
+				handler->remoteAddress().str().c_str(), handler->maxQueueSize(),
+				handler->framesPerRead());
+	handler->logStats();
 
     } else
 	syslog(LOG_ERR, "unable to create acnetd connection sockets");
@@ -532,3 +1110,567 @@ void handleTcpClient(int sTcp, nodename_t tcpNode)
 
     exit(1);
 }
+
+TcpAdmission tcpAdmission;
+
+TcpAdmission::TcpAdmission() :
+    rate(DEFAULT_ACCEPT_RATE), tokens(DEFAULT_ACCEPT_BURST), burst(DEFAULT_ACCEPT_BURST),
+    perHost(DEFAULT_HOST_CONNS), lastRefill(0), limiting(false), lastHostSummary(0), hostRejectsLogged(0)
+{
+}
+
+// Sets the limits from "rate[:burst[:per-host]]". The burst defaults
+// to twice the rate.
+
+bool TcpAdmission::setLimits(char const* arg)
+{
+    char* end;
+    unsigned long const r = strtoul(arg, &end, 10);
+
+    if (end == arg)
+	return false;
+
+    unsigned long b = 2 * r, h = perHost;
+
+    if (*end == ':') {
+	arg = end + 1;
+	b = strtoul(arg, &end, 10);
+	if (end == arg)
+	    return false;
+	if (*end == ':') {
+	    arg = end + 1;
+	    h = strtoul(arg, &end, 10);
+	    if (end == arg)
+		return false;
+	}
+    }
+
+    if (*end || (r && !b))
+	return false;
+
+    rate = r;
+    tokens = burst = b;
+    perHost = h;
+    return true;
+}
+
+void TcpAdmission::refill(int64_t now)
+{
+    if (lastRefill)
+	tokens = std::min(double(burst), tokens + rate * (now - lastRefill) / 1000.0);
+    lastRefill = now;
+}
+
+bool TcpAdmission::hostFull(ipaddr_t addr) const
+{
+    if (!perHost)
+	return false;
+
+    auto const ii = hosts.find(addr);
+
+    return ii != hosts.end() && ii->second >= perHost;
+}
+
+// Counts a connection turned away because its host is at its limit.
+// Only the first rejection of a host is logged; a reconnect storm
+// from one proxy or NATed host otherwise floods syslog.
+
+void TcpAdmission::hostRejected(ipaddr_t addr, int64_t now, char const* what)
+{
+    ++hostRejects;
+
+    if (!rejecting[addr]++) {
+	syslog(LOG_WARNING, "rejecting %s from host %s -- %ld connections open", what, addr.str().c_str(), perHost);
+	if (!lastHostSummary)
+	    lastHostSummary = now;
+	hostRejectsLogged = (uint32_t) hostRejects;
+    } else if (now - lastHostSummary >= HOST_REJECT_SUMMARY) {
+	syslog(LOG_WARNING, "%" PRIu32 " more connections rejected from %zu hosts at their limit",
+	       (uint32_t) hostRejects - hostRejectsLogged, rejecting.size());
+	lastHostSummary = now;
+	hostRejectsLogged = (uint32_t) hostRejects;
+    }
+}
+
+// Called for each accepted connection. Returns true, and charges the
+// connection to its source address, if it may be served.
+
+bool TcpAdmission::admit(ipaddr_t addr, int64_t now)
+{
+    if (hostFull(addr)) {
+	hostRejected(addr, now, "connection");
+	return false;
+    }
+
+    if (rate) {
+	refill(now);
+	if (tokens < 1.0) {
+	    ++rateRejects;
+
+	    // Only the start of a storm is logged
+
+	    if (!limiting) {
+		limiting = true;
+		syslog(LOG_WARNING, "more than %.0f connections per second -- rejecting", rate);
+	    }
+	    return false;
+	}
+	tokens -= 1.0;
+    }
+
+    if (limiting) {
+	limiting = false;
+	syslog(LOG_NOTICE, "accepting connections again (%" PRIu32 " rejected so far)", (uint32_t) rateRejects);
+    }
+
+    ++accepted;
+    ++hosts[addr];
+    return true;
+}
+
+// Moves a connection's charge to the client its proxy forwarded.
+// Returns false, leaving the charge where it was, if that client
+// already holds its share of connections.
+
+bool TcpAdmission::move(ipaddr_t from, ipaddr_t to)
+{
+    if (from == to)
+	return true;
+
+    if (hostFull(to)) {
+	hostRejected(to, now(), "forwarded connection");
+	return false;
+    }
+
+    release(from);
+    ++hosts[to];
+    return true;
+}
+
+void TcpAdmission::release(ipaddr_t addr)
+{
+    auto const ii = hosts.find(addr);
+
+    if (ii == hosts.end())
+	return;
+
+    // A host that was being turned away can connect again
+
+    if (ii->second-- == perHost) {
+	auto const jj = rejecting.find(addr);
+
+	if (jj != rejecting.end()) {
+	    syslog(LOG_NOTICE, "accepting connections from host %s again (%" PRIu32 " rejected)",
+		   addr.str().c_str(), jj->second);
+	    rejecting.erase(jj);
+	}
+    }
+
+    if (!ii->second)
+	hosts.erase(ii);
+}
+
+// Forked handlers hold their charge until their process is reaped
+
+void TcpAdmission::forked(pid_t pid, ipaddr_t addr)
+{
+    children[pid] = addr;
+}
+
+void TcpAdmission::reaped(pid_t pid)
+{
+    auto const ii = children.find(pid);
+
+    if (ii != children.end()) {
+	release(ii->second);
+	children.erase(ii);
+    }
+}
+
+#ifndef NO_REPORT
+void TcpAdmission::report(std::ostream& os) const
+{
+    os << "\t\t<div class=\"section\">\n\t\t<h1>TCP Client Connections</h1>\n";
+
+    os << "\t\t<table class=\"dump\">\n"
+	"\t\t\t<colgroup>\n"
+	"\t\t\t\t<col class=\"label\"/>\n"
+	"\t\t\t\t<col/>\n"
+	"\t\t\t</colgroup>\n"
+	"\t\t\t<tbody>\n";
+
+    {
+	static struct {
+	    char const* descr;
+	    StatCounter TcpAdmission::* count;
+	} const data[] = {
+	    { "Accepted", &TcpAdmission::accepted },
+	    { "Rejected (rate)", &TcpAdmission::rateRejects },
+	    { "Rejected (per host)", &TcpAdmission::hostRejects },
+	};
+
+	for (size_t ii = 0; ii < sizeof(data) / sizeof(*data); ++ii)
+	    os << "\t\t\t\t<tr" << (ii % 2 ? "" : " class=\"even\"") << ">"
+		"<td class=\"label\">" << data[ii].descr << "</td>"
+		"<td>'" << std::setw(13) << std::setfill(' ') << (uint32_t) (this->*data[ii].count) << "'</td></tr>\n";
+    }
+
+    os << "\t\t\t\t<tr class=\"even\"><td class=\"label\">Hosts connected</td><td>'" << std::setw(13) <<
+	std::setfill(' ') << hosts.size() << "'</td></tr>\n";
+    os << "\t\t\t</tbody>\n"
+	"\t\t</table>\n"
+	"\t\t</div>\n";
+}
+#endif
+
+#if THIS_TARGET == Linux_Target
+
+TcpClientGateway::TcpClientGateway(nodename_t tcpNode) :
+    epfd(epoll_create1(EPOLL_CLOEXEC)), tcpNode(tcpNode), nextCheck(0), maxClients(0)
+{
+    if (epfd == -1)
+	syslog(LOG_ERR, "couldn't create TCP client epoll set -- %m");
+}
+
+TcpClientGateway::~TcpClientGateway()
+{
+    shutdown();
+    if (epfd != -1)
+	close(epfd);
+}
+
+// Brings the epoll registration of a client in line with the events
+// we want from it.
+
+void TcpClientGateway::watch(Connection* c, uint32_t events)
+{
+    if (events != c->events) {
+	epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = c;
+
+	if (-1 == epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev))
+	    syslog(LOG_ERR, "couldn't update TCP client epoll set -- %m");
+	c->events = events;
+    }
+}
+
+void TcpClientGateway::updateInterest(Connection* c)
+{
+    watch(c, EPOLLIN | (c->handler->anyPendingPackets() ? (uint32_t) EPOLLOUT : 0));
+}
+
+void TcpClientGateway::addClient(int sTcp)
+{
+    Connection* const c = new Connection();
+
+    c->fd = sTcp;
+    c->events = EPOLLIN;
+    c->remoteAddr = setupClientSocket(sTcp);
+    c->handler = 0;
+    c->lastActivity = currentTimeMillis();
+    c->closed = false;
+    c->detachedAt = 0;
+
+    epoll_event ev;
+
+    ev.events = c->events;
+    ev.data.ptr = c;
+
+    if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, sTcp, &ev)) {
+	syslog(LOG_ERR, "couldn't add TCP client to epoll set -- %m");
+	close(sTcp);
+	tcpAdmission.release(c->remoteAddr);
+	delete c;
+	return;
+    }
+
+    clients.insert(c);
+    if (clients.size() > maxClients)
+	maxClients = clients.size();
+}
+
+// Handles the events of one client. Returns true when the connection
+// should be closed.
+
+bool TcpClientGateway::handleEvent(Connection* c, uint32_t events)
+{
+    if (!c->handler) {
+	std::string session;
+	bool failed;
+
+	if (!(c->handler = handshake(c->fd, c->request, -1, -1, tcpNode, c->remoteAddr, session, failed))) {
+	    if (failed)
+		syslog(LOG_ERR, "closing on invalid handshake");
+	    return failed;
+	}
+
+	// A proxied connection now counts against the client it
+	// forwarded.
+
+	ipaddr_t const origin = c->handler->remoteAddress();
+
+	if (!tcpAdmission.move(c->remoteAddr, origin))
+	    return true;
+	c->remoteAddr = origin;
+
+	// A client that asked for a session picks up the one it names,
+	// if it's still held and speaks the same protocol, or is given
+	// a new one.
+
+	if (!session.empty()) {
+	    auto const ii = sessions.find(session);
+
+	    if (ii != sessions.end() && typeid(*ii->second->handler) == typeid(*c->handler))
+		resumeSession(ii->second, c);
+	    else
+		startSession(c);
+	}
+
+	// Commands the client sent right behind its handshake
+
+	std::string rest;
+
+	rest.swap(c->request);
+	return !rest.empty() && c->handler->receive((uint8_t*) &rest[0], rest.size());
+    }
+
+    if ((events & EPOLLOUT) && c->handler->sendPendingPackets())
+	return true;
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+	return c->handler->handleClientSocket();
+    return false;
+}
+
+void TcpClientGateway::handleEvents()
+{
+    epoll_event ev[64];
+    int const n = epoll_wait(epfd, ev, sizeof(ev) / sizeof(ev[0]), 0);
+
+    for (int ii = 0; ii < n; ++ii) {
+	Connection* const c = (Connection*) ev[ii].data.ptr;
+
+	// Handling an earlier client in this batch may have closed this
+	// one.
+
+	if (c->closed)
+	    continue;
+
+	c->lastActivity = currentTimeMillis();
+
+	if (handleEvent(c, ev[ii].events))
+	    dropClient(c);
+	else if (c->handler)
+	    updateInterest(c);
+    }
+
+    // Send the acks batched up for pipelined clients.
+
+    for (auto ii = taskPoolMap.begin(); ii != taskPoolMap.end(); ++ii)
+	ii->second->flushPendingAcks();
+
+    watchBacklogs();
+    releaseClosed();
+}
+
+// Packets for a client are usually written to its socket as they
+// are sent. When one has to be queued instead, the client is watched
+// for writability until the queue drains. Since that can happen
+// anywhere a task sends to its client, the handlers only raise a
+// flag and the clients are checked here.
+
+void TcpClientGateway::watchBacklogs()
+{
+    if (TcpClientProtocolHandler::newBacklog) {
+	TcpClientProtocolHandler::newBacklog = false;
+
+	for (auto ii = clients.begin(); ii != clients.end(); ++ii)
+	    if (!(*ii)->closed && (*ii)->handler) {
+		if ((*ii)->handler->overflowed())
+		    closeClient(*ii);
+		else if (!(*ii)->handler->isDetached())
+		    updateInterest(*ii);
+	    }
+    }
+}
+
+// Called from the main loop on every pass. Drops connections that
+// never finished their handshake and sessions whose clients didn't
+// come back in time, and pings idle clients, which also finds the
+// ones that went away without closing their socket. The
+// return value is how long the main loop may sleep before calling
+// again.
+
+int TcpClientGateway::checkClients()
+{
+    int64_t const t = currentTimeMillis();
+
+    if (t >= nextCheck) {
+	for (auto ii = clients.begin(); ii != clients.end(); ++ii) {
+	    Connection* const c = *ii;
+
+	    if (!c->handler) {
+		if (t - c->lastActivity > HANDSHAKE_TIMEOUT) {
+		    syslog(LOG_ERR, "closing on handshake timeout");
+		    closeClient(c);
+		}
+	    } else if (c->handler->isDetached()) {
+		if (t - c->detachedAt > SESSION_GRACE) {
+		    syslog(LOG_NOTICE, "session of host %s expired", c->remoteAddr.str().c_str());
+		    closeClient(c);
+		}
+	    } else if (t - c->lastActivity > PING_INTERVAL) {
+		c->lastActivity = t;
+		if (c->handler->handleClientPing())
+		    dropClient(c);
+	    }
+	}
+	nextCheck = t + 1000;
+    }
+
+    // Packets from the network are sent to the clients outside of
+    // handleEvents().
+
+    watchBacklogs();
+    releaseClosed();
+    return (int) (nextCheck - t);
+}
+
+// Returns a new session token: 128 random bits in hex.
+
+static std::string sessionToken()
+{
+    static char const hex[] = "0123456789abcdef";
+    uint8_t bits[16];
+    std::string token;
+
+    if (RAND_bytes(bits, sizeof(bits)) == 1)
+	for (size_t ii = 0; ii < sizeof(bits); ++ii) {
+	    token += hex[bits[ii] >> 4];
+	    token += hex[bits[ii] & 0xf];
+	}
+    return token;
+}
+
+void TcpClientGateway::startSession(Connection* c)
+{
+    std::string const token = sessionToken();
+
+    if (token.empty()) {
+	syslog(LOG_ERR, "couldn't create a session token for host %s", c->remoteAddr.str().c_str());
+	return;
+    }
+
+    c->session = token;
+    sessions[token] = c;
+    (void) c->handler->sendPacket(ACNETD_SESSION, token.data(), token.size());
+    syslog(LOG_NOTICE, "host %s started a resumable session", c->remoteAddr.str().c_str());
+}
+
+// Moves a session from the connection that held it to the client's
+// new connection. The new connection's handler hasn't done anything
+// yet, so the session's handler, with its tasks and queue, takes its
+// place. The old connection may not have noticed its client is gone.
+
+void TcpClientGateway::resumeSession(Connection* old, Connection* c)
+{
+    TcpClientProtocolHandler* const handler = old->handler;
+
+    syslog(LOG_NOTICE, "host %s resumed its session after %ld ms", c->remoteAddr.str().c_str(),
+	   old->fd == -1 ? long(currentTimeMillis() - old->detachedAt) : 0L);
+
+    if (!handler->isDetached())
+	handler->detach();
+
+    delete c->handler;
+    c->handler = handler;
+    c->session.swap(old->session);
+    sessions[c->session] = c;
+
+    old->handler = 0;
+    old->closed = true;
+    if (old->fd != -1)
+	close(old->fd);
+    tcpAdmission.release(old->remoteAddr);
+    closing.push_back(old);
+
+    handler->attach(c->fd, c->remoteAddr, c->session);
+}
+
+// Handles a connection that failed or that the client closed. The
+// tasks of a session are kept, without a socket, until the client
+// comes back or the grace period runs out. Anything else is closed.
+
+void TcpClientGateway::dropClient(Connection* c)
+{
+    if (c->session.empty() || c->handler->overflowed() || c->handler->saidGoodbye()) {
+	closeClient(c);
+	return;
+    }
+
+    syslog(LOG_NOTICE, "host %s disconnected; holding its session for %d seconds", c->remoteAddr.str().c_str(),
+	   SESSION_GRACE / 1000);
+
+    close(c->fd);
+    c->fd = -1;
+    c->events = 0;
+    c->detachedAt = currentTimeMillis();
+    c->handler->detach();
+}
+
+void TcpClientGateway::closeClient(Connection* c)
+{
+    if (!c->closed) {
+	c->closed = true;
+
+	if (!c->session.empty())
+	    sessions.erase(c->session);
+
+	if (c->handler) {
+	    syslog(LOG_ERR, "disconnect from host %s (max queue %ld bytes, %.1f frames per read)",
+		   c->remoteAddr.str().c_str(), c->handler->maxQueueSize(), c->handler->framesPerRead());
+	    c->handler->logStats();
+
+	    // The client's tasks write to its connection, so they go
+	    // before it does.
+
+	    for (auto ii = taskPoolMap.begin(); ii != taskPoolMap.end(); ++ii)
+		ii->second->removeClientTasks(c->handler);
+	}
+
+	if (c->fd != -1)
+	    close(c->fd);
+	delete c->handler;
+	c->handler = 0;
+	tcpAdmission.release(c->remoteAddr);
+
+	closing.push_back(c);
+    }
+}
+
+// Connections are freed after their batch of events has been handled
+// since later events in the batch may still point at them.
+
+void TcpClientGateway::releaseClosed()
+{
+    for (auto ii = closing.begin(); ii != closing.end(); ++ii) {
+	clients.erase(*ii);
+	delete *ii;
+    }
+    closing.clear();
+}
+
+void TcpClientGateway::shutdown()
+{
+    for (auto ii = clients.begin(); ii != clients.end(); ++ii) {
+	if ((*ii)->handler) {
+	    (*ii)->handler->handleShutdown();
+	    (void) (*ii)->handler->sendPendingPackets();
+	}
+	closeClient(*ii);
+    }
+    releaseClosed();
+}
+
+#endif
@@ -0,0 +1,78 @@
+#include <cerrno>
+#include "tcptask.h"
+
+ssize_t TcpLink::send(uint16_t type, void const* d, size_t n)
+{
+    // Packets the client's slow-consumer policy discards are reported
+    // as sent, like any other packet lost on the way to the client.
+
+    if (type == ACNETD_DATA && client->dropsPacket(d, n))
+	return (ssize_t) n;
+
+    if (client->sendPacket(type, d, n))
+	return (ssize_t) n;
+
+    errno = EPIPE;
+    return -1;
+}
+
+bool TcpLink::sameLink(TaskInfo const* task) const
+{
+    TcpLink const* const o = dynamic_cast<TcpLink const*>(task);
+
+    return o && o->client == client;
+}
+
+// Searches the pool for the task with the given name that belongs to
+// the given TCP client.
+
+TaskInfo* TcpLink::find(TaskPool& taskPool, taskhandle_t th, TcpClientProtocolHandler const* client)
+{
+    auto ii = taskPool.tasks(th);
+
+    while (ii.first != ii.second) {
+	TcpLink const* const o = dynamic_cast<TcpLink const*>(ii.first->second);
+
+	if (o && o->client == client)
+	    return ii.first->second;
+	++ii.first;
+    }
+
+    return 0;
+}
+
+// The tasks of in-process clients have no sockets of their own. They
+// carry acnetd's pid and zero ports, which no client socket can have,
+// so they are never found by TaskPool::getTask().
+
+TcpTask::TcpTask(TaskPool& taskPool, taskhandle_t handle, taskid_t id, TcpClientProtocolHandler* client,
+		 ipaddr_t remoteAddr) :
+    RemoteTask(taskPool, handle, id, getpid(), 0, 0, remoteAddr), TcpLink(client)
+{
+}
+
+ssize_t TcpTask::sendToCommandSocket(void const* d, size_t n)
+{
+    return send(ACNETD_ACK, d, n);
+}
+
+ssize_t TcpTask::sendToDataSocket(void const* d, size_t n)
+{
+    return send(ACNETD_DATA, d, n);
+}
+
+TcpMulticastTask::TcpMulticastTask(TaskPool& taskPool, taskhandle_t handle, taskid_t id,
+				   TcpClientProtocolHandler* client, ipaddr_t mcAddr) :
+    MulticastTask(taskPool, handle, id, getpid(), 0, 0, mcAddr), TcpLink(client)
+{
+}
+
+ssize_t TcpMulticastTask::sendToCommandSocket(void const* d, size_t n)
+{
+    return send(ACNETD_ACK, d, n);
+}
+
+ssize_t TcpMulticastTask::sendToDataSocket(void const* d, size_t n)
+{
+    return send(ACNETD_DATA, d, n);
+}
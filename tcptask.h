@@ -0,0 +1,79 @@
+#ifndef __TCPTASK_H
+#define __TCPTASK_H
+
+#include "remtask.h"
+#include "mctask.h"
+
+// TcpLink
+//
+// The connection of a TCP client that acnetd serves in-process. Its
+// tasks frame their acks and data onto the connection's send queue
+// instead of sending them to a pair of UDP sockets.
+//
+class TcpLink {
+    TcpClientProtocolHandler* const client;
+
+ protected:
+    explicit TcpLink(TcpClientProtocolHandler* client) : client(client) {}
+
+    ssize_t send(uint16_t, void const*, size_t);
+    bool sameLink(TaskInfo const*) const;
+    bool linkBusy() const { return client->refusesRequests(); }
+
+ public:
+    virtual ~TcpLink() {}
+
+    TcpClientProtocolHandler const* tcpClient() const { return client; }
+
+    static TaskInfo* find(TaskPool&, taskhandle_t, TcpClientProtocolHandler const*);
+};
+
+// TcpTask
+//
+// A RemoteTask connected through an in-process TCP client
+//
+class TcpTask : public RemoteTask, public TcpLink {
+    TcpTask();
+
+ protected:
+    ssize_t sendToCommandSocket(void const*, size_t);
+    ssize_t sendToDataSocket(void const*, size_t);
+
+ public:
+    TcpTask(TaskPool&, taskhandle_t, taskid_t, TcpClientProtocolHandler*, ipaddr_t);
+    virtual ~TcpTask() {}
+
+    bool equals(TaskInfo const* o) const { return sameLink(o); }
+    bool sameClient(TaskInfo const* o) const { return sameLink(o); }
+    bool hasCredit() const { return !linkBusy() && RemoteTask::hasCredit(); }
+
+    char const* name() const { return "TcpTask"; }
+};
+
+// TcpMulticastTask
+//
+// A MulticastTask connected through an in-process TCP client
+//
+class TcpMulticastTask : public MulticastTask, public TcpLink {
+    TcpMulticastTask();
+
+ protected:
+    ssize_t sendToCommandSocket(void const*, size_t);
+    ssize_t sendToDataSocket(void const*, size_t);
+
+ public:
+    TcpMulticastTask(TaskPool&, taskhandle_t, taskid_t, TcpClientProtocolHandler*, ipaddr_t);
+    virtual ~TcpMulticastTask() {}
+
+    bool equals(TaskInfo const* o) const { return sameLink(o); }
+    bool sameClient(TaskInfo const* o) const { return sameLink(o); }
+    bool hasCredit() const { return !linkBusy() && MulticastTask::hasCredit(); }
+
+    char const* name() const { return "TcpMulticastTask"; }
+};
+
+// Local Variables:
+// mode:c++
+// End:
+
+#endif
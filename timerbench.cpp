@@ -0,0 +1,151 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <vector>
+#include "timesensitive.h"
+
+// timerbench compares the cost of re-arming a timeout, which acnetd
+// does for every reply it sends or receives, in the sorted list the
+// request and reply pools used to keep and in the TimerWheel. Each
+// of 'entries' timeouts is between 400 ms and 390 s long. The clock
+// advances a millisecond per re-arm and every re-arm picks an entry
+// at random, as replies to many open requests would.
+
+using std::chrono::steady_clock;
+
+static int64_t clockMs = 1000000;
+
+int64_t now()
+{
+    return clockMs;
+}
+
+struct Entry : public TimeSensitive {
+    int64_t tmo;
+
+    Entry() : tmo(0) {}
+    int64_t expiration() const { return lastUpdate + tmo; }
+
+    // The old re-arm: walk back from the tail of the sorted list to
+    // the entry's place.
+
+    void insertSorted(Node* root)
+    {
+	detach();
+	lastUpdate = now();
+
+	Node* current = root->prev();
+
+	while (current != root && static_cast<Entry const*>(current)->expiration() > expiration())
+	    current = current->prev();
+	insertBefore(current->next());
+    }
+};
+
+static void usage(char const* prog)
+{
+    fprintf(stderr, "usage: %s [-n entries] [-r rearms]\n"
+	    "  -n entries\tarmed timeouts (default 8192)\n"
+	    "  -r rearms\tre-arms to time (default 1000000)\n", prog);
+    exit(1);
+}
+
+static double nsPer(steady_clock::time_point start, size_t n)
+{
+    return std::chrono::duration<double, std::nano>(steady_clock::now() - start).count() / n;
+}
+
+int main(int argc, char** argv)
+{
+    size_t entries = 8192, rearms = 1000000;
+    int ch;
+
+    while (-1 != (ch = getopt(argc, argv, "n:r:")))
+	switch (ch) {
+	 case 'n':
+	    entries = strtoul(optarg, 0, 0);
+	    break;
+
+	 case 'r':
+	    rearms = strtoul(optarg, 0, 0);
+	    break;
+
+	 default:
+	    usage(argv[0]);
+	}
+
+    if (!entries)
+	usage(argv[0]);
+
+    std::vector<size_t> picks(rearms);
+
+    srandom(1);
+    for (size_t ii = 0; ii < rearms; ++ii)
+	picks[ii] = random() % entries;
+
+    // The sorted list
+
+    {
+	std::vector<Entry> e(entries);
+	Node root;
+
+	for (size_t ii = 0; ii < entries; ++ii) {
+	    e[ii].tmo = 400 + random() % 389600;
+	    e[ii].insertSorted(&root);
+	}
+
+	int64_t const start = clockMs;
+	auto const t = steady_clock::now();
+
+	for (size_t ii = 0; ii < rearms; ++ii) {
+	    ++clockMs;
+	    e[picks[ii]].insertSorted(&root);
+	}
+	printf("%zu entries: sorted list %8.1f ns per re-arm\n", entries, nsPer(t, rearms));
+	clockMs = start;
+    }
+
+    // The wheel. Expired entries are drained as the clock moves so the
+    // cost of moving entries down the levels is counted too.
+
+    {
+	std::vector<Entry> e(entries);
+	TimerWheel wheel;
+	size_t expired = 0, early = 0;
+
+	srandom(1);
+	for (size_t ii = 0; ii < rearms; ++ii)
+	    (void) random();
+	for (size_t ii = 0; ii < entries; ++ii) {
+	    e[ii].tmo = 400 + random() % 389600;
+	    e[ii].update(wheel);
+	}
+
+	auto const t = steady_clock::now();
+
+	for (size_t ii = 0; ii < rearms; ++ii) {
+	    ++clockMs;
+	    e[picks[ii]].update(wheel);
+
+	    TimeSensitive* x;
+
+	    while (0 != (x = wheel.expired(clockMs))) {
+		early += x->expiration() > clockMs;
+		x->update(wheel);
+		++expired;
+	    }
+	}
+	printf("%zu entries: timer wheel %8.1f ns per re-arm (%zu expirations)%s\n", entries, nsPer(t, rearms), expired,
+	       early ? "  EARLY EXPIRATIONS" : "");
+	if (early)
+	    return 1;
+    }
+
+    return 0;
+}
+
+// Local Variables:
+// mode:c++
+// fill-column:125
+// End:
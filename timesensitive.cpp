@@ -1,6 +1,7 @@
 #include <cstdlib>
 #include <cassert>
 #include <cstdint>
+#include <algorithm>
 #include "timesensitive.h"
 
 
@@ -9,22 +10,191 @@ TimeSensitive::TimeSensitive()
     lastUpdate = 0;
 }
 
-void TimeSensitive::update(Node* const root)
+// Stamps the entry with the current time and re-arms it in 'wheel'.
+
+void TimeSensitive::update(TimerWheel& wheel)
 {
-    detach();
     lastUpdate = now();
+    wheel.schedule(this);
+}
+
+TimerWheel::TimerWheel() :
+    current(now())
+{
+    std::fill(occupied, occupied + LEVELS, 0);
+}
+
+// Moves the wheel's time back to 't' after the system clock has
+// stepped backwards. The wheel's time never runs ahead of the clock
+// otherwise, and every entry would be treated as due no earlier than
+// the old time, so all armed entries are taken off and armed again
+// against the new time.
+
+void TimerWheel::rebase(int64_t t)
+{
+    Node armed;
 
-    int64_t const ourExp = expiration();
-    Node* current = root->prev();
+    for (int ll = 0; ll < LEVELS; ++ll) {
+	for (uint64_t bits = occupied[ll]; bits; bits &= bits - 1) {
+	    Node* const head = &slots[ll][__builtin_ctzll(bits)];
 
-    while (current != root) {
-	if (dynamic_cast<TimeSensitive const*>(current)->expiration() <= ourExp)
-	    break;
+	    while (head->next() != head) {
+		TimeSensitive* const e = static_cast<TimeSensitive*>(head->next());
 
-	current = current->prev();
+		e->detach();
+		e->insertBefore(&armed);
+	    }
+	}
+	occupied[ll] = 0;
     }
 
-    current = current->next();
+    while (overflow.next() != &overflow) {
+	TimeSensitive* const e = static_cast<TimeSensitive*>(overflow.next());
+
+	e->detach();
+	e->insertBefore(&armed);
+    }
+
+    current = t;
+    while (armed.next() != &armed)
+	schedule(static_cast<TimeSensitive*>(armed.next()));
+}
+
+// Arms (or re-arms) an entry for its expiration time. The entry goes
+// in the level of the highest digit in which its expiration differs
+// from the wheel's time, in the slot of that digit. An entry already
+// due goes in the current tick's slot.
+
+void TimerWheel::schedule(TimeSensitive* e)
+{
+    int64_t const t = now();
+
+    if (t < current)
+	rebase(t);
+
+    int64_t const exp = std::max(e->expiration(), current);
+    uint64_t const diff = exp ^ current;
+    int const level = diff ? (63 - __builtin_clzll(diff)) / BITS : 0;
+    Node* head = &overflow;
+
+    if (level < LEVELS) {
+	int const ii = slot(exp, level);
+
+	head = &slots[level][ii];
+	occupied[level] |= uint64_t(1) << ii;
+    }
+
+    e->detach();
+    e->insertBefore(head);
+}
+
+// Finds the next time the wheel has something to do: either a level
+// 0 slot whose entries are due or a slot at a higher level whose
+// entries need to move down. Slots whose entries have all been
+// detached since they were armed are cleared from the bitmaps along
+// the way. Returns false when the wheel is empty.
+
+bool TimerWheel::nextEvent(int64_t& when, int& level)
+{
+    for (int ll = 0; ll < LEVELS; ++ll) {
+	int const shift = ll * BITS;
+	int const digit = slot(current, ll);
+
+	// Level 0 includes the current tick. Above it, the slot for the
+	// current time has already been moved down.
+
+	uint64_t const ahead = ll == 0 ? ~uint64_t(0) << digit :
+	    digit == SLOTS - 1 ? 0 : ~uint64_t(0) << (digit + 1);
+	uint64_t bits;
+
+	while (0 != (bits = occupied[ll] & ahead)) {
+	    int const ii = __builtin_ctzll(bits);
+	    Node const& head = slots[ll][ii];
+
+	    if (head.next() == &head) {
+		occupied[ll] &= ~(uint64_t(1) << ii);
+		continue;
+	    }
+
+	    when = ((current >> (shift + BITS)) << (shift + BITS)) | (int64_t(ii) << shift);
+	    level = ll;
+	    return true;
+	}
+    }
+
+    // Overflowed entries are looked at again once the wheel's time
+    // reaches the next turn of the top level.
+
+    if (overflow.next() != &overflow) {
+	when = ((current >> (LEVELS * BITS)) + 1) << (LEVELS * BITS);
+	level = LEVELS;
+	return true;
+    }
+    return false;
+}
+
+// Re-arms the entries of the higher level slot the wheel's time has
+// just reached, which moves them to finer levels.
+
+void TimerWheel::cascade(int level)
+{
+    Node* const head = level < LEVELS ? &slots[level][slot(current, level)] : &overflow;
+    size_t n = 0;
+
+    // Overflowed entries that are still out of reach go back on the
+    // same list, so only the ones there now are moved.
+
+    for (Node* ii = head->next(); ii != head; ii = ii->next())
+	++n;
+
+    while (n--)
+	schedule(static_cast<TimeSensitive*>(head->next()));
+
+    if (level < LEVELS)
+	occupied[level] &= ~(uint64_t(1) << slot(current, level));
+}
+
+// Returns an entry that expired at or before 't', or null if there
+// are none. The caller has to re-arm or detach the entry before
+// asking for the next one.
+
+TimeSensitive* TimerWheel::expired(int64_t t)
+{
+    int64_t when;
+    int level;
+
+    if (t < current)
+	rebase(t);
+
+    while (nextEvent(when, level)) {
+	if (when > t)
+	    return 0;
+
+	current = when;
+	if (level == 0) {
+	    Node* const head = &slots[0][slot(current, 0)];
+
+	    return static_cast<TimeSensitive*>(head->next());
+	}
+	cascade(level);
+    }
+
+    // Nothing is armed, so the wheel's time can jump ahead.
+
+    current = std::max(current, t);
+    return 0;
+}
+
+// Returns how many milliseconds after 't' the wheel next has work
+// to do, or -1 if it's empty. Moving entries down a level counts as
+// work, so this can be earlier than the next expiration.
+
+int TimerWheel::timeout(int64_t t)
+{
+    int64_t when;
+    int level;
 
-    insertBefore(current);
+    if (!nextEvent(when, level))
+	return -1;
+    return when > t ? int(when - t) : 0;
 }
@@ -3,23 +3,69 @@
 
 #include <time.h>
 #include <sys/time.h>
+#include <stdint.h>
 #include "node.h"
 
 // Prototypes of functions (operators) that related to time-keeping.
 
 int64_t now();
 
-// Classes that inherit from this class can be sorted in a "most
-// expired" order.
+class TimerWheel;
+
+// Classes that inherit from this class can be scheduled in a
+// TimerWheel, which hands them back once they've expired.
 
 struct TimeSensitive : public Node {
+ friend class TimerWheel;
+
     int64_t lastUpdate;
 
     TimeSensitive();
-    void update(Node*);
+    void update(TimerWheel&);
     virtual int64_t expiration() const = 0;
 };
 
+// TimerWheel
+//
+// A hierarchical timer wheel with millisecond ticks. Level 0 has a
+// slot for each of the next 64 ticks, and each level above it has
+// slots 64 times as wide as the one below, so four levels cover a
+// little over four and a half hours. An entry goes in the lowest
+// level where its expiration falls in the same slot of the level
+// above as the wheel's current tick, which makes arming and
+// re-arming constant time. When the wheel's time reaches a slot
+// above level 0, the slot's entries move down to finer levels. A
+// bitmap per level tracks the slots that may hold entries. Entries
+// due past the top level's reach wait in an overflow list until the
+// wheel's time gets closer. The wheel runs on now(), which follows
+// the system clock; if the clock steps backwards, the wheel's time
+// is moved back with it.
+//
+class TimerWheel {
+    enum { BITS = 6, SLOTS = 1 << BITS, LEVELS = 4 };
+
+    Node slots[LEVELS][SLOTS];
+    Node overflow;
+    uint64_t occupied[LEVELS];
+    int64_t current;
+
+    TimerWheel(TimerWheel const&);
+    TimerWheel& operator=(TimerWheel const&);
+
+    static int slot(int64_t t, int level) { return (t >> (level * BITS)) & (SLOTS - 1); }
+
+    bool nextEvent(int64_t&, int&);
+    void cascade(int);
+    void rebase(int64_t);
+
+ public:
+    TimerWheel();
+
+    void schedule(TimeSensitive*);
+    TimeSensitive* expired(int64_t);
+    int timeout(int64_t);
+};
+
 // Local Variables:
 // mode:c++
 // End:
@@ -0,0 +1,125 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <vector>
+#include "wsmask.h"
+
+// wsbench compares two ways of unmasking WebSocket payloads: the
+// byte-at-a-time decoder acnetd used to run, which appends each
+// unmasked byte to a vector, and the in-place word kernel in wsmask.h.
+// For each payload size it reports the throughput of both and checks
+// that they agree.
+
+using std::chrono::steady_clock;
+
+static void usage(char const* prog)
+{
+    fprintf(stderr, "usage: %s [-b bytes] [-s size]...\n"
+	    "  -b bytes\tbytes to unmask per payload size (default 1 GB)\n"
+	    "  -s size\tpayload size; may be repeated (default 16, 125, 1024, 8192, 65535)\n", prog);
+    exit(1);
+}
+
+// The old decoder: one XOR and one push_back per byte.
+
+static void unmaskBytes(std::vector<uint8_t>& out, uint8_t const* p, size_t n, uint32_t mask)
+{
+    int offset = 3;
+
+    for (size_t ii = 0; ii < n; ++ii) {
+	out.push_back(p[ii] ^ uint8_t(mask >> (offset * 8)));
+	offset = (offset + 3) % sizeof(mask);
+    }
+}
+
+static double rate(steady_clock::time_point start, size_t bytes)
+{
+    double const secs = std::chrono::duration<double>(steady_clock::now() - start).count();
+
+    return bytes / secs / 1e6;
+}
+
+int main(int argc, char** argv)
+{
+    size_t total = 1000000000;
+    std::vector<size_t> sizes;
+    int ch;
+
+    while (-1 != (ch = getopt(argc, argv, "b:s:")))
+	switch (ch) {
+	 case 'b':
+	    total = strtoul(optarg, 0, 0);
+	    break;
+
+	 case 's':
+	    sizes.push_back(strtoul(optarg, 0, 0));
+	    break;
+
+	 default:
+	    usage(argv[0]);
+	}
+
+    if (sizes.empty())
+	sizes = { 16, 125, 1024, 8192, 65535 };
+
+    uint8_t const key[] = { 0x37, 0xfa, 0x21, 0x3d };
+    uint32_t const mask = (uint32_t(key[0]) << 24) | (uint32_t(key[1]) << 16) | (uint32_t(key[2]) << 8) | key[3];
+
+    for (size_t size : sizes) {
+	if (!size)
+	    continue;
+
+	std::vector<uint8_t> frame(size + 1);
+
+	for (size_t ii = 0; ii < frame.size(); ++ii)
+	    frame[ii] = uint8_t(ii * 131);
+
+	size_t const loops = std::max(total / size, (size_t) 1);
+
+	// Payloads in the read buffer usually start on an odd address
+
+	uint8_t* const p = frame.data() + 1;
+
+	// Byte-at-a-time into a vector, as the handler used to collect
+	// each frame into its payload.
+
+	std::vector<uint8_t> payload;
+	auto start = steady_clock::now();
+
+	for (size_t ii = 0; ii < loops; ++ii) {
+	    payload.clear();
+	    unmaskBytes(payload, p, size, mask);
+	}
+
+	double const byteRate = rate(start, loops * size);
+
+	// In place. Unmasking twice restores the data, so the loop works
+	// on the same bytes every pass.
+
+	start = steady_clock::now();
+	for (size_t ii = 0; ii < loops; ++ii)
+	    unmaskPayload(p, size, key);
+
+	double const wordRate = rate(start, loops * size);
+
+	if (loops % 2)
+	    unmaskPayload(p, size, key);
+	unmaskPayload(p, size, key);
+
+	bool const same = std::equal(payload.begin(), payload.end(), p);
+
+	printf("%6zu byte payloads: byte-at-a-time %8.1f MB/s, in place %8.1f MB/s (%.1fx)%s\n", size,
+	       byteRate, wordRate, wordRate / byteRate, same ? "" : "  MISMATCH");
+	if (!same)
+	    return 1;
+    }
+
+    return 0;
+}
+
+// Local Variables:
+// mode:c++
+// fill-column:125
+// End:
@@ -1,162 +1,311 @@
 #include "server.h"
 #include <sys/socket.h>
 #include <inttypes.h>
-#include <iterator>
+#include <errno.h>
+#include <time.h>
+#include <zlib.h>
+#include "wsmask.h"
 
 // WebSocket TCP client protocol implementation
 
 #define MAX_PAYLOAD_SIZE	(INTERNAL_ACNET_PACKET_SIZE + 2)
 
-template<typename _Container>
-class decode_iterator
-    : public std::iterator<std::output_iterator_tag, void, void, void, void>
-{
-    uint32_t const mask;
-    int offset;
-    _Container& container;
+// When permessage-deflate is negotiated, messages at least this long
+// are compressed. Shorter ones don't shrink enough to pay for it.
 
- public:
-    typedef _Container container_type;
+#define DEFLATE_THRESHOLD	256
+#define DEFLATE_LEVEL		Z_BEST_SPEED
+#define DEFLATE_MEMLEVEL	8
 
-    decode_iterator(_Container& __x, uint32_t const __m) :
-			mask(__m), offset(3), container(__x) {}
+#ifdef CLOCK_THREAD_CPUTIME_ID
+#define STATS_CLOCK		CLOCK_THREAD_CPUTIME_ID
+#else
+#define STATS_CLOCK		CLOCK_MONOTONIC
+#endif
 
-    decode_iterator& operator=(uint8_t const __value)
-    {
-	container.push_back(__value ^ uint8_t(mask >> (offset * 8)));
-	offset = (offset + 3) % sizeof(mask);
-	return *this;
-    }
+static int64_t cpuNanos()
+{
+    timespec ts;
 
-    decode_iterator& operator*()
-    {
-	return *this;
-    }
+    clock_gettime(STATS_CLOCK, &ts);
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
 
-    decode_iterator& operator++()
-    {
-	return *this;
-    }
+WebSocketProtocolHandler::WebSocketProtocolHandler(int sTcp, int sCmd, int sData, nodename_t tcpNode) :
+			    TcpClientProtocolHandler(sTcp, sCmd, sData, tcpNode),
+			    deflateOn(false), deflateNoContext(false), deflateBits(MAX_WBITS), deflater(0),
+			    inflater(0), compressedMsg(false), msgsDeflated(0), rawOut(0), wireOut(0),
+			    msgsInflated(0), wireIn(0), rawIn(0), deflateNs(0), inflateNs(0)
+{
+}
 
-    decode_iterator operator++(int)
-    {
-	return *this;
+WebSocketProtocolHandler::~WebSocketProtocolHandler()
+{
+    if (deflater) {
+	deflateEnd(deflater);
+	delete deflater;
+    }
+    if (inflater) {
+	inflateEnd(inflater);
+	delete inflater;
     }
-};
+}
 
-template<typename _Container>
-inline decode_iterator<_Container> decode_inserter(_Container& __x,
-			   uint32_t const __m)
+void WebSocketProtocolHandler::restart()
 {
-    return decode_iterator<_Container>(__x, __m);
+    TcpClientProtocolHandler::restart();
+    payload.clear();
+    compressedMsg = false;
 }
 
-WebSocketProtocolHandler::WebSocketProtocolHandler(int sTcp, int sCmd, int sData, nodename_t tcpNode) :
-			    TcpClientProtocolHandler(sTcp, sCmd, sData, tcpNode),
-			    payload(MAX_PAYLOAD_SIZE)
+static std::string trim(std::string const& s)
 {
-    payload.clear();
+    size_t const b = s.find_first_not_of(" \t");
+    size_t const e = s.find_last_not_of(" \t");
+
+    return b == std::string::npos ? std::string() : s.substr(b, e - b + 1);
 }
 
-bool WebSocketProtocolHandler::readPayloadLength(uint8_t b, uint64_t& len)
+// Picks the first permessage-deflate offer in the client's
+// Sec-WebSocket-Extensions header that we can honour and returns our
+// answer to it, or an empty string to run without compression.
+
+std::string WebSocketProtocolHandler::negotiateExtensions(std::string const& offers)
 {
-    if (b == 127) {
-	uint32_t tmp[2];
+    size_t pos = 0;
 
-	if (readBytes(tmp, sizeof(tmp))) {
-	    len = (int64_t(ntohl(tmp[0])) << 32) + int64_t(ntohl(tmp[1]));
-	    return len <= MAX_PAYLOAD_SIZE;
-	} else
-	    return false;
-    } else if (b == 126) {
-	uint16_t tmp;
+    while (pos <= offers.size()) {
+	size_t end = offers.find(',', pos);
 
-	if (readBytes(&tmp, sizeof(tmp)))
-	    len = uint64_t(ntohs(tmp));
-	else
-	    return false;
-    } else
-	len = uint64_t(b);
+	if (end == std::string::npos)
+	    end = offers.size();
 
-    return true;
+	std::string const offer = offers.substr(pos, end - pos);
+	size_t p = offer.find(';');
+	bool ok = trim(offer.substr(0, p)) == "permessage-deflate";
+	bool noContext = false;
+	int bits = 0;
+
+	while (ok && p != std::string::npos) {
+	    size_t const q = offer.find(';', p + 1);
+	    std::string const param = trim(offer.substr(p + 1, q == std::string::npos ? q : q - p - 1));
+	    size_t const eq = param.find('=');
+	    std::string const name = trim(param.substr(0, eq));
+	    std::string const value = eq == std::string::npos ? std::string() : trim(param.substr(eq + 1));
+
+	    if (name == "server_no_context_takeover")
+		noContext = true;
+	    else if (name == "server_max_window_bits") {
+
+		// zlib can't produce raw deflate streams with a 256 byte
+		// window, so such an offer is passed over.
+
+		bits = atoi(value.c_str());
+		ok = bits >= 9 && bits <= MAX_WBITS;
+	    } else if (name != "client_no_context_takeover" && name != "client_max_window_bits")
+		ok = false;
+
+	    p = q;
+	}
+
+	if (ok) {
+	    std::string answer = "permessage-deflate";
+
+	    deflateOn = true;
+	    deflateNoContext = noContext;
+	    if (noContext)
+		answer += "; server_no_context_takeover";
+	    if (bits) {
+		deflateBits = bits;
+		answer += "; server_max_window_bits=" + std::to_string(bits);
+	    }
+	    return answer;
+	}
+	pos = end + 1;
+    }
+
+    return std::string();
 }
 
-bool WebSocketProtocolHandler::readMask(bool msk, uint32_t& mask)
+// Runs the deflate stream over one piece of input, growing 'out' as
+// needed. 'have' is the number of bytes of 'out' already used.
+
+static bool runDeflate(z_stream* z, void const* in, size_t n, int flush, std::vector<uint8_t>& out, size_t& have)
 {
-    if (msk) {
-	if (readBytes(&mask, sizeof(mask)))
-	    mask = ntohl(mask);
-	else
+    z->next_in = (Bytef*) in;
+    z->avail_in = n;
+
+    do {
+	if (out.size() - have < 64)
+	    out.resize(out.size() * 2 + 64);
+
+	z->next_out = out.data() + have;
+	z->avail_out = out.size() - have;
+
+	int const res = deflate(z, flush);
+
+	have = out.size() - z->avail_out;
+	if (res != Z_OK && res != Z_BUF_ERROR)
 	    return false;
-    } else
-	mask = 0;
+    } while (z->avail_in || !z->avail_out);
 
     return true;
 }
 
-bool WebSocketProtocolHandler::sendBinaryDataToClient(Pkt2 *pkt2, ssize_t len, uint16_t type)
+// Sends a message as a compressed frame. The type word is compressed
+// along with the payload since it's part of the message.
+
+bool WebSocketProtocolHandler::sendCompressed(uint16_t type, void const* data, size_t len)
 {
-    bool done = false;
+    static std::vector<uint8_t> out;
+    int64_t const start = cpuNanos();
+    uint16_t const t = htons(type);
+    size_t have = 0;
+
+    if (!runDeflate(deflater, &t, sizeof(t), Z_NO_FLUSH, out, have) ||
+	!runDeflate(deflater, data, len, Z_SYNC_FLUSH, out, have)) {
+	syslog(LOG_ERR, "ws: couldn't compress message -- %s", deflater->msg ? deflater->msg : "zlib error");
+	errno = EIO;
+	return false;
+    }
 
-    if (len <= 125) {
+    // The flush ends with an empty stored block, which the receiver
+    // puts back.
+
+    have -= 4;
+    if (deflateNoContext)
+	deflateReset(deflater);
+
+    deflateNs += cpuNanos() - start;
+    ++msgsDeflated;
+    rawOut += len + sizeof(type);
+    wireOut += have;
+
+    uint8_t hdr[10] = { 0xc2 };
+    size_t hLen;
+
+    if (have <= 125) {
+	hdr[1] = have;
+	hLen = 2;
+    } else if (have <= 0xffff) {
+	hdr[1] = 126;
+	hdr[2] = have >> 8;
+	hdr[3] = have;
+	hLen = 4;
+    } else {
+	hdr[1] = 127;
+	for (int ii = 0; ii < 8; ++ii)
+	    hdr[2 + ii] = uint64_t(have) >> (8 * (7 - ii));
+	hLen = 10;
+    }
 
-	// Convert packet (Pkt2) to small header size (Pkt1) and send
+    return send(hdr, hLen, out.data(), have);
+}
 
-	Pkt1 *pkt1 = (Pkt1 *) (((uint8_t *) pkt2) + (sizeof(Pkt2) - sizeof(Pkt1)));
-	pkt1->op = 0x82;
-	pkt1->len = len + sizeof(pkt1->type);
-	pkt1->type = htons(type);
+// Decompresses a message into a buffer that's good until the next
+// message is decompressed.
 
-	if (!send(pkt1, len + sizeof(Pkt1))) {
-	    syslog(LOG_ERR, "ws: error sending binary data to client -- %m");
-	    done = true;
+bool WebSocketProtocolHandler::inflateMessage(uint8_t const* d, size_t n, uint8_t*& msg, size_t& msgLen)
+{
+    static uint8_t const tail[] = { 0x00, 0x00, 0xff, 0xff };
+    static uint8_t buf[MAX_PAYLOAD_SIZE];
+
+    if (!inflater) {
+	inflater = new z_stream();
+	if (Z_OK != inflateInit2(inflater, -MAX_WBITS)) {
+	    syslog(LOG_ERR, "ws: couldn't set up decompression");
+	    delete inflater;
+	    inflater = 0;
+	    return false;
 	}
-    } else {
+    }
 
-	// Send packet (Pkt2)
+    int64_t const start = cpuNanos();
 
-	pkt2->op = 0x82;
-	pkt2->_126 = 126;
-	pkt2->len = htons(len + sizeof(pkt2->type));
-	pkt2->type = htons(type);
+    inflater->next_out = buf;
+    inflater->avail_out = sizeof(buf);
 
-	if (!send(pkt2, len + sizeof(Pkt2))) {
-	    syslog(LOG_ERR, "ws: error sending binary data to client -- %m");
-	    done = true;
+    for (int ii = 0; ii < 2; ++ii) {
+	inflater->next_in = (Bytef*) (ii ? tail : d);
+	inflater->avail_in = ii ? sizeof(tail) : n;
+
+	int const res = inflate(inflater, Z_SYNC_FLUSH);
+
+	if ((res != Z_OK && res != Z_BUF_ERROR) || inflater->avail_in || !inflater->avail_out) {
+	    syslog(LOG_ERR, "ws: couldn't decompress message from client");
+	    return false;
 	}
     }
 
-    return done;
+    msg = buf;
+    msgLen = sizeof(buf) - inflater->avail_out;
+
+    inflateNs += cpuNanos() - start;
+    ++msgsInflated;
+    wireIn += n;
+    rawIn += msgLen;
+    return true;
 }
 
-bool WebSocketProtocolHandler::handleDataSocket()
-{
-    bool done = false;
-    uint8_t buf[64 * 1024];
-    Pkt2 *pkt2 = (Pkt2 *) buf;
+// Frames a binary message and hands the header and payload to send()
+// together, so the payload is only copied if it has to be queued.
 
-    ssize_t const len = recv(sData, pkt2->data, sizeof(buf) - sizeof(Pkt2), 0);
+bool WebSocketProtocolHandler::sendBinaryDataToClient(uint16_t type, void const* data, size_t len)
+{
+    bool sent;
+
+    if (deflateOn && !deflater && len + sizeof(type) >= DEFLATE_THRESHOLD) {
+	deflater = new z_stream();
+	if (Z_OK != deflateInit2(deflater, DEFLATE_LEVEL, Z_DEFLATED, -deflateBits, DEFLATE_MEMLEVEL,
+				 Z_DEFAULT_STRATEGY)) {
+	    syslog(LOG_ERR, "ws: couldn't set up compression; sending uncompressed");
+	    delete deflater;
+	    deflater = 0;
+	    deflateOn = false;
+	}
+    }
 
-    if (len < 0) {
-	syslog(LOG_ERR, "error receiving data -- %m");
-	done = true;
-    } else
-	done = sendBinaryDataToClient(pkt2, len, ACNETD_DATA);
+    if (deflater && len + sizeof(type) >= DEFLATE_THRESHOLD)
+	sent = sendCompressed(type, data, len);
+    else if (len + sizeof(type) <= 125) {
+	Pkt1 pkt1;
+
+	pkt1.op = 0x82;
+	pkt1.len = len + sizeof(pkt1.type);
+	pkt1.type = htons(type);
+	sent = send(&pkt1, sizeof(pkt1), data, len);
+    } else if (len + sizeof(type) <= 0xffff) {
+	Pkt2 pkt2;
+
+	pkt2.op = 0x82;
+	pkt2._126 = 126;
+	pkt2.len = htons(len + sizeof(pkt2.type));
+	pkt2.type = htons(type);
+	sent = send(&pkt2, sizeof(pkt2), data, len);
+    } else {
+	errno = EMSGSIZE;
+	sent = false;
+    }
 
-    return done;
+    if (!sent) {
+	syslog(LOG_ERR, "ws: error sending binary data to client -- %m");
+	return true;
+    }
+    return false;
 }
 
-bool WebSocketProtocolHandler::handleAcnetCommand(std::vector<uint8_t>& payload)
+bool WebSocketProtocolHandler::handleAcnetCommand(uint8_t* d, size_t n)
 {
     bool done = false;
     uint16_t type;
 
-    if (payload.size() >= sizeof(type)) {
-	type = ntohs(*(uint16_t *) payload.data());
-	uint16_t len = (uint16_t) payload.size() - sizeof(type);
+    if (n >= sizeof(type)) {
+	memcpy(&type, d, sizeof(type));
+	type = ntohs(type);
+	uint16_t len = (uint16_t) n - sizeof(type);
 
 	if (type == ACNETD_COMMAND && len >= sizeof(CommandHeader))
-	    done = handleClientCommand((CommandHeader *) (payload.data() + sizeof(type)), len);
+	    done = handleClientCommand((CommandHeader *) (d + sizeof(type)), len);
 	else
 	    done = true;
     } else
@@ -165,75 +314,126 @@ bool WebSocketProtocolHandler::handleAcnetCommand(std::vector<uint8_t>& payload)
     return done;
 }
 
-bool WebSocketProtocolHandler::handleClientSocket()
+// Handles each complete frame in the buffer and returns the number of
+// bytes used.
+
+size_t WebSocketProtocolHandler::handleFrames(uint8_t* d, size_t n, bool& done)
+{
+    size_t used = 0;
+
+    while (!done && enabledTraffic == AllTraffic && n - used >= 2) {
+	uint8_t const* const hdr = d + used;
+	size_t const avail = n - used;
+	bool const hasMask = hdr[1] & 0x80;
+	uint64_t len = hdr[1] & 0x7f;
+	size_t hLen = 2;
+
+	if (len == 126) {
+	    uint16_t tmp;
+
+	    if (avail < hLen + sizeof(tmp))
+		break;
+	    memcpy(&tmp, hdr + hLen, sizeof(tmp));
+	    len = uint64_t(ntohs(tmp));
+	    hLen += sizeof(tmp);
+	} else if (len == 127) {
+	    uint32_t tmp[2];
+
+	    if (avail < hLen + sizeof(tmp))
+		break;
+	    memcpy(tmp, hdr + hLen, sizeof(tmp));
+	    len = (int64_t(ntohl(tmp[0])) << 32) + int64_t(ntohl(tmp[1]));
+	    hLen += sizeof(tmp);
+	}
+
+	if (len > MAX_PAYLOAD_SIZE - payload.size()) {
+	    syslog(LOG_ERR, "ws: message too large from client");
+	    done = true;
+	    break;
+	}
+
+	size_t const maskLen = hasMask ? 4 : 0;
+
+	if (avail < hLen + maskLen + len)
+	    break;
+
+	uint8_t* const data = d + used + hLen + maskLen;
+
+	if (hasMask)
+	    unmaskPayload(data, len, data - maskLen);
+
+	used += hLen + maskLen + len;
+	++frames;
+	done = handleFrame(hdr[0], data, len);
+    }
+
+    return used;
+}
+
+// Handles one unmasked frame. A message that arrives in one frame is
+// handled where it lies in the read buffer; the frames of a
+// fragmented one are collected in 'payload' until the final one
+// arrives. Control frames may come between fragments and are handled
+// on their own.
+
+bool WebSocketProtocolHandler::handleFrame(uint8_t op, uint8_t* data, size_t len)
 {
     bool done = false;
-    uint8_t hdr[2];
-
-    if (readBytes(hdr, sizeof(hdr))) {
-	uint32_t mask;
-	uint64_t len;
-	bool hasMask = hdr[1] & 0x80;
-
-	if (readPayloadLength(hdr[1] & 0x7f, len) && readMask(hasMask, mask)) {
-	    uint8_t buf[MAX_PAYLOAD_SIZE];
-
-	    if (readBytes(buf, len)) {
-
-		// Save next frame of payload
-
-		if (hasMask)
-		    std::copy(buf, buf + len, decode_inserter(payload, mask));
-		else
-		    std::copy(buf, buf + len, std::back_inserter(payload));
-
-		// If final fragment, then send the payload on
-
-		if (hdr[0] & 0x80) {
-
-		    // Check message opcode
-
-		    switch (hdr[0] & 0x0f) {
-		     case 0x1:
-			{
-			    std::string s((char *) payload.data(), payload.size());
-			    done = handleAcnetCommand(payload);
-			}
-			break;
-
-		     case 0x2:
-			done = handleAcnetCommand(payload);
-			break;
-
-		     case 0x8:
-			{
-			    uint8_t msg[] = { 0x88, (uint8_t) payload.size() };
-			    send(msg, sizeof(msg));
-			    send(payload.data(), payload.size());
-			    done = true;
-			}
-			break;
-
-		     case 0x9:
-			{
-			    uint8_t pong[] = { 0x8a, (uint8_t) payload.size() };
-			    send(pong, sizeof(pong));
-			    send(payload.data(), payload.size());
-			}
-			break;
-
-		     case 0xa:
-			break;
-		    }
-
-		    payload.clear();
-		}
-	    } else
-		done = true;
-	} else
+
+    // RSV1 marks the first frame of a compressed message. It's only
+    // allowed there and only when compression was negotiated.
+
+    if ((op & 0x40) && (!deflateOn || (op & 0x08) || !(op & 0x0f))) {
+	syslog(LOG_ERR, "ws: unexpected compressed frame from client");
+	return true;
+    }
+
+    if (!(op & 0x08)) {
+	if (op & 0x0f)
+	    compressedMsg = op & 0x40;
+
+	if (!(op & 0x80) || !payload.empty()) {
+	    payload.insert(payload.end(), data, data + len);
+	    if (!(op & 0x80))
+		return false;
+
+	    data = payload.data();
+	    len = payload.size();
+	}
+
+	if (compressedMsg && !inflateMessage(data, len, data, len))
+	    return true;
+    }
+
+    // Check message opcode
+
+    switch (op & 0x0f) {
+     case 0x0:
+     case 0x1:
+     case 0x2:
+	done = handleAcnetCommand(data, len);
+	payload.clear();
+	break;
+
+     case 0x8:
+	{
+	    uint8_t msg[] = { 0x88, (uint8_t) len };
+	    send(msg, sizeof(msg), data, len);
+	    goodbye = true;
 	    done = true;
-    } else
-	done = true;
+	}
+	break;
+
+     case 0x9:
+	{
+	    uint8_t pong[] = { 0x8a, (uint8_t) len };
+	    send(pong, sizeof(pong), data, len);
+	}
+	break;
+
+     case 0xa:
+	break;
+    }
 
     return done;
 }
@@ -242,19 +442,26 @@ bool WebSocketProtocolHandler::handleCommandSocket()
 {
     bool done = false;
     uint8_t buf[64 * 1024];
-    Pkt2 *pkt2 = (Pkt2 *) buf;
 
-    ssize_t const len = recv(sCmd, pkt2->data, sizeof(buf) - sizeof(Pkt2), 0);
+    ssize_t const len = recv(sCmd, buf, sizeof(buf), 0);
 
     if (len < 0) {
 	syslog(LOG_ERR, "error receiving command ack -- %m");
 	done = true;
     } else
-	done = sendBinaryDataToClient(pkt2, len, ACNETD_ACK);
+	done = sendBinaryDataToClient(ACNETD_ACK, buf, len);
 
     return done;
 }
 
+// Frames a packet for the client, whether it came from acnetd's data
+// socket or from one of an in-process client's tasks.
+
+bool WebSocketProtocolHandler::sendPacket(uint16_t type, void const* d, size_t n)
+{
+    return !sendBinaryDataToClient(type, d, n);
+}
+
 bool WebSocketProtocolHandler::handleClientPing()
 {
     uint8_t ping[] = { 0x89, 0x00 };
@@ -267,6 +474,17 @@ bool WebSocketProtocolHandler::handleClientPing()
     return false;
 }
 
+void WebSocketProtocolHandler::logStats() const
+{
+    TcpClientProtocolHandler::logStats();
+    if (msgsDeflated)
+	syslog(LOG_NOTICE, "ws: compressed %" PRIu64 " messages, %" PRIu64 " bytes to %" PRIu64 " (%.1f%% saved), "
+	       "%.3f ms cpu", msgsDeflated, rawOut, wireOut, 100.0 * (1.0 - double(wireOut) / rawOut), deflateNs / 1e6);
+    if (msgsInflated)
+	syslog(LOG_NOTICE, "ws: decompressed %" PRIu64 " messages, %" PRIu64 " bytes to %" PRIu64 ", %.3f ms cpu",
+	       msgsInflated, wireIn, rawIn, inflateNs / 1e6);
+}
+
 void WebSocketProtocolHandler::handleShutdown()
 {
     uint8_t msg[] = { 0x88, 0x00 };
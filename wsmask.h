@@ -0,0 +1,40 @@
+#ifndef __WSMASK_H
+#define __WSMASK_H
+
+#include <cstring>
+#include <stdint.h>
+#include <stddef.h>
+
+// Unmasks a WebSocket payload in place. 'key' points to the four
+// bytes of the frame's masking key, in the order they arrived. The
+// payload is XORed a 64-bit word at a time, which the compiler is free
+// to vectorize; only the last few bytes are done one at a time. The
+// word loop starts at the payload's first byte, so the key lines up
+// with the word without regard to the buffer's alignment.
+
+inline void unmaskPayload(uint8_t* p, size_t n, uint8_t const* key)
+{
+    uint32_t k32;
+    memcpy(&k32, key, sizeof(k32));
+
+    uint64_t const k64 = (uint64_t(k32) << 32) | k32;
+    size_t ii = 0;
+
+    for (; ii + sizeof(k64) <= n; ii += sizeof(k64)) {
+	uint64_t w;
+
+	memcpy(&w, p + ii, sizeof(w));
+	w ^= k64;
+	memcpy(p + ii, &w, sizeof(w));
+    }
+
+    for (; ii < n; ++ii)
+	p[ii] ^= key[ii % sizeof(k32)];
+}
+
+#endif
+
+// Local Variables:
+// mode:c++
+// fill-column:125
+// End: